@@ -5,14 +5,14 @@
 #include "sys_logStatus.h"      // library for logging and debugging
 #include "sys_wifi.h"           // library to control the wifi connection
 // #include "time.h"           // NTP time sync library for knowing actual time - uses ezTime library, which needs flags to be configured (see time.h for more info)
-// #include "crypto.h"         // crypto control and configuration - don't need this, but may be useful if you are thinking abour TLS connections
+// #include "sys_crypto.h"     // crypto control and configuration - only needed once, to create the ECCX08 key for MQTT_TLS_ECCX08 (see sys_mqtt_tls.h)
 #include "home_assistant.h"    // home assistant module
 
 // the setup function runs once when you press reset or power the board
 void setup() {
   // light up for startup
   pinMode(LED_BUILTIN, OUTPUT);
-  digitalWrite(LED_BUILTIN, HIGH);
+  setLED(true);
 
   // [1] set up system modules
   setupLog(); 
@@ -25,12 +25,18 @@ void setup() {
   setupHA();   // setupHA will call setups for all subsystems
 
   // finish startup
-  digitalWrite(LED_BUILTIN, LOW);
+  setLED(false);
 }
 
 // the loop function runs over and over again forever
 void loop() {
-  connectToWiFi();    // check we still have the network up - its flakey on the Nano IoT 33
+  instrumentLoop();   // time each pass, see home_assistant_diagnostics.h
+  {
+    SpanTimerType span(instrumentation.wifi);
+    connectToWiFi();    // check we still have the network up - its flakey on the Nano IoT 33
+  }
 //  loopTime();         // do ezTime updates
   ha.loop();          // home assistant polling and event updates
+  loopSmartMeter();   // service the modbus bus, meter reads complete in the background
+  loopLED();          // play out any status or error blinks
 }
@@ -0,0 +1,402 @@
+// ----[HOST BENCHMARK]-----
+// runs the sketch on the host against simulated SDM120 meters and reports how it keeps up
+//
+// the whole sketch is built into this file, so everything it does is the real code: setup(),
+// loop(), the bus planner, the async client, readMeterAndUpdateHA() and the block decode in
+// onRegisterBlockRead(), the publish filters and ArduinoHA.  Only the layer underneath is
+// simulated (see shim/host_sim.h).  Each meter count in the sweep runs in a process of its own,
+// so it starts from a clean boot with nothing left over from the last one.
+//
+// the figures cover the time after the warm up, when the discovery burst is over:
+//   cycle ms     mean time for a bus cycle (from being started to the client going idle), and the worst.
+//                With several buses, from the first bus starting to the last one going idle
+//   ms/meter     the mean cycle shared out over the meters
+//   refresh s    mean time between completed reads of each meter
+//   bus %        how much of the time there was a frame on the wire, on the busiest bus
+//   reads, errs  completed meter reads, and requests that failed (timeouts, CRC, bad responses)
+//   pub/s        state publishes per second (discovery excluded), and the MQTT bytes per second
+//   bus B/s      modbus bytes per second, both directions
+//   heap peak    highest heap use since boot, and what it was once setup() had finished
+//   loop us      host CPU time for a pass of loop(), mean and worst.  Only for comparing builds
+//                on the same machine, it is nothing like the time on the board
+
+#ifdef METER_DUAL_CORE
+  #error "the host harness runs the sketch single core, build without METER_DUAL_CORE"
+#endif
+
+#include "../../HAIoT_SmartMeter.ino"
+#include "sim_sdm120.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct BenchOptionsType {
+  std::vector<int> meterCounts;
+  unsigned long seconds = 120;        // simulated time per run
+  unsigned long warmupSeconds = 20;   // left out of the figures
+  unsigned long loopGapUs = 500;      // simulated time between passes of loop()
+  int buses = 1;                      // the meters are shared out over this many buses
+  std::string framing = "8N1";
+  std::string fieldMask;              // per meter field mask (hex), empty for all fields
+  std::string timeoutMs;              // the client timeout, empty for the config default
+  SimMeterSettingsType meter;
+  unsigned int seed = 1;
+  bool verbose = false;
+  bool csv = false;
+};
+
+struct BenchResultType {
+  int meters = 0;
+  double cycleMs = 0;
+  double worstCycleMs = 0;
+  double refreshS = 0;
+  double busPercent = 0;
+  unsigned long reads = 0;
+  unsigned long errors = 0;
+  double publishesPerS = 0;
+  double mqttBytesPerS = 0;
+  double busBytesPerS = 0;
+  size_t heapPeak = 0;
+  size_t heapAfterSetup = 0;
+  double loopUs = 0;
+  double worstLoopUs = 0;
+};
+
+// ----[measuring]-----
+
+// the UART behind each of the sketch's buses, in modbusBuses order
+const uint8_t benchBusUarts[] = { 1, 2, 0 };
+
+struct BenchMeterWatchType {
+  uint32_t frames = 0;
+  unsigned long long lastFrameUs = 0;
+  unsigned long long intervalSumUs = 0;
+  unsigned long intervals = 0;
+};
+
+BenchResultType runBench(const BenchOptionsType& options, int meters) {
+  srand(options.seed);
+  // the meters go round the buses in turn, so meter 1 is on bus 1, meter 2 on bus 2 and so on
+  std::vector<SimModbusBusType> buses(options.buses);
+  std::string meterList;
+  for (int id = 1; id <= meters; id++) {
+    int b = (id - 1) % options.buses;
+    buses[b].add(id, options.meter);
+    meterList += (id > 1 ? "," : "") + std::to_string(id);
+    if (b > 0) {
+      meterList += "@" + std::to_string(b + 1);
+    }
+    if (!options.fieldMask.empty()) {
+      meterList += "::" + options.fieldMask;
+    }
+  }
+  for (int b = 0; b < options.buses; b++) {
+    buses[b].attach(benchBusUarts[b]);
+  }
+
+  hostSim.echoSerial = options.verbose;
+  hostSim.setPref("config", "meters", meterList.c_str());
+  hostSim.setPref("config", "dvc_id", "hostsim");
+  hostSim.setPref("config", "tz", "Europe/London");
+  hostSim.setPref("config", "mqtt_broker_ip", "10.0.0.2");
+  hostSim.setPref("config", "mb_baud", std::to_string(options.meter.baud).c_str());
+  hostSim.setPref("config", "mb_framing", options.framing.c_str());
+  if (!options.timeoutMs.empty()) {
+    hostSim.setPref("config", "mb_timeout", options.timeoutMs.c_str());
+  }
+  hostSim.setPref("secrets", "s_wifi_ssid", "ssid");
+  hostSim.setPref("secrets", "s_wifi_pwd", "password");
+  hostSim.setPref("secrets", "s_mqtt_user", "user");
+  hostSim.setPref("secrets", "s_mqtt_pwd", "password");
+
+  BenchResultType result;
+  result.meters = meters;
+  {
+    HostSimHeapScopeType counted(true);
+    setup();
+  }
+  result.heapAfterSetup = hostSim.stats.heapLiveBytes;
+
+  std::vector<BenchMeterWatchType> watch(ha.meterCount);
+  unsigned long long startUs = hostSim.nowUs;
+  unsigned long long warmEndUs = startUs + options.warmupSeconds * 1000000ULL;
+  unsigned long long endUs = warmEndUs + options.seconds * 1000000ULL;
+  HostSimStatsType atWarmEnd;
+  unsigned long long busyAtWarmEnd[HOST_SIM_UART_COUNT] = {};
+  bool warm = false;
+
+  bool cycleWasActive = false;
+  unsigned long long cycleStartUs = 0;
+  unsigned long long cycleSumUs = 0;
+  unsigned long long worstCycleUs = 0;
+  unsigned long cycles = 0;
+  unsigned long errorsAtWarmEnd = 0;
+  unsigned long readsAtWarmEnd = 0;
+  double loopSumUs = 0;
+  double worstLoopUs = 0;
+  unsigned long loops = 0;
+
+  while (hostSim.nowUs < endUs) {
+    if (!warm && (hostSim.nowUs >= warmEndUs)) {
+      warm = true;
+      atWarmEnd = hostSim.stats;
+      for (int p = 0; p < HOST_SIM_UART_COUNT; p++) {
+        busyAtWarmEnd[p] = hostSim.uarts[p].busyUs;
+      }
+      for (uint8_t m = 0; m < ha.meterCount; m++) {
+        const MeterHealthType& health = ha.meters[m].health;
+        errorsAtWarmEnd += health.timeouts + health.crcErrors + health.badResponses;
+        readsAtWarmEnd += ha.meters[m].snapshot.frames;
+      }
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    {
+      HostSimHeapScopeType counted(true);
+      loop();
+    }
+    double passUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+
+    if (warm) {
+      loopSumUs += passUs;
+      loops++;
+      if (passUs > worstLoopUs) {
+        worstLoopUs = passUs;
+      }
+    }
+
+    // bus cycles, from the sketch's own cycle state, a cycle is on while any bus is in one
+    bool cycleActive = false;
+    for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+      cycleActive |= meterCycles[b].active;
+    }
+    if (cycleActive && !cycleWasActive) {
+      cycleStartUs = hostSim.nowUs;
+    } else if (!cycleActive && cycleWasActive && warm) {
+      unsigned long long took = hostSim.nowUs - cycleStartUs;
+      cycleSumUs += took;
+      cycles++;
+      if (took > worstCycleUs) {
+        worstCycleUs = took;
+      }
+    }
+    cycleWasActive = cycleActive;
+
+    // completed reads, from each meter's snapshot
+    for (uint8_t m = 0; m < ha.meterCount; m++) {
+      BenchMeterWatchType& w = watch[m];
+      uint32_t frames = ha.meters[m].snapshot.frames;
+      if (frames != w.frames) {
+        if (warm && (w.lastFrameUs != 0)) {
+          w.intervalSumUs += hostSim.nowUs - w.lastFrameUs;
+          w.intervals++;
+        }
+        w.frames = frames;
+        w.lastFrameUs = hostSim.nowUs;
+      }
+    }
+
+    hostSim.advanceUs(options.loopGapUs);
+  }
+
+  double windowS = options.seconds;
+  const HostSimStatsType& stats = hostSim.stats;
+  result.cycleMs = cycles ? cycleSumUs / 1000.0 / cycles : 0;
+  result.worstCycleMs = worstCycleUs / 1000.0;
+  unsigned long long intervalSumUs = 0;
+  unsigned long intervals = 0;
+  for (const BenchMeterWatchType& w : watch) {
+    intervalSumUs += w.intervalSumUs;
+    intervals += w.intervals;
+  }
+  result.refreshS = intervals ? intervalSumUs / 1e6 / intervals : 0;
+  for (int p = 0; p < HOST_SIM_UART_COUNT; p++) {
+    double percent = 100.0 * (hostSim.uarts[p].busyUs - busyAtWarmEnd[p]) / (windowS * 1e6);
+    if (percent > result.busPercent) {
+      result.busPercent = percent;
+    }
+  }
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const MeterHealthType& health = ha.meters[m].health;
+    result.errors += health.timeouts + health.crcErrors + health.badResponses;
+    result.reads += ha.meters[m].snapshot.frames;
+  }
+  result.errors -= errorsAtWarmEnd;
+  result.reads -= readsAtWarmEnd;
+  result.publishesPerS = ((stats.publishes - stats.discoveryPublishes) - (atWarmEnd.publishes - atWarmEnd.discoveryPublishes)) / windowS;
+  result.mqttBytesPerS = (stats.mqttBytes - atWarmEnd.mqttBytes) / windowS;
+  result.busBytesPerS = ((stats.busBytesIn + stats.busBytesOut) - (atWarmEnd.busBytesIn + atWarmEnd.busBytesOut)) / windowS;
+  result.heapPeak = stats.heapPeakBytes;
+  result.loopUs = loops ? loopSumUs / loops : 0;
+  result.worstLoopUs = worstLoopUs;
+  return result;
+}
+
+// ----[reporting]-----
+
+void printHeader(const BenchOptionsType& options) {
+  if (options.csv) {
+    printf("meters,cycle_ms,worst_cycle_ms,ms_per_meter,refresh_s,bus_pct,reads,errors,pub_per_s,mqtt_bytes_per_s,bus_bytes_per_s,heap_peak,heap_after_setup,loop_us,worst_loop_us\n");
+    return;
+  }
+  printf("%d bus%s, %lu baud %s, latency %.0f+%.0fms, faults: timeout %.1f%% crc %.1f%% exception %.1f%%, %lus after %lus warm up\n\n",
+         options.buses, (options.buses > 1) ? "es" : "", options.meter.baud, options.framing.c_str(), options.meter.latencyMs, options.meter.jitterMs,
+         100 * options.meter.timeoutRate, 100 * options.meter.crcErrorRate, 100 * options.meter.exceptionRate,
+         options.seconds, options.warmupSeconds);
+  printf("meters  cycle ms (worst)  ms/meter  refresh s  bus %%   reads  errs   pub/s  mqtt B/s  bus B/s  heap peak (setup)  loop us (worst)\n");
+}
+
+void printResult(const BenchOptionsType& options, const BenchResultType& r) {
+  double perMeter = r.meters ? r.cycleMs / r.meters : 0;
+  if (options.csv) {
+    printf("%d,%.2f,%.2f,%.2f,%.3f,%.1f,%lu,%lu,%.2f,%.1f,%.1f,%zu,%zu,%.2f,%.2f\n", r.meters, r.cycleMs, r.worstCycleMs, perMeter,
+           r.refreshS, r.busPercent, r.reads, r.errors, r.publishesPerS, r.mqttBytesPerS, r.busBytesPerS, r.heapPeak,
+           r.heapAfterSetup, r.loopUs, r.worstLoopUs);
+    return;
+  }
+  printf("%6d  %8.1f (%6.1f)  %8.1f  %9.2f  %5.1f  %6lu  %4lu  %6.1f  %8.0f  %7.0f  %9zu (%5zu)  %7.2f (%6.1f)\n", r.meters, r.cycleMs,
+         r.worstCycleMs, perMeter, r.refreshS, r.busPercent, r.reads, r.errors, r.publishesPerS, r.mqttBytesPerS, r.busBytesPerS,
+         r.heapPeak, r.heapAfterSetup, r.loopUs, r.worstLoopUs);
+}
+
+// ----[options]-----
+
+void usage() {
+  printf("usage: host_bench [options]\n"
+         "  --meters LIST      meter counts to run, e.g. 1-16 or 1,4,16 (default 1-16)\n"
+         "  --buses N          share the meters out over N buses, 1 to %d (default 1)\n"
+         "  --seconds N        simulated seconds measured per run (default 120)\n"
+         "  --warmup N         simulated seconds before measuring starts (default 20)\n"
+         "  --baud N           line rate of the meters and the sketch (default 9600)\n"
+         "  --framing F        8N1, 8E1, 8O1 or 8N2 (default 8N1)\n"
+         "  --latency MS       meter response latency (default 30)\n"
+         "  --jitter MS        extra random latency, up to this (default 10)\n"
+         "  --timeouts PCT     requests that get no answer (default 0)\n"
+         "  --crc PCT          responses with a bad CRC (default 0)\n"
+         "  --exceptions PCT   requests that get an exception (default 0)\n"
+         "  --timeout-ms MS    the sketch's response timeout (default from the config)\n"
+         "  --fields HEX       field mask for every meter (default all)\n"
+         "  --loop-gap US      simulated time between passes of loop() (default 500)\n"
+         "  --seed N           seed for the jitter and the faults (default 1)\n"
+         "  --csv              machine readable output\n"
+         "  --verbose          show the sketch's log (use a single meter count)\n", MODBUS_MAX_BUSES);
+}
+
+bool parseMeterCounts(const char* text, std::vector<int>& counts) {
+  counts.clear();
+  std::string list(text);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    std::string item = list.substr(start, (end == std::string::npos) ? std::string::npos : end - start);
+    int from = 0;
+    int to = 0;
+    if (sscanf(item.c_str(), "%d-%d", &from, &to) == 2) {
+      for (int n = from; n <= to; n++) {
+        counts.push_back(n);
+      }
+    } else if (sscanf(item.c_str(), "%d", &from) == 1) {
+      counts.push_back(from);
+    } else {
+      return false;
+    }
+    if (end == std::string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  for (int n : counts) {
+    if ((n < 1) || (n > METER_POOL_SIZE)) {
+      return false;
+    }
+  }
+  return !counts.empty();
+}
+
+bool parseOptions(int argc, char** argv, BenchOptionsType& options) {
+  parseMeterCounts("1-16", options.meterCounts);
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    bool takesValue = true;
+    if (arg == "--csv") {
+      options.csv = true;
+      takesValue = false;
+    } else if (arg == "--verbose") {
+      options.verbose = true;
+      takesValue = false;
+    } else if (!value) {
+      return false;
+    } else if (arg == "--meters") {
+      if (!parseMeterCounts(value, options.meterCounts)) {
+        return false;
+      }
+    } else if (arg == "--buses") {
+      options.buses = atoi(value);
+    } else if (arg == "--seconds") {
+      options.seconds = strtoul(value, nullptr, 10);
+    } else if (arg == "--warmup") {
+      options.warmupSeconds = strtoul(value, nullptr, 10);
+    } else if (arg == "--baud") {
+      options.meter.baud = strtoul(value, nullptr, 10);
+    } else if (arg == "--framing") {
+      options.framing = value;
+    } else if (arg == "--latency") {
+      options.meter.latencyMs = atof(value);
+    } else if (arg == "--jitter") {
+      options.meter.jitterMs = atof(value);
+    } else if (arg == "--timeouts") {
+      options.meter.timeoutRate = atof(value) / 100;
+    } else if (arg == "--crc") {
+      options.meter.crcErrorRate = atof(value) / 100;
+    } else if (arg == "--exceptions") {
+      options.meter.exceptionRate = atof(value) / 100;
+    } else if (arg == "--timeout-ms") {
+      options.timeoutMs = value;
+    } else if (arg == "--fields") {
+      options.fieldMask = value;
+    } else if (arg == "--loop-gap") {
+      options.loopGapUs = strtoul(value, nullptr, 10);
+    } else if (arg == "--seed") {
+      options.seed = strtoul(value, nullptr, 10);
+    } else {
+      return false;
+    }
+    if (takesValue) {
+      i++;
+    }
+  }
+  return (options.seconds > 0) && (options.loopGapUs > 0) && (options.meter.baud > 0) && (options.buses >= 1)
+         && (options.buses <= MODBUS_MAX_BUSES);
+}
+
+int main(int argc, char** argv) {
+  BenchOptionsType options;
+  if (!parseOptions(argc, argv, options)) {
+    usage();
+    return 2;
+  }
+
+  printHeader(options);
+  int failed = 0;
+  for (int meters : options.meterCounts) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+      BenchResultType result = runBench(options, meters);
+      printResult(options, result);
+      fflush(stdout);
+      _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      printf("%6d  run failed (status %d)\n", meters, status);
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+}
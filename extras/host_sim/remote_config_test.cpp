@@ -0,0 +1,42 @@
+// ----[REMOTE CONFIG TEST]-----
+// checks the poll periods a remote config document is allowed to set, against the real
+// parsePollPeriods() out of the sketch.  Nothing is set up, the parser only needs the tables.
+// Exits non zero if any check fails, so it can sit in a script
+
+#include "../../HAIoT_SmartMeter.ino"
+
+#include <string>
+
+int failures = 0;
+
+void expectPoll(const char* value, bool accepted) {
+  RemoteConfigChangeType change;
+  bool ok = parsePollPeriods(value, change);
+  bool pass = (ok == accepted) && (ok == change.pollSet) && (ok == (change.error[0] == '\0'));
+  printf("%s poll=%s : %s%s\n", pass ? "pass" : "FAIL", value, ok ? "accepted" : "rejected ", change.error);
+  if (!pass) {
+    failures++;
+  }
+}
+
+int main() {
+  std::string powerLimit = std::to_string(ENERGY_MAX_POWER_PERIOD_MS);
+  std::string pastPowerLimit = std::to_string(ENERGY_MAX_POWER_PERIOD_MS + 1);
+  std::string heartbeat = std::to_string(METER_HEARTBEAT_MS);
+
+  expectPoll("default", true);
+  expectPoll("1000,30000,60000", true);
+  expectPoll((powerLimit + "," + heartbeat + "," + heartbeat).c_str(), true);
+
+  // the power samples would be too far apart for the energy integrator to join
+  expectPoll((pastPowerLimit + ",30000,60000").c_str(), false);
+  expectPoll(heartbeat.c_str(), false);           // a single period goes for every group, power included
+
+  // the other groups go up to the heartbeat
+  expectPoll(("1000," + std::to_string(METER_HEARTBEAT_MS + 1)).c_str(), false);
+  expectPoll("50,30000,60000", false);
+  expectPoll("fast", false);
+
+  printf("%d failed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+// host shim of the Arduino core, the clock is simulated (see host_sim.h)
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <cmath>
+#include <string>
+#include <algorithm>
+typedef uint8_t byte;
+typedef bool boolean;
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+#define LED_BUILTIN 13
+#define A0 17
+#define A1 18
+#define A2 19
+#define A3 20
+#define HEX 16
+#define DEC 10
+#define SERIAL_8N1 0x800001c
+#define SERIAL_8E1 0x800001e
+#define SERIAL_8O1 0x800001f
+#define SERIAL_8N2 0x800003c
+#define PROGMEM
+#define F(x) (reinterpret_cast<const __FlashStringHelper*>(x))
+class __FlashStringHelper;
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+void yield();
+void pinMode(uint8_t, uint8_t);
+void digitalWrite(uint8_t, uint8_t);
+int digitalRead(uint8_t);
+long random(long);
+long random(long, long);
+void randomSeed(unsigned long);
+char* dtostrf(double val, signed char width, unsigned char prec, char* s);
+void configTime(long gmtOffsetS, int daylightOffsetS, const char* server1, const char* server2 = nullptr, const char* server3 = nullptr);
+template<class T> T constrain_(T a, T l, T h) { return a < l ? l : (a > h ? h : a); }
+#define constrain(a,l,h) constrain_(a,l,h)
+#define bit(b) (1UL << (b))
+
+class String {
+public:
+  std::string s;
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const String& o) : s(o.s) {}
+  String(char c) : s(1, c) {}
+  String(int v, int base = 10) { char b[34]; if (base == 16) snprintf(b, sizeof b, "%x", v); else snprintf(b, sizeof b, "%d", v); s = b; }
+  String(unsigned int v, int base = 10) { char b[34]; snprintf(b, sizeof b, base == 16 ? "%x" : "%u", v); s = b; }
+  String(long v, int base = 10) { char b[34]; snprintf(b, sizeof b, base == 16 ? "%lx" : "%ld", v); s = b; }
+  String(unsigned long v, int base = 10) { char b[34]; snprintf(b, sizeof b, base == 16 ? "%lx" : "%lu", v); s = b; }
+  String(unsigned char v, int base = 10) : String((unsigned int)v, base) {}
+  String(float v, unsigned char d = 2) { char b[40]; snprintf(b, sizeof b, "%.*f", d, v); s = b; }
+  String(double v, unsigned char d = 2) { char b[40]; snprintf(b, sizeof b, "%.*f", d, v); s = b; }
+  String& operator=(const String& o) { s = o.s; return *this; }
+  String& operator=(const char* c) { s = c ? c : ""; return *this; }
+  String& operator+=(const String& o) { s += o.s; return *this; }
+  String& operator+=(const char* c) { s += c; return *this; }
+  String& operator+=(char c) { s += c; return *this; }
+  friend String operator+(const String& a, const String& b) { String r(a); r.s += b.s; return r; }
+  friend String operator+(const String& a, const char* b) { String r(a); r.s += b; return r; }
+  friend String operator+(const char* a, const String& b) { String r(a); r.s += b.s; return r; }
+  bool operator==(const String& o) const { return s == o.s; }
+  bool operator==(const char* c) const { return s == c; }
+  bool equalsIgnoreCase(const String& o) const { return strcasecmp(s.c_str(), o.s.c_str()) == 0; }
+  bool operator!=(const String& o) const { return s != o.s; }
+  bool operator!=(const char* c) const { return s != c; }
+  bool operator!() const { return s.empty(); }
+  const char* c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+  void toCharArray(char* buf, unsigned int len) const { if (!len) return; strncpy(buf, s.c_str(), len - 1); buf[len - 1] = 0; }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  void toLowerCase() { for (auto& c : s) c = tolower(c); }
+  void toUpperCase() { for (auto& c : s) c = toupper(c); }
+  void trim() { while (!s.empty() && isspace(s.back())) s.pop_back(); while (!s.empty() && isspace(s.front())) s.erase(0, 1); }
+  bool startsWith(const String& p) const { return s.compare(0, p.s.size(), p.s) == 0; }
+  int indexOf(char c, unsigned int from = 0) const { size_t r = s.find(c, from); return r == std::string::npos ? -1 : (int)r; }
+  int indexOf(const String& p, unsigned int from = 0) const { size_t r = s.find(p.s, from); return r == std::string::npos ? -1 : (int)r; }
+  String substring(unsigned int b) const { return b >= s.size() ? String() : String(s.substr(b).c_str()); }
+  String substring(unsigned int b, unsigned int e) const { if (e > s.size()) e = s.size(); return b >= e ? String() : String(s.substr(b, e - b).c_str()); }
+  char charAt(unsigned int i) const { return i < s.size() ? s[i] : 0; }
+  char operator[](unsigned int i) const { return charAt(i); }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* buf, size_t n) { size_t r = 0; while (n--) r += write(*buf++); return r; }
+  size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t print(const String& s) { return write(s.c_str()); }
+  size_t print(const char* s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(double v, int d = 2) { return print(String(v, (unsigned char)d)); }
+  size_t println() { return write("\r\n"); }
+  template<class T> size_t println(const T& v) { size_t r = print(v); return r + println(); }
+  template<class T> size_t println(const T& v, int b) { size_t r = print(v, b); return r + println(); }
+  size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() { return -1; }
+  virtual void flush() {}
+  void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream {
+public:
+  int port;
+  HardwareSerial(int p) : port(p) {}
+  void begin(unsigned long baud) { begin(baud, SERIAL_8N1); }
+  void begin(unsigned long baud, uint32_t config, int8_t rxPin = -1, int8_t txPin = -1);
+  void end() {}
+  void updateBaudRate(unsigned long baud);
+  int available() override;
+  int read() override;
+  size_t write(uint8_t) override;
+  using Print::write;
+  void flush() override {}
+  explicit operator bool() const;
+};
+extern HardwareSerial Serial;
+extern HardwareSerial Serial0;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+class Printable {};
+class IPAddress {
+public:
+  uint8_t b[4] = {0, 0, 0, 0};
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t c, uint8_t d, uint8_t e) { b[0] = a; b[1] = c; b[2] = d; b[3] = e; }
+  IPAddress(uint32_t v) { memcpy(b, &v, 4); }
+  operator uint32_t() const { uint32_t v; memcpy(&v, b, 4); return v; }
+  uint8_t operator[](int i) const { return b[i]; }
+  bool fromString(const char* s) { unsigned a, c, d, e; if (sscanf(s, "%u.%u.%u.%u", &a, &c, &d, &e) != 4) return false; b[0] = a; b[1] = c; b[2] = d; b[3] = e; return true; }
+  String toString() const { char t[16]; snprintf(t, sizeof t, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]); return String(t); }
+};
+#define INADDR_NONE IPAddress(0, 0, 0, 0)
+// the ESP32-S3 SoC caps the core pulls in with Arduino.h
+#define SOC_UART_NUM 3
+// freertos bits the ESP32 core pulls in with Arduino.h
+typedef int BaseType_t;
+typedef void* TaskHandle_t;
+#define pdPASS 1
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void*), const char*, uint32_t, void*, unsigned, TaskHandle_t*, int);
+void vTaskDelay(uint32_t);
@@ -0,0 +1,6 @@
+// host shim of ArduinoHA 2.x, only the parts the sketch uses
+#pragma once
+#include "ArduinoHADefines.h"
+#include "HADevice.h"
+#include "HAMqtt.h"
+#include "HASensor.h"
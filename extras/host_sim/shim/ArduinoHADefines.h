@@ -0,0 +1,3 @@
+// host shim of ArduinoHA 2.x
+#pragma once
+#define AHATOFSTR(x) F(x)
@@ -0,0 +1,23 @@
+// host shim of ArduinoRS485, bytes go straight through to Serial1 (see host_sim.h)
+#pragma once
+#include <Arduino.h>
+class RS485Class : public Stream {
+public:
+  RS485Class(HardwareSerial& hwSerial, int txPin, int dePin, int rePin);
+  virtual void begin(unsigned long baudrate);
+  virtual void begin(unsigned long baudrate, unsigned long config);
+  virtual void end();
+  int available() override;
+  int peek() override;
+  int read() override;
+  void flush() override;
+  size_t write(uint8_t b) override;
+  using Print::write;
+  void beginTransmission();
+  void endTransmission();
+  void receive();
+  void noReceive();
+  void setPins(int txPin, int dePin, int rePin);
+  void setDelays(int predelay, int postdelay);
+  HardwareSerial* _serial;
+};
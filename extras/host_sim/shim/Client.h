@@ -0,0 +1,12 @@
+// host shim of the Arduino core network client
+#pragma once
+#include <Arduino.h>
+class Client : public Stream {
+public:
+  virtual int connect(IPAddress ip, uint16_t port) = 0;
+  virtual int connect(const char* host, uint16_t port) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+  virtual operator bool() = 0;
+  using Print::write;
+};
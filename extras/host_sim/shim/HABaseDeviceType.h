@@ -0,0 +1,37 @@
+// host shim of ArduinoHA 2.x
+#pragma once
+#include <Arduino.h>
+#include "HAMqtt.h"
+#include "HASerializer.h"
+#include <string>
+class HABaseDeviceType {
+public:
+  enum NumberPrecision { PrecisionP0 = 0, PrecisionP1, PrecisionP2, PrecisionP3 };
+  HABaseDeviceType(const __FlashStringHelper* componentName, const char* uniqueId);
+  virtual ~HABaseDeviceType() {}
+  inline const char* uniqueId() const { return _uniqueId; }
+  inline const __FlashStringHelper* componentName() const { return _componentName; }
+  inline void setName(const char* name) { _name = name; }
+  inline const char* getName() const { return _name; }
+  inline void setObjectId(const char* objectId) { _objectId = objectId; }
+  virtual void setAvailability(bool online);
+  bool isAvailabilityConfigured() const;
+  bool isOnline() const;
+protected:
+  static HAMqtt* mqtt() { return HAMqtt::instance(); }
+  virtual void buildSerializer() {}
+  void destroySerializer();
+  virtual void onMqttConnected() = 0;
+  virtual void onMqttMessage(const char* topic, const uint8_t* payload, const uint16_t length) {}
+  void publishConfig();
+  std::string configPayload() const;
+  virtual std::string extraConfig() const { return std::string(); }
+  void publishAvailability();
+  bool publishOnDataTopic(const __FlashStringHelper* topic, const char* payload, bool retained = false, bool isProgmemData = false);
+  const __FlashStringHelper* const _componentName;
+  const char* _uniqueId;
+  const char* _name;
+  const char* _objectId;
+  HASerializer* _serializer;
+  friend class HAMqtt;
+};
@@ -0,0 +1,24 @@
+// host shim of ArduinoHA 2.x
+#pragma once
+#include <Arduino.h>
+class HASerializer;
+class HADevice {
+public:
+  HADevice();
+  bool setUniqueId(const byte* uniqueId, const uint16_t length);
+  const char* getUniqueId() const;
+  void setName(const char* name);
+  void setSoftwareVersion(const char* softwareVersion);
+  void setManufacturer(const char* manufacturer);
+  void setModel(const char* model);
+  void setConfigurationUrl(const char* url);
+  bool enableSharedAvailability();
+  bool isSharedAvailabilityEnabled() const;
+  void enableLastWill();
+  void enableExtendedUniqueIds();
+  bool isExtendedUniqueIdsEnabled() const;
+  void setAvailability(bool online);
+  bool isAvailable() const;
+  void publishAvailability() const;
+  const char* getAvailabilityTopic() const;
+};
@@ -0,0 +1,40 @@
+// host shim of ArduinoHA 2.x, publishes are counted rather than sent (see host_sim.h)
+#pragma once
+#include <Arduino.h>
+#include <Client.h>
+#include "HADevice.h"
+class HABaseDeviceType;
+class HAMqtt {
+public:
+  enum ConnectionState { StateConnecting = -5, StateDisconnected = -1, StateConnected = 0 };
+  static HAMqtt* instance();
+  HAMqtt(Client& netClient, HADevice& device, const uint8_t maxDevicesTypesNb = 6);
+  void setDiscoveryPrefix(const char* prefix);
+  const char* getDiscoveryPrefix() const;
+  void setDataPrefix(const char* prefix);
+  const char* getDataPrefix() const;
+  HADevice const* getDevice() const;
+  void onMessage(void (*callback)(const char* topic, const uint8_t* payload, uint16_t length));
+  void onConnected(void (*callback)());
+  void onDisconnected(void (*callback)());
+  void setBufferSize(uint16_t size);
+  bool begin(const IPAddress serverIp, const uint16_t serverPort, const char* username = nullptr, const char* password = nullptr);
+  bool begin(const IPAddress serverIp, const char* username = nullptr, const char* password = nullptr);
+  bool begin(const char* serverHostname, const uint16_t serverPort, const char* username = nullptr, const char* password = nullptr);
+  bool begin(const char* serverHostname, const char* username = nullptr, const char* password = nullptr);
+  bool disconnect();
+  void loop();
+  bool isConnected() const;
+  void setKeepAlive(uint16_t keepAlive);
+  void addDeviceType(HABaseDeviceType* deviceType);
+  bool publish(const char* topic, const char* payload, bool retained = false);
+  bool beginPublish(const char* topic, uint16_t payloadLength, bool retained = false);
+  void writePayload(const char* data, const uint16_t length);
+  void writePayload(const uint8_t* data, const uint16_t length);
+  void writePayload(const __FlashStringHelper* data);
+  bool endPublish();
+  bool subscribe(const char* topic);
+private:
+  Client* _client;
+  bool writePacket(uint8_t type, const char* topic, const char* payload, size_t payloadLength);
+};
@@ -0,0 +1,16 @@
+// host shim of ArduinoHA 2.x
+#pragma once
+#include <Arduino.h>
+class HANumeric {
+public:
+  HANumeric();
+  HANumeric(const float value, const uint8_t precision);
+  inline bool isSet() const { return _isSet; }
+  inline float toFloat() const { return _value; }
+  inline uint8_t getPrecision() const { return _precision; }
+  inline bool operator==(const HANumeric& o) const { return (_isSet == o._isSet) && (_value == o._value) && (_precision == o._precision); }
+private:
+  float _value;
+  uint8_t _precision;
+  bool _isSet;
+};
@@ -0,0 +1,39 @@
+// host shim of ArduinoHA 2.x, HASensor and HASensorNumber
+#pragma once
+#include "HABaseDeviceType.h"
+#include "HANumeric.h"
+class HASensor : public HABaseDeviceType {
+public:
+  HASensor(const char* uniqueId);
+  bool setValue(const char* value);
+  inline void setExpireAfter(uint16_t expireAfter) { (void)expireAfter; }
+  inline void setDeviceClass(const char* deviceClass) { _deviceClass = deviceClass; }
+  inline void setStateClass(const char* stateClass) { _stateClass = stateClass; }
+  inline void setForceUpdate(bool forceUpdate) { _forceUpdate = forceUpdate; }
+  inline void setIcon(const char* icon) { _icon = icon; }
+  inline void setUnitOfMeasurement(const char* unit) { _unitOfMeasurement = unit; }
+protected:
+  virtual void buildSerializer() override;
+  virtual void onMqttConnected() override;
+  virtual std::string extraConfig() const override;
+private:
+  const char* _deviceClass;
+  const char* _stateClass;
+  bool _forceUpdate;
+  const char* _icon;
+  const char* _unitOfMeasurement;
+};
+class HASensorNumber : public HASensor {
+public:
+  HASensorNumber(const char* uniqueId, const NumberPrecision precision = PrecisionP0);
+  bool setValue(const HANumeric& value, const bool force = false);
+  inline bool setValue(const float value, const bool force = false) { return setValue(HANumeric(value, _precision), force); }
+  inline void setCurrentValue(const HANumeric& value) { _currentValue = value; }
+  inline const HANumeric& getCurrentValue() const { return _currentValue; }
+protected:
+  virtual void onMqttConnected() override;
+private:
+  bool publishValue(const HANumeric& value);
+  const NumberPrecision _precision;
+  HANumeric _currentValue;
+};
@@ -0,0 +1,14 @@
+// host shim of ArduinoHA 2.x
+#pragma once
+#include <Arduino.h>
+class HABaseDeviceType;
+class HASerializer {
+public:
+  enum EntryType { UnknownEntryType = 0, PropertyEntryType, TopicEntryType, FlagEntryType };
+  enum FlagType { WithDevice = 1, WithAvailability, WithUniqueId };
+  enum PropertyValueType { UnknownPropertyValueType = 0, ConstCharPropertyValue, ProgmemPropertyValue, BoolPropertyType, NumberPropertyType, ArrayPropertyType };
+  HASerializer(HABaseDeviceType* deviceType, const uint8_t maxEntriesNb);
+  void set(const __FlashStringHelper* property, const void* value, PropertyValueType valueType = ConstCharPropertyValue);
+  void set(const FlagType flag);
+  void topic(const __FlashStringHelper* topic);
+};
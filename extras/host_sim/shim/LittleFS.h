@@ -0,0 +1,40 @@
+// host shim of LittleFS, backed by a directory on the host
+#pragma once
+#include <Arduino.h>
+#include <cstdio>
+#include <string>
+#include <sys/stat.h>
+#ifndef HOST_SIM_FS_ROOT
+  #define HOST_SIM_FS_ROOT "/tmp/host_sim_fs"
+#endif
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+class File {
+public:
+  FILE* f = nullptr;
+  File() {}
+  File(FILE* p) : f(p) {}
+  operator bool() const { return f != nullptr; }
+  size_t write(const uint8_t* b, size_t n) { return fwrite(b, 1, n, f); }
+  size_t read(uint8_t* b, size_t n) { return fread(b, 1, n, f); }
+  bool seek(uint32_t pos) { return fseek(f, pos, SEEK_SET) == 0; }
+  size_t position() { return ftell(f); }
+  size_t size() { long c = ftell(f); fseek(f, 0, SEEK_END); long s = ftell(f); fseek(f, c, SEEK_SET); return s; }
+  int available() { long c = ftell(f); return (int)(size() - c); }
+  void flush() { fflush(f); }
+  void close() { if (f) fclose(f); f = nullptr; }
+};
+class LittleFSFS {
+public:
+  bool begin(bool = false) { mkdir(HOST_SIM_FS_ROOT, 0755); return true; }
+  File open(const char* p, const char* m) { return File(fopen(path(p).c_str(), m[0] == 'r' ? "rb" : (m[0] == 'a' ? "ab" : "wb"))); }
+  bool remove(const char* p) { return ::remove(path(p).c_str()) == 0; }
+  bool rename(const char* from, const char* to) { return ::rename(path(from).c_str(), path(to).c_str()) == 0; }
+  bool exists(const char* p) { FILE* f = fopen(path(p).c_str(), "rb"); if (f) fclose(f); return f != nullptr; }
+  size_t totalBytes() { return 1024 * 1024; }
+  size_t usedBytes() { return 0; }
+private:
+  static std::string path(const char* p) { return std::string(HOST_SIM_FS_ROOT) + p; }
+};
+static LittleFSFS LittleFS;
@@ -0,0 +1,20 @@
+// host shim of the ESP32 Preferences (NVS) library, held in memory
+#pragma once
+#include <Arduino.h>
+#include <string>
+class Preferences {
+public:
+  bool begin(const char* ns, bool readOnly = false);
+  void end();
+  String getString(const char* key, const String defaultValue = String());
+  size_t putString(const char* key, const String value);
+  size_t putString(const char* key, const char* value) { return putString(key, String(value)); }
+  uint32_t getUInt(const char* key, uint32_t defaultValue = 0);
+  size_t putUInt(const char* key, uint32_t value);
+  size_t getBytes(const char* key, void* buf, size_t maxLen);
+  size_t putBytes(const char* key, const void* value, size_t len);
+  bool isKey(const char* key);
+  bool remove(const char* key);
+private:
+  std::string ns;
+};
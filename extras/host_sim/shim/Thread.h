@@ -0,0 +1,22 @@
+// host shim of ArduinoThread
+#pragma once
+#include <Arduino.h>
+class Thread {
+protected:
+  unsigned long interval;
+  unsigned long last_run;
+  unsigned long _cached_next_run;
+  void runned(unsigned long time);
+  void runned() { runned(millis()); }
+  void (*_onRun)(void);
+public:
+  bool enabled;
+  int ThreadID;
+  Thread(void (*callback)(void) = NULL, unsigned long _interval = 0);
+  virtual ~Thread() {}
+  virtual void setInterval(unsigned long _interval);
+  virtual bool shouldRun(unsigned long time);
+  bool shouldRun() { return shouldRun(millis()); }
+  void onRun(void (*callback)(void));
+  virtual void run();
+};
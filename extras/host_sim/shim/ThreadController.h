@@ -0,0 +1,18 @@
+// host shim of ArduinoThread
+#pragma once
+#include "Thread.h"
+#define MAX_THREADS 15
+class ThreadController : public Thread {
+protected:
+  Thread* thread[MAX_THREADS];
+  int cached_size;
+public:
+  ThreadController(unsigned long _interval = 0);
+  void run() override;
+  bool add(Thread* _thread);
+  void remove(int _id);
+  void remove(Thread* _thread);
+  void clear();
+  int size(bool cached = true);
+  Thread* get(int index);
+};
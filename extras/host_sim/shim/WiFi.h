@@ -0,0 +1,54 @@
+// host shim of the ESP32 WiFi library, always connected unless the harness takes it down
+#pragma once
+#include <Arduino.h>
+#include <Client.h>
+enum wl_status_t { WL_NO_SHIELD = 255, WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_SCAN_COMPLETED = 2, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4, WL_CONNECTION_LOST = 5, WL_DISCONNECTED = 6 };
+typedef int arduino_event_id_t;
+#define ARDUINO_EVENT_WIFI_STA_GOT_IP 7
+#define ARDUINO_EVENT_WIFI_STA_DISCONNECTED 5
+typedef union { struct { uint8_t reason; } wifi_sta_disconnected; } arduino_event_info_t;
+typedef void (*WiFiEventFuncCb)(arduino_event_id_t event, arduino_event_info_t info);
+class WiFiClass {
+public:
+  wl_status_t status();
+  wl_status_t begin(const char* ssid, const char* pass, int32_t channel = 0, const uint8_t* bssid = nullptr, bool connect = true);
+  uint8_t waitForConnectResult(unsigned long timeoutLength = 60000);
+  bool setHostname(const char*);
+  uint8_t* macAddress(uint8_t* mac);
+  uint8_t* BSSID();
+  int32_t channel();
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(uint8_t i = 0);
+  bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress());
+  bool disconnect(bool wifioff = false, bool eraseap = false);
+  bool setAutoReconnect(bool);
+  bool mode(int);
+  int onEvent(WiFiEventFuncCb cb, arduino_event_id_t event = 0);
+  int8_t RSSI();
+};
+extern WiFiClass WiFi;
+#define WIFI_STA 1
+class WiFiClient : public Client {
+public:
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char* host, uint16_t port) override;
+  uint8_t connected() override;
+  void stop() override;
+  operator bool() override { return connected(); }
+  int available() override;
+  int read() override;
+  size_t write(uint8_t) override;
+  size_t write(const uint8_t* buf, size_t n) override;
+  using Print::write;
+  bool open = false;      // connected by connect(), a client no one is on the other end of otherwise
+};
+class WiFiServer {
+public:
+  WiFiServer(uint16_t port);
+  void begin();
+  void end();
+  WiFiClient available();
+  WiFiClient accept();
+};
@@ -0,0 +1,289 @@
+// host implementation of the Arduino core and the board libraries that sit close to it: the
+// clock, the serial ports and the RS485 wire, Preferences, the ESP system calls, ArduinoThread,
+// and a counting allocator for the heap figures
+#include <Arduino.h>
+#include <ArduinoRS485.h>
+#include <Preferences.h>
+#include <Thread.h>
+#include <ThreadController.h>
+#include <esp_system.h>
+#include "host_sim.h"
+#include <cstdarg>
+#include <deque>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+HostSimType hostSim;
+
+// ----[clock]-----
+
+unsigned long millis() { hostSim.nowUs += 1; return hostSim.nowUs / 1000; }
+unsigned long micros() { hostSim.nowUs += 1; return hostSim.nowUs; }
+void delay(unsigned long ms) { hostSim.nowUs += ms * 1000ULL; }
+void delayMicroseconds(unsigned int us) { hostSim.nowUs += us; }
+void yield() {}
+
+static int pins[64];
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t p, uint8_t v) { pins[p & 63] = v; }
+int digitalRead(uint8_t p) { return pins[p & 63]; }
+long random(long m) { return m ? rand() % m : 0; }
+long random(long a, long b) { return a + random(b - a); }
+void randomSeed(unsigned long s) { srand(s); }
+char* dtostrf(double v, signed char w, unsigned char p, char* s) { sprintf(s, "%*.*f", w, p, v); return s; }
+// the host clock is already set, time() is the real time
+void configTime(long, int, const char*, const char*, const char*) {}
+
+// the sketch builds single core on the host, the acquisition task can't be run
+BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*, unsigned, TaskHandle_t*, int) { return 0; }
+void vTaskDelay(uint32_t ticks) { hostSim.nowUs += ticks * 1000ULL; }
+
+// ----[heap]-----
+// every allocation carries its size in front of it, and whether it was counted, so the live
+// total can be kept
+
+static const size_t HEAP_HEADER = 16;
+
+void* operator new(size_t size) {
+  unsigned char* block = static_cast<unsigned char*>(malloc(size + HEAP_HEADER));
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  bool counted = hostSim.heapPaused <= 0;
+  reinterpret_cast<size_t*>(block)[0] = size;
+  reinterpret_cast<size_t*>(block)[1] = counted;
+  if (!counted) {
+    return block + HEAP_HEADER;
+  }
+  hostSim.stats.heapAllocations++;
+  hostSim.stats.heapLiveBytes += size;
+  if (hostSim.stats.heapLiveBytes > hostSim.stats.heapPeakBytes) {
+    hostSim.stats.heapPeakBytes = hostSim.stats.heapLiveBytes;
+  }
+  return block + HEAP_HEADER;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept {
+  if (!p) {
+    return;
+  }
+  unsigned char* block = static_cast<unsigned char*>(p) - HEAP_HEADER;
+  if (reinterpret_cast<size_t*>(block)[1]) {
+    hostSim.stats.heapLiveBytes -= reinterpret_cast<size_t*>(block)[0];
+  }
+  free(block);
+}
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+uint64_t EspClass::getEfuseMac() { return 0xA1B2C3D4E5F6ULL; }
+uint32_t EspClass::getFreeHeap() { return hostSim.heapBytes - hostSim.stats.heapLiveBytes; }
+uint32_t EspClass::getMinFreeHeap() { return hostSim.heapBytes - hostSim.stats.heapPeakBytes; }
+uint32_t EspClass::getCycleCount() { return (uint32_t)(hostSim.nowUs * 240); }
+uint32_t EspClass::getCpuFreqMHz() { return 240; }
+EspClass ESP;
+
+// ----[serial ports]-----
+// Serial is the log, Serial0 to Serial2 are the RS485 side: what the sketch writes is held
+// until the transmission ends, and bytes for it to read are queued with the time they arrive
+
+struct WireByteType {
+  unsigned long long atUs;
+  uint8_t value;
+};
+struct UartWireType {
+  std::deque<WireByteType> inFlight;
+  std::deque<uint8_t> received;
+  std::vector<uint8_t> sending;
+};
+static UartWireType uartWires[HOST_SIM_UART_COUNT];
+
+static bool isUart(int port) {
+  return (port >= 0) && (port < HOST_SIM_UART_COUNT);
+}
+
+unsigned long HostSimUartType::charUs() const {
+  unsigned long rate = this->baud ? this->baud : 9600;
+  return (this->bitsPerChar * 1000000UL + rate - 1) / rate;
+}
+
+void HostSimType::deliverByte(uint8_t port, unsigned long long atUs, uint8_t value) {
+  HostSimHeapScopeType uncounted(false);
+  uartWires[port].inFlight.push_back({ atUs, value });
+  this->stats.busBytesIn++;
+  this->stats.busBusyUs += this->uarts[port].charUs();
+  this->uarts[port].busyUs += this->uarts[port].charUs();
+}
+
+size_t HostSimType::bytesInFlight() const {
+  size_t n = 0;
+  for (const UartWireType& wire : uartWires) {
+    n += wire.inFlight.size();
+  }
+  return n;
+}
+
+static void receiveDueBytes(UartWireType& wire) {
+  HostSimHeapScopeType uncounted(false);
+  while (!wire.inFlight.empty() && (wire.inFlight.front().atUs <= hostSim.nowUs)) {
+    wire.received.push_back(wire.inFlight.front().value);
+    wire.inFlight.pop_front();
+  }
+}
+
+size_t Print::printf(const char* fmt, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+  write(buffer);
+  return n;
+}
+
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t, int8_t) {
+  if (!isUart(this->port)) {
+    return;
+  }
+  hostSim.uarts[this->port].baud = baud;
+  hostSim.uarts[this->port].bitsPerChar = (config == SERIAL_8N1) ? 10 : 11;    // a parity or second stop bit
+}
+void HardwareSerial::updateBaudRate(unsigned long baud) {
+  if (isUart(this->port)) {
+    hostSim.uarts[this->port].baud = baud;
+  }
+}
+int HardwareSerial::available() {
+  if (!isUart(this->port)) {
+    return 0;
+  }
+  receiveDueBytes(uartWires[this->port]);
+  return (int)uartWires[this->port].received.size();
+}
+int HardwareSerial::read() {
+  if (!isUart(this->port) || (available() == 0)) {
+    return -1;
+  }
+  int c = uartWires[this->port].received.front();
+  uartWires[this->port].received.pop_front();
+  return c;
+}
+size_t HardwareSerial::write(uint8_t c) {
+  if (this->port == HOST_SIM_USB_PORT) {
+    if (hostSim.echoSerial) {
+      putchar(c);
+    }
+  } else if (isUart(this->port)) {
+    HostSimHeapScopeType uncounted(false);
+    uartWires[this->port].sending.push_back(c);
+  }
+  return 1;
+}
+HardwareSerial::operator bool() const { return (this->port == HOST_SIM_USB_PORT) ? hostSim.usbHost : true; }
+HardwareSerial Serial(HOST_SIM_USB_PORT), Serial0(0), Serial1(1), Serial2(2);
+
+bool tud_mounted() { return hostSim.usbHost; }
+
+// ----[RS485]-----
+
+RS485Class::RS485Class(HardwareSerial& s, int, int, int) : _serial(&s) {}
+void RS485Class::begin(unsigned long baud) { _serial->begin(baud); }
+void RS485Class::begin(unsigned long baud, unsigned long config) { _serial->begin(baud, config); }
+void RS485Class::end() {}
+int RS485Class::available() { return _serial->available(); }
+int RS485Class::peek() { return -1; }
+int RS485Class::read() { return _serial->read(); }
+void RS485Class::flush() {}
+size_t RS485Class::write(uint8_t b) { return _serial->write(b); }
+void RS485Class::beginTransmission() { uartWires[_serial->port].sending.clear(); }
+// the UART is flushed before the driver is turned round, so the caller waits out the frame
+void RS485Class::endTransmission() {
+  HostSimHeapScopeType uncounted(false);
+  HostSimUartType& uart = hostSim.uarts[_serial->port];
+  std::vector<uint8_t> frame;
+  frame.swap(uartWires[_serial->port].sending);
+  unsigned long long frameUs = (unsigned long long)frame.size() * uart.charUs();
+  hostSim.nowUs += frameUs;
+  hostSim.stats.busFramesOut++;
+  hostSim.stats.busBytesOut += frame.size();
+  hostSim.stats.busBusyUs += frameUs;
+  uart.busyUs += frameUs;
+  if (uart.onBusFrame) {
+    uart.onBusFrame(frame.data(), frame.size(), hostSim.nowUs);
+  }
+}
+void RS485Class::receive() {}
+void RS485Class::noReceive() {}
+void RS485Class::setPins(int, int, int) {}
+void RS485Class::setDelays(int, int) {}
+
+// ----[Preferences]-----
+
+static std::map<std::string, std::string>& preferenceStore() {
+  static std::map<std::string, std::string> store;
+  return store;
+}
+static std::string preferenceKey(const std::string& ns, const char* key) {
+  return ns + "/" + key;
+}
+
+bool Preferences::begin(const char* ns, bool) { HostSimHeapScopeType uncounted(false); this->ns = ns; return true; }
+void Preferences::end() {}
+String Preferences::getString(const char* k, const String d) {
+  HostSimHeapScopeType uncounted(false);
+  auto it = preferenceStore().find(preferenceKey(this->ns, k));
+  return (it == preferenceStore().end()) ? d : String(it->second.c_str());
+}
+size_t Preferences::putString(const char* k, const String v) { HostSimHeapScopeType uncounted(false); preferenceStore()[preferenceKey(this->ns, k)] = v.s; return v.length(); }
+uint32_t Preferences::getUInt(const char* k, uint32_t d) {
+  HostSimHeapScopeType uncounted(false);
+  auto it = preferenceStore().find(preferenceKey(this->ns, k));
+  return (it == preferenceStore().end()) ? d : strtoul(it->second.c_str(), nullptr, 10);
+}
+size_t Preferences::putUInt(const char* k, uint32_t v) { HostSimHeapScopeType uncounted(false); preferenceStore()[preferenceKey(this->ns, k)] = std::to_string(v); return 4; }
+size_t Preferences::getBytes(const char* k, void* b, size_t m) {
+  HostSimHeapScopeType uncounted(false);
+  auto it = preferenceStore().find(preferenceKey(this->ns, k));
+  if (it == preferenceStore().end()) {
+    return 0;
+  }
+  size_t n = (m < it->second.size()) ? m : it->second.size();
+  memcpy(b, it->second.data(), n);
+  return n;
+}
+size_t Preferences::putBytes(const char* k, const void* v, size_t l) { HostSimHeapScopeType uncounted(false); preferenceStore()[preferenceKey(this->ns, k)] = std::string((const char*)v, l); return l; }
+bool Preferences::isKey(const char* k) { HostSimHeapScopeType uncounted(false); return preferenceStore().count(preferenceKey(this->ns, k)) > 0; }
+bool Preferences::remove(const char* k) { HostSimHeapScopeType uncounted(false); return preferenceStore().erase(preferenceKey(this->ns, k)) > 0; }
+
+void HostSimType::setPref(const char* ns, const char* key, const char* value) {
+  preferenceStore()[preferenceKey(ns, key)] = value;
+}
+
+// ----[ArduinoThread]-----
+
+Thread::Thread(void (*cb)(void), unsigned long iv) : interval(iv), last_run(0), _cached_next_run(iv), _onRun(cb), enabled(true), ThreadID((int)(intptr_t)this) {}
+void Thread::runned(unsigned long t) { last_run = t; _cached_next_run = t + interval; }
+void Thread::setInterval(unsigned long iv) { interval = iv; _cached_next_run = last_run + iv; }
+bool Thread::shouldRun(unsigned long t) { return enabled && ((long)(t - _cached_next_run) >= 0); }
+void Thread::onRun(void (*cb)(void)) { _onRun = cb; }
+void Thread::run() { if (_onRun) _onRun(); runned(); }
+
+ThreadController::ThreadController(unsigned long iv) : Thread(nullptr, iv), cached_size(0) { for (auto& t : thread) t = nullptr; }
+void ThreadController::run() {
+  unsigned long t = millis();
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (thread[i] && thread[i]->shouldRun(t)) {
+      thread[i]->run();
+    }
+  }
+  runned();
+}
+bool ThreadController::add(Thread* th) { for (auto& t : thread) if (!t) { t = th; cached_size++; return true; } return false; }
+void ThreadController::remove(int) {}
+void ThreadController::remove(Thread* th) { for (auto& t : thread) if (t == th) { t = nullptr; cached_size--; } }
+void ThreadController::clear() { for (auto& t : thread) t = nullptr; cached_size = 0; }
+int ThreadController::size(bool) { return cached_size; }
+Thread* ThreadController::get(int i) { return thread[i]; }
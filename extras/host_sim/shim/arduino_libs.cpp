@@ -0,0 +1,339 @@
+// host implementation of the network side: WiFi and WiFiClient, and the parts of ArduinoHA the
+// sketch uses.  HAMqtt writes each publish to its client as an MQTT PUBLISH packet, so the bytes
+// WiFiClient counts are the bytes that would have gone to the broker (less TCP/IP overhead)
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ArduinoHA.h>
+#include "host_sim.h"
+#include <string>
+#include <vector>
+
+// ----[WiFi]-----
+
+static uint8_t simBSSID[6] = { 1, 2, 3, 4, 5, 6 };
+static WiFiEventFuncCb wifiEventCallbacks[8];
+static arduino_event_id_t wifiEventIds[8];
+static int wifiEventCount = 0;
+
+static void fireWiFiEvent(arduino_event_id_t event) {
+  arduino_event_info_t info;
+  info.wifi_sta_disconnected.reason = 201;    // no access point found
+  for (int i = 0; i < wifiEventCount; i++) {
+    if (wifiEventIds[i] == event) {
+      wifiEventCallbacks[i](event, info);
+    }
+  }
+}
+
+wl_status_t WiFiClass::status() { return hostSim.online ? WL_CONNECTED : WL_DISCONNECTED; }
+wl_status_t WiFiClass::begin(const char*, const char*, int32_t, const uint8_t*, bool) { return status(); }
+uint8_t WiFiClass::waitForConnectResult(unsigned long) { return status(); }
+bool WiFiClass::setHostname(const char*) { return true; }
+uint8_t* WiFiClass::macAddress(uint8_t* m) { for (int i = 0; i < 6; i++) m[i] = 0x10 + i; return m; }
+uint8_t* WiFiClass::BSSID() { return simBSSID; }
+int32_t WiFiClass::channel() { return 6; }
+IPAddress WiFiClass::localIP() { return IPAddress(192, 168, 1, 50); }
+IPAddress WiFiClass::gatewayIP() { return IPAddress(192, 168, 1, 1); }
+IPAddress WiFiClass::subnetMask() { return IPAddress(255, 255, 255, 0); }
+IPAddress WiFiClass::dnsIP(uint8_t) { return IPAddress(192, 168, 1, 1); }
+bool WiFiClass::config(IPAddress, IPAddress, IPAddress, IPAddress) { return true; }
+bool WiFiClass::disconnect(bool, bool) { return true; }
+bool WiFiClass::setAutoReconnect(bool) { return true; }
+bool WiFiClass::mode(int) { return true; }
+int WiFiClass::onEvent(WiFiEventFuncCb cb, arduino_event_id_t e) {
+  if (wifiEventCount < 8) {
+    wifiEventIds[wifiEventCount] = e;
+    wifiEventCallbacks[wifiEventCount++] = cb;
+  }
+  return wifiEventCount;
+}
+int8_t WiFiClass::RSSI() { return -60; }
+WiFiClass WiFi;
+
+void HostSimType::setOnline(bool up) {
+  bool was = this->online;
+  this->online = up;
+  if (was && !up) {
+    fireWiFiEvent(ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+  } else if (!was && up) {
+    fireWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  }
+}
+
+int WiFiClient::connect(IPAddress, uint16_t) { this->open = hostSim.online; return this->open; }
+int WiFiClient::connect(const char*, uint16_t) { this->open = hostSim.online; return this->open; }
+uint8_t WiFiClient::connected() { return this->open && hostSim.online; }
+void WiFiClient::stop() { this->open = false; }
+int WiFiClient::available() { return 0; }
+int WiFiClient::read() { return -1; }
+size_t WiFiClient::write(uint8_t) { hostSim.stats.mqttBytes++; return 1; }
+size_t WiFiClient::write(const uint8_t*, size_t n) { hostSim.stats.mqttBytes += n; return n; }
+WiFiServer::WiFiServer(uint16_t) {}
+void WiFiServer::begin() {}
+void WiFiServer::end() {}
+// nothing on the network connects to the sketch
+WiFiClient WiFiServer::available() { return WiFiClient(); }
+WiFiClient WiFiServer::accept() { return WiFiClient(); }
+
+// ----[ArduinoHA device]-----
+
+static const char* deviceUniqueId = "101112131415";
+static const char* deviceName = "";
+static const char* deviceSoftware = "";
+static const char* deviceManufacturer = "";
+static const char* deviceModel = "";
+
+HADevice::HADevice() {}
+bool HADevice::setUniqueId(const byte*, const uint16_t) { return true; }
+const char* HADevice::getUniqueId() const { return deviceUniqueId; }
+void HADevice::setName(const char* name) { deviceName = name; }
+void HADevice::setSoftwareVersion(const char* version) { deviceSoftware = version; }
+void HADevice::setManufacturer(const char* manufacturer) { deviceManufacturer = manufacturer; }
+void HADevice::setModel(const char* model) { deviceModel = model; }
+void HADevice::setConfigurationUrl(const char*) {}
+bool HADevice::enableSharedAvailability() { return true; }
+bool HADevice::isSharedAvailabilityEnabled() const { return true; }
+void HADevice::enableLastWill() {}
+void HADevice::enableExtendedUniqueIds() {}
+bool HADevice::isExtendedUniqueIdsEnabled() const { return true; }
+void HADevice::setAvailability(bool) {}
+bool HADevice::isAvailable() const { return true; }
+void HADevice::publishAvailability() const {}
+const char* HADevice::getAvailabilityTopic() const { return "aha/101112131415/avty_t"; }
+
+// ----[ArduinoHA mqtt]-----
+
+static HAMqtt* mqttInstance = nullptr;
+static HADevice mqttDevice;
+static std::vector<HABaseDeviceType*> deviceTypes;
+static uint8_t maxDeviceTypes = 0;
+static void (*onConnectedCallback)() = nullptr;
+static void (*onMessageCallback)(const char*, const uint8_t*, uint16_t) = nullptr;
+static bool announced = false;
+static std::vector<std::string> subscriptions;
+static std::string pendingTopic;
+static std::string pendingPayload;
+static bool pendingRetain = false;
+
+HAMqtt* HAMqtt::instance() { return mqttInstance; }
+HAMqtt::HAMqtt(Client& client, HADevice&, const uint8_t n) : _client(&client) { mqttInstance = this; maxDeviceTypes = n; }
+void HAMqtt::setDiscoveryPrefix(const char*) {}
+const char* HAMqtt::getDiscoveryPrefix() const { return "homeassistant"; }
+void HAMqtt::setDataPrefix(const char*) {}
+const char* HAMqtt::getDataPrefix() const { return "aha"; }
+HADevice const* HAMqtt::getDevice() const { return &mqttDevice; }
+void HAMqtt::onMessage(void (*cb)(const char*, const uint8_t*, uint16_t)) { onMessageCallback = cb; }
+void HAMqtt::onConnected(void (*cb)()) { onConnectedCallback = cb; }
+void HAMqtt::onDisconnected(void (*)()) {}
+void HAMqtt::setBufferSize(uint16_t) {}
+bool HAMqtt::begin(const IPAddress, const uint16_t, const char*, const char*) { return true; }
+bool HAMqtt::begin(const IPAddress, const char*, const char*) { return true; }
+bool HAMqtt::begin(const char*, const uint16_t, const char*, const char*) { return true; }
+bool HAMqtt::begin(const char*, const char*, const char*) { return true; }
+bool HAMqtt::disconnect() { return true; }
+void HAMqtt::setKeepAlive(uint16_t) {}
+bool HAMqtt::isConnected() const { return hostSim.online && announced; }
+void HAMqtt::addDeviceType(HABaseDeviceType* d) {
+  HostSimHeapScopeType uncounted(false);
+  if (deviceTypes.size() < maxDeviceTypes) {
+    deviceTypes.push_back(d);
+  }
+}
+
+// connects as soon as the network is up, as ArduinoHA does: the entities first, then the callback
+void HAMqtt::loop() {
+  if (!hostSim.online) {
+    announced = false;
+    return;
+  }
+  if (!announced) {
+    announced = true;
+    {
+      HostSimHeapScopeType uncounted(false);
+      subscriptions.clear();
+    }
+    for (HABaseDeviceType* d : deviceTypes) {
+      d->onMqttConnected();
+    }
+    if (onConnectedCallback) {
+      onConnectedCallback();
+    }
+  }
+}
+
+// an MQTT packet: fixed header, remaining length (variable length encoded), topic, payload
+bool HAMqtt::writePacket(uint8_t type, const char* topic, const char* payload, size_t payloadLength) {
+  HostSimHeapScopeType uncounted(false);
+  size_t topicLength = strlen(topic);
+  size_t remaining = 2 + topicLength + payloadLength;
+  uint8_t header[5];
+  size_t headerLength = 0;
+  header[headerLength++] = type;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    header[headerLength++] = digit | (remaining ? 0x80 : 0);
+  } while (remaining && (headerLength < sizeof(header)));
+  uint8_t length[2] = { (uint8_t)(topicLength >> 8), (uint8_t)(topicLength & 0xFF) };
+  this->_client->write(header, headerLength);
+  this->_client->write(length, 2);
+  this->_client->write((const uint8_t*)topic, topicLength);
+  if (payloadLength) {
+    this->_client->write((const uint8_t*)payload, payloadLength);
+  }
+  return true;
+}
+
+bool HAMqtt::publish(const char* topic, const char* payload, bool retained) {
+  HostSimHeapScopeType uncounted(false);
+  if (!isConnected()) {
+    return false;
+  }
+  hostSim.stats.publishes++;
+  if (strncmp(topic, "homeassistant/", 14) == 0) {
+    hostSim.stats.discoveryPublishes++;
+  }
+  writePacket(retained ? 0x31 : 0x30, topic, payload, strlen(payload));
+  if (hostSim.onPublish) {
+    hostSim.onPublish(topic, payload, retained);
+  }
+  return true;
+}
+bool HAMqtt::beginPublish(const char* t, uint16_t, bool r) {
+  HostSimHeapScopeType uncounted(false);
+  if (!isConnected()) {
+    return false;
+  }
+  pendingTopic = t;
+  pendingPayload.clear();
+  pendingRetain = r;
+  return true;
+}
+void HAMqtt::writePayload(const char* d, const uint16_t l) { HostSimHeapScopeType uncounted(false); pendingPayload.append(d, l); }
+void HAMqtt::writePayload(const uint8_t* d, const uint16_t l) { HostSimHeapScopeType uncounted(false); pendingPayload.append((const char*)d, l); }
+void HAMqtt::writePayload(const __FlashStringHelper* d) { HostSimHeapScopeType uncounted(false); pendingPayload += (const char*)d; }
+bool HAMqtt::endPublish() { return publish(pendingTopic.c_str(), pendingPayload.c_str(), pendingRetain); }
+
+bool HAMqtt::subscribe(const char* topic) {
+  HostSimHeapScopeType uncounted(false);
+  if (!isConnected()) {
+    return false;
+  }
+  subscriptions.push_back(topic);
+  writePacket(0x82, topic, "", 1);    // packet id and qos byte stand in for the payload
+  return true;
+}
+
+void HostSimType::deliverMqtt(const char* topic, const char* payload) {
+  for (const std::string& subscribed : subscriptions) {
+    if ((subscribed == topic) && onMessageCallback) {
+      onMessageCallback(topic, (const uint8_t*)payload, strlen(payload));
+    }
+  }
+}
+
+// ----[ArduinoHA entities]-----
+
+HASerializer::HASerializer(HABaseDeviceType*, const uint8_t) {}
+void HASerializer::set(const __FlashStringHelper*, const void*, PropertyValueType) {}
+void HASerializer::set(const FlagType) {}
+void HASerializer::topic(const __FlashStringHelper*) {}
+
+HANumeric::HANumeric() : _value(0), _precision(0), _isSet(false) {}
+HANumeric::HANumeric(const float v, const uint8_t p) : _value(v), _precision(p), _isSet(true) {}
+
+HABaseDeviceType::HABaseDeviceType(const __FlashStringHelper* c, const char* u) : _componentName(c), _uniqueId(u), _name(nullptr), _objectId(nullptr), _serializer(nullptr) {
+  if (mqtt()) {
+    mqtt()->addDeviceType(this);
+  }
+}
+void HABaseDeviceType::setAvailability(bool) {}
+bool HABaseDeviceType::isAvailabilityConfigured() const { return false; }
+bool HABaseDeviceType::isOnline() const { return true; }
+void HABaseDeviceType::destroySerializer() { delete _serializer; _serializer = nullptr; }
+void HABaseDeviceType::publishConfig() {
+  buildSerializer();
+  if (!_serializer) {
+    return;
+  }
+  HostSimHeapScopeType uncounted(false);    // only the serializer is on the heap in ArduinoHA
+  std::string topic = std::string("homeassistant/") + (const char*)_componentName + "/" + deviceUniqueId + "/" + _uniqueId + "/config";
+  std::string payload = configPayload();
+  mqtt()->publish(topic.c_str(), payload.c_str(), true);
+  destroySerializer();
+}
+// the shape ArduinoHA sends, with the device block on every entity
+std::string HABaseDeviceType::configPayload() const {
+  std::string payload = std::string("{\"name\":\"") + (_name ? _name : "") + "\",\"uniq_id\":\"" + _uniqueId + "\"";
+  payload += extraConfig();
+  payload += std::string(",\"stat_t\":\"aha/") + deviceUniqueId + "/" + _uniqueId + "/stat_t\"";
+  payload += std::string(",\"avty_t\":\"aha/") + deviceUniqueId + "/avty_t\"";
+  payload += std::string(",\"dev\":{\"ids\":\"") + deviceUniqueId + "\",\"name\":\"" + deviceName + "\",\"sw\":\"" + deviceSoftware
+           + "\",\"mf\":\"" + deviceManufacturer + "\",\"mdl\":\"" + deviceModel + "\"}}";
+  return payload;
+}
+void HABaseDeviceType::publishAvailability() {}
+bool HABaseDeviceType::publishOnDataTopic(const __FlashStringHelper* topic, const char* payload, bool retained, bool) {
+  HostSimHeapScopeType uncounted(false);
+  if (!_uniqueId) {
+    return false;
+  }
+  std::string t = std::string("aha/") + deviceUniqueId + "/" + _uniqueId + "/" + (const char*)topic;
+  return mqtt()->publish(t.c_str(), payload, retained);
+}
+
+static void appendProperty(std::string& payload, const char* key, const char* value) {
+  if (value) {
+    payload += std::string(",\"") + key + "\":\"" + value + "\"";
+  }
+}
+
+HASensor::HASensor(const char* u) : HABaseDeviceType(F("sensor"), u), _deviceClass(nullptr), _stateClass(nullptr), _forceUpdate(false), _icon(nullptr), _unitOfMeasurement(nullptr) {}
+bool HASensor::setValue(const char* v) { return publishOnDataTopic(F("stat_t"), v, true); }
+void HASensor::buildSerializer() {
+  if (_serializer || !uniqueId()) {
+    return;
+  }
+  _serializer = new HASerializer(this, 12);
+}
+std::string HASensor::extraConfig() const {
+  std::string payload;
+  appendProperty(payload, "dev_cla", _deviceClass);
+  appendProperty(payload, "stat_cla", _stateClass);
+  appendProperty(payload, "ic", _icon);
+  appendProperty(payload, "unit_of_meas", _unitOfMeasurement);
+  return payload;
+}
+void HASensor::onMqttConnected() {
+  if (!uniqueId()) {
+    return;
+  }
+  publishConfig();
+}
+
+HASensorNumber::HASensorNumber(const char* u, const NumberPrecision p) : HASensor(u), _precision(p) {}
+bool HASensorNumber::setValue(const HANumeric& v, const bool force) {
+  if (!force && (v == _currentValue)) {
+    return true;
+  }
+  if (publishValue(v)) {
+    _currentValue = v;
+    return true;
+  }
+  return false;
+}
+bool HASensorNumber::publishValue(const HANumeric& v) {
+  if (!v.isSet()) {
+    return false;
+  }
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%.*f", (int)_precision, v.toFloat());
+  return publishOnDataTopic(F("stat_t"), buffer, true);
+}
+void HASensorNumber::onMqttConnected() {
+  if (!uniqueId()) {
+    return;
+  }
+  publishConfig();
+  publishValue(_currentValue);    // ArduinoHA sends the current value straight after the config
+}
@@ -0,0 +1,5 @@
+// host shim of the ESP32 system calls, the heap figures come from the harness allocator
+#pragma once
+#include <Arduino.h>
+class EspClass { public: uint64_t getEfuseMac(); uint32_t getFreeHeap(); uint32_t getMinFreeHeap(); uint32_t getCycleCount(); uint32_t getCpuFreqMHz(); };
+extern EspClass ESP;
@@ -0,0 +1,2 @@
+// host shim of the ESP-IDF wifi header
+#pragma once
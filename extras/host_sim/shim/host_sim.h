@@ -0,0 +1,90 @@
+// ----[HOST SIMULATION HOOKS]-----
+// the side of the shims the harness drives: the simulated clock, the RS485 wire, the network
+// and what was counted going over them
+//
+// time only moves when something makes it.  The harness steps the clock between passes of
+// loop(), delay() moves it on, a transmission on the bus holds the caller for the time the frame
+// takes at the line rate (RS485.endTransmission() flushes on the boards too), and every read of
+// millis() or micros() costs a microsecond so a busy wait in the sketch always ends
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+// the UARTs, Serial0 to Serial2.  Serial itself is the USB CDC port the log goes out on, as on 
+// the Nano ESP32, so all three UARTs are free for meter buses
+#define HOST_SIM_UART_COUNT   3
+#define HOST_SIM_USB_PORT     HOST_SIM_UART_COUNT     // the port number of Serial
+
+struct HostSimStatsType {
+  // modbus wire, all the buses and both directions
+  unsigned long busFramesOut = 0;
+  unsigned long busBytesOut = 0;
+  unsigned long busBytesIn = 0;
+  unsigned long long busBusyUs = 0;   // time there was a frame on the wire
+
+  // mqtt, bytes include the fixed header and topic length of each publish
+  unsigned long publishes = 0;
+  unsigned long discoveryPublishes = 0;
+  unsigned long long mqttBytes = 0;
+
+  // heap, everything that goes through operator new
+  size_t heapLiveBytes = 0;
+  size_t heapPeakBytes = 0;
+  unsigned long heapAllocations = 0;
+};
+
+// one UART and the RS485 wire behind it
+struct HostSimUartType {
+  unsigned long baud = 0;             // as the sketch started the port, 0 if it never did
+  uint8_t bitsPerChar = 10;
+  unsigned long long busyUs = 0;      // time there was a frame on this wire
+
+  // a frame the sketch has sent on this bus, and the time its last bit left the wire
+  std::function<void(const uint8_t* frame, size_t length, unsigned long long endUs)> onBusFrame;
+
+  // the time a character takes at the current line rate
+  unsigned long charUs() const;
+};
+
+struct HostSimType {
+  unsigned long long nowUs = 0;       // the simulated clock
+  bool echoSerial = false;            // show the sketch's log output
+  bool usbHost = false;               // a serial monitor is attached
+  bool online = true;                 // wifi and the broker are reachable
+  HostSimUartType uarts[HOST_SIM_UART_COUNT];
+  size_t heapBytes = 320 * 1024;      // what the heap figures reported to the sketch are taken from
+  int heapPaused = 1;                 // allocations are only counted while this is 0, see HostSimHeapScopeType
+  HostSimStatsType stats;
+
+  // every mqtt publish, after it has been counted
+  std::function<void(const char* topic, const char* payload, bool retained)> onPublish;
+
+  // put a byte on a UART's wire for the sketch to receive at a given time, bytes must be given in order
+  void deliverByte(uint8_t port, unsigned long long atUs, uint8_t value);
+  // bytes scheduled but not yet due, on all the wires
+  size_t bytesInFlight() const;
+
+  // set a Preferences value before setup() reads the config
+  void setPref(const char* ns, const char* key, const char* value);
+
+  // take the network down or bring it back, wifi events fire as they would on the board
+  void setOnline(bool up);
+
+  // hand the sketch a message on a topic it subscribed to
+  void deliverMqtt(const char* topic, const char* payload);
+
+  // progress the clock, delivering any bytes that fall due on the way
+  void advanceUs(unsigned long long us) { this->nowUs += us; }
+};
+extern HostSimType hostSim;
+
+// count the heap while the sketch runs, and leave out what the shims and the harness allocate
+// for their own book keeping (a real board has none of that)
+struct HostSimHeapScopeType {
+  int change;
+  explicit HostSimHeapScopeType(bool count) : change(count ? -1 : 1) { hostSim.heapPaused += this->change; }
+  ~HostSimHeapScopeType() { hostSim.heapPaused -= this->change; }
+};
@@ -0,0 +1,3 @@
+// host shim of TinyUSB, the USB host is the harness' usbHost flag
+#pragma once
+bool tud_mounted();
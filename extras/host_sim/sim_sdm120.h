@@ -0,0 +1,234 @@
+// ----[SIMULATED EASTRON SDM120]-----
+// meters on the simulated RS485 bus, answering input register reads the way an SDM120M does
+//
+// each meter has its own line rate (it says nothing unless the sketch's port is at the same rate,
+// as a real one would only see garbage), a response latency with some jitter, and faults that
+// can be injected as a fraction of requests: no answer at all, a corrupted CRC, or an exception.
+// The response goes out a character at a time from the end of the request plus the latency, so
+// the sketch sees it arrive at the line rate and its frame timing is exercised.
+//
+// the readings follow a slow swing in load, and on some meters it goes negative (a solar feed),
+// so the power is signed and the energy registers move.  The meter integrates its own power into
+// the import and export registers, so the device's own integration has something to agree with.
+// Registers that aren't listed read as zero, as they do on the meter
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "shim/host_sim.h"
+
+struct SimMeterSettingsType {
+  unsigned long baud = 9600;        // the meter's own line rate
+  float latencyMs = 30;             // from the end of the request to the first byte of the response
+  float jitterMs = 10;              // added to the latency, uniformly up to this much
+  float timeoutRate = 0;            // fraction of requests that get no answer
+  float crcErrorRate = 0;           // fraction whose response has a bad CRC
+  float exceptionRate = 0;          // fraction that get an exception (illegal data address)
+};
+
+class SimSDM120Type {
+public:
+  uint8_t id;
+  SimMeterSettingsType settings;
+  unsigned long requests = 0;
+  unsigned long faults = 0;         // requests that had a fault injected
+
+  SimSDM120Type(uint8_t modbusID, const SimMeterSettingsType& meterSettings) : id(modbusID), settings(meterSettings) {
+    this->phase = modbusID * 0.7;
+    this->solar = (modbusID % 3) == 0;
+  }
+
+  // answer a read, returns false if the meter says nothing
+  bool respond(uint8_t function, uint16_t address, uint16_t count, std::vector<uint8_t>& response) {
+    this->requests++;
+    integrate();
+
+    float fault = chance();
+    if (fault < this->settings.timeoutRate) {
+      this->faults++;
+      return false;
+    }
+    response.clear();
+    response.push_back(this->id);
+    if ((function != 0x04) || (count == 0) || (count > 80) || (fault < this->settings.timeoutRate + this->settings.exceptionRate)) {
+      if (function == 0x04) {
+        this->faults++;
+      }
+      response.push_back(function | 0x80);
+      response.push_back((function == 0x04) ? 0x02 : 0x01);
+    } else {
+      response.push_back(function);
+      response.push_back(2 * count);
+      for (uint16_t i = 0; i < count; i++) {
+        uint16_t word = registerWord(address + i);
+        response.push_back(word >> 8);
+        response.push_back(word & 0xFF);
+      }
+    }
+    appendCRC(response);
+    if (fault < this->settings.timeoutRate + this->settings.exceptionRate + this->settings.crcErrorRate) {
+      if (response[1] == 0x04) {
+        this->faults++;
+        response.back() ^= 0x5A;
+      }
+    }
+    return true;
+  }
+
+  // the latency for this response, in microseconds
+  unsigned long long latencyUs() {
+    return (unsigned long long)((this->settings.latencyMs + this->settings.jitterMs * chance()) * 1000);
+  }
+
+  static uint16_t crc16(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    while (length--) {
+      crc ^= *data++;
+      for (int b = 0; b < 8; b++) {
+        crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+      }
+    }
+    return crc;
+  }
+
+private:
+  double phase;
+  bool solar;
+  double importKWh = 1234.5;
+  double exportKWh = 12.5;
+  unsigned long long integratedToUs = 0;
+
+  static float chance() {
+    return rand() / (RAND_MAX + 1.0f);
+  }
+
+  static void appendCRC(std::vector<uint8_t>& frame) {
+    uint16_t crc = crc16(frame.data(), frame.size());
+    frame.push_back(crc & 0xFF);
+    frame.push_back(crc >> 8);
+  }
+
+  // active power in W at a given time, a ten minute swing around a base load
+  double powerAt(unsigned long long us) const {
+    double swing = sin(this->phase + us / 1e6 * 2 * M_PI / 600);
+    return this->solar ? 1500 * swing - 300 : 800 + 600 * swing;
+  }
+
+  // bring the energy registers up to now, in 100ms steps
+  void integrate() {
+    const unsigned long long stepUs = 100000;
+    while (this->integratedToUs + stepUs <= hostSim.nowUs) {
+      double watts = powerAt(this->integratedToUs + stepUs / 2);
+      double kWh = watts * stepUs / 3.6e12;     // W us to kWh
+      if (watts >= 0) {
+        this->importKWh += kWh;
+      } else {
+        this->exportKWh -= kWh;
+      }
+      this->integratedToUs += stepUs;
+    }
+  }
+
+  // a reading by its register number in the meter spec (1 based, the first of its two words)
+  float reading(uint16_t reg) const {
+    double t = hostSim.nowUs / 1e6;
+    double power = powerAt(hostSim.nowUs);
+    double voltage = 230 + 3 * sin(t / 37 + this->phase);
+    double apparent = fabs(power) / 0.95;
+    switch (reg) {
+      case 1:   return voltage;
+      case 7:   return apparent / voltage;
+      case 13:  return power;
+      case 19:  return apparent;
+      case 25:  return apparent * 0.31;
+      case 31:  return (power >= 0) ? 0.95 : -0.95;
+      case 71:  return 50 + 0.02 * sin(t / 11);
+      case 73:  return (float)this->importKWh;
+      case 75:  return (float)this->exportKWh;
+      case 77:  return (float)(this->importKWh * 0.1);
+      case 79:  return (float)(this->exportKWh * 0.1);
+      case 85:  return power;
+      case 87:  return 2500;
+      case 89:  return (power >= 0) ? power : 0;
+      case 91:  return 2500;
+      case 93:  return (power < 0) ? -power : 0;
+      case 95:  return 1600;
+      case 259: return apparent / voltage;
+      case 265: return 12.5;
+      case 343: return (float)(this->importKWh + this->exportKWh);
+      case 345: return (float)((this->importKWh + this->exportKWh) * 0.1);
+    }
+    return 0;
+  }
+
+  // a word at a 0 based wire address, floats are sent high word first
+  uint16_t registerWord(uint16_t address) const {
+    uint16_t reg = address + 1;
+    bool low = ((reg - 1) & 1) != 0;                // the second word of a float
+    float value = reading(low ? reg - 1 : reg);
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return low ? (bits & 0xFFFF) : (bits >> 16);
+  }
+};
+
+// a bus, a set of meters behind one of the sketch's UARTs
+class SimModbusBusType {
+public:
+  std::vector<SimSDM120Type> meters;
+  unsigned long badRequests = 0;    // frames the meters couldn't make sense of
+  unsigned long unanswered = 0;     // requests no meter answered
+
+  void add(uint8_t id, const SimMeterSettingsType& settings) {
+    this->meters.push_back(SimSDM120Type(id, settings));
+  }
+
+  // hook the bus up to a UART in the host shims, Serial1 is port 1
+  void attach(uint8_t uart) {
+    this->port = uart;
+    hostSim.uarts[uart].onBusFrame = [this](const uint8_t* frame, size_t length, unsigned long long endUs) {
+      this->onRequest(frame, length, endUs);
+    };
+  }
+
+private:
+  uint8_t port = 1;
+  unsigned long long busFreeUs = 0;   // when the last response finishes going out
+
+  void onRequest(const uint8_t* frame, size_t length, unsigned long long endUs) {
+    if ((length != 8) || (SimSDM120Type::crc16(frame, 6) != (frame[6] | (frame[7] << 8)))) {
+      this->badRequests++;
+      return;
+    }
+    SimSDM120Type* meter = nullptr;
+    for (SimSDM120Type& m : this->meters) {
+      if (m.id == frame[0]) {
+        meter = &m;
+      }
+    }
+    // a meter at a different rate never sees a valid frame
+    if (!meter || (meter->settings.baud != hostSim.uarts[this->port].baud)) {
+      this->unanswered++;
+      return;
+    }
+    std::vector<uint8_t> response;
+    if (!meter->respond(frame[1], (frame[2] << 8) | frame[3], (frame[4] << 8) | frame[5], response)) {
+      this->unanswered++;
+      return;
+    }
+    unsigned long long at = endUs + meter->latencyUs();
+    if (at < this->busFreeUs) {
+      at = this->busFreeUs;     // still sending the last one, the sketch timed it out early
+    }
+    unsigned long charUs = hostSim.uarts[this->port].charUs();
+    for (uint8_t b : response) {
+      at += charUs;
+      hostSim.deliverByte(this->port, at, b);
+    }
+    this->busFreeUs = at;
+  }
+};
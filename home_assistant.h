@@ -8,6 +8,32 @@
 #include "sys_logStatus.h"
 #include "sys_wifi.h"
 #include <Client.h>
+#include <new>              // placement new, for the entity pool
+
+// uncomment this line to publish each meter's readings as one json state message on a single 
+// topic, rather than one message per entity.  Discovery then picks the fields out with value_template
+// #define HA_AGGREGATED_STATE
+
+// uncomment this line to keep one message per field, on the same topics as the ArduinoHA entities,
+// but publish them straight through ha.mqtt with no ArduinoHA object behind each field.  Discovery is 
+// built from the register table in flash, so a meter costs only its readings and filter state.  For 
+// large installations, and to get a full bus on the Nano IoT 33
+// #define HA_LEAN_PUBLISH
+
+#if defined(HA_AGGREGATED_STATE) && defined(HA_LEAN_PUBLISH)
+  #error "HA_AGGREGATED_STATE and HA_LEAN_PUBLISH are two ways of publishing, set one of them"
+#endif
+// the meter fields are ArduinoHA entities unless one of those is set
+#if !defined(HA_AGGREGATED_STATE) && !defined(HA_LEAN_PUBLISH)
+  #define HA_METER_ENTITIES
+#endif
+
+// uncomment this line on the ESP32 to read the modbus bus from its own FreeRTOS task on the other
+// core, so MQTT and wifi stalls in loop() don't throw out the bus timing (see sensor_eastron_smart_meter.h)
+// #define METER_DUAL_CORE
+#if defined(METER_DUAL_CORE) && !defined(ARDUINO_ARCH_ESP32)
+  #undef METER_DUAL_CORE    // the Nano IoT 33 only has the one core, it keeps the cooperative loop
+#endif
 
 // ================================[ A cache of persistent strings for UIDs ]==================================
 // this hacky work around is required because the homeassistant library does not make local copies of the strings 
@@ -17,15 +43,26 @@
 // don't use <vectors> because the pointers can change, don't use Strings because the pointers can change.
 #include "sys_static_strings.h"
 
-// Save a string in the array and return a pointer to the saved string
-const char* newUid(const String& name, int instance = -1) {
-    String s_uid = getUniqueChipID();  
-    if (instance >= 0) {
-        s_uid = s_uid + "_" + String(instance);
+#define UID_BUFFER_SIZE   64    // longest unique id we build
+
+// the chip id, worked out once and kept for building all the uids
+const char* uniqueChipID() {
+    static char chipID[24] = "";
+    if (chipID[0] == '\0') {
+        getUniqueChipID().toCharArray(chipID, sizeof(chipID));
     }
-    s_uid = s_uid + "_" + name;  // put the name last in case its very long
+    return chipID;
+}
 
-    return storeStaticString(s_uid);
+// Save a uid of the form <chip id>_<instance>_<name><suffix> and return a pointer to the saved string
+const char* newUid(const char* name, int instance = -1, const char* suffix = "") {
+    char uid[UID_BUFFER_SIZE];
+    if (instance >= 0) {
+        snprintf(uid, sizeof(uid), "%s_%d_%s%s", uniqueChipID(), instance, name, suffix);   // put the name last in case its very long
+    } else {
+        snprintf(uid, sizeof(uid), "%s_%s%s", uniqueChipID(), name, suffix);
+    }
+    return storeStaticString(uid);
 }
 
 // ====================================[ HA device + entity definition ]=======================================
@@ -39,19 +76,120 @@ const char* newUid(const String& name, int instance = -1) {
 #include <ArduinoHA.h>          //  |
 #include <HADevice.h>           //  |
 #include <HAMqtt.h>             //  | 
-#define  PROVISION_MAX_ENTITIES 64
+#ifdef HA_METER_ENTITIES
+  #define  PROVISION_MAX_ENTITIES 64    // ArduinoHA entity slots, the meter entities are handed out from a pool of this size
+#else
+  #define  PROVISION_MAX_ENTITIES 1     // nothing is published through ArduinoHA entities, the library needs a slot all the same
+#endif
+#define  METER_FIELD_COUNT      21      // values published per meter, one per entry in the register table
+#define  METER_AGGREGATE_FIELDS 2       // fields summarised over a sample window, one per entry in meterAggregateFields
+#define  METER_LABEL_LENGTH     16      // longest meter label, used in the entity names e.g. [UPS 1] Voltage
+#define  METER_SNAPSHOT_WORDS   42      // registers held per meter, the words of all the register table entries
+
+// meters that can be configured on the bus.  Each one costs about 1KB of RAM whether it is used
+// or not, and its entities take a few KB more, so the SAMD with its 32KB gets fewer unless the 
+// fields are published without entities
+#if defined(ARDUINO_ARCH_SAMD) && defined(HA_METER_ENTITIES)
+  #define METER_POOL_SIZE       4
+#else
+  #define METER_POOL_SIZE       16
+#endif
+
+// a set of fields on a meter, one bit per register table entry
+typedef uint32_t MeterFieldMaskType;
+#define  METER_ALL_FIELDS       ((MeterFieldMaskType)((1UL << METER_FIELD_COUNT) - 1))
+static_assert(METER_FIELD_COUNT <= 32, "MeterFieldMaskType needs widening for more than 32 fields");
+constexpr MeterFieldMaskType meterFieldBit(uint8_t field) { return ((MeterFieldMaskType)1) << field; }
 #include <Thread.h>             // simple threading library for time event driven updates
 #include <ThreadController.h>   //  |
+#include "sys_scheduler.h"      //  | tiered polling groups on top of the thread controller
+#include "sys_meter_health.h"   // per meter failure tracking and backoff
+#include "sys_window_stats.h"   // min/max/mean/rms summaries of high rate samples
+#include "sys_instrumentation.h"  // timing histograms of the hot paths
+#include "sys_register_snapshot.h" // the raw registers last read off each meter
+#include "sys_energy_integrator.h" // energy integrated from the power readings
+#include "sys_history_log.h"       // rolling history of the meters in flash
+
+// ====================================[ meter sensor entity ]=======================================
+// entity names are only needed when the discovery config is published, so rather than keep a 
+// formatted name for every entity in RAM they are formatted on demand into one shared buffer,
+// from the meter id and the (constant, flash resident) name in the register table.  The unique 
+// id has to stay put as ArduinoHA builds the state topic from it on every publish
+#define ENTITY_NAME_BUFFER_SIZE   64
+
+char entityNameBuffer[ENTITY_NAME_BUFFER_SIZE];   // shared, only valid while a discovery config is being built
+
+class HAMeterSensorType : public HASensorNumber {
+public:
+    HAMeterSensorType(const char* uniqueId) : HASensorNumber(uniqueId, HASensorNumber::PrecisionP2) {}
 
-WiFiClient networkClient;               // declare a wifi client object for the HA MQTT connection 
+    // set the parts of the name, e.g. "UPS 1", "Active Power", " Max" gives "[UPS 1] Active Power Max"
+    void setMeterName(const char* label, const char* name, const char* suffix = "") {
+        this->nameLabel = label;
+        this->nameBase = name;
+        this->nameSuffix = suffix;
+    }
+
+    // send the discovery config (and the current value), when the discovery scheduler gets to us
+    void publishDiscovery() {
+        HASensorNumber::onMqttConnected();
+    }
+
+protected:
+    // ArduinoHA calls this for every entity at once on each connect, the discovery scheduler
+    // sends the configs a few at a time instead, see home_assistant_discovery.h
+    void onMqttConnected() override {}
+
+    void buildSerializer() override {
+        if (this->nameBase) {
+            snprintf(entityNameBuffer, sizeof(entityNameBuffer), "[%s] %s%s", this->nameLabel, this->nameBase, this->nameSuffix);
+            setName(entityNameBuffer);
+        }
+        HASensorNumber::buildSerializer();
+    }
+
+private:
+    const char* nameLabel = "";
+    const char* nameBase = nullptr;
+    const char* nameSuffix = "";
+};
+
+// the meter entities are created at setup, once the list of meters has been read from the config,
+// out of a fixed pool sized to the ArduinoHA entity slots.  The library quietly ignores entities
+// past its limit (and its check leaves the last slot unused), so the pool stops one short of it
+#ifdef HA_METER_ENTITIES
+  #define METER_ENTITY_POOL_SIZE  (PROVISION_MAX_ENTITIES - 1)
+#else
+  #define METER_ENTITY_POOL_SIZE  0     // and no room is set aside for them
+#endif
+
+class HAMeterSensorPoolType {
+public:
+    // construct an entity in the next free slot, nullptr if the pool is used up
+    HAMeterSensorType* allocate(const char* uniqueId) {
+        // through remaining(), a straight compare with a pool size of 0 is always true and warns
+        if (!uniqueId || (this->remaining() == 0)) {
+            return nullptr;
+        }
+        return new (this->storage[this->used++]) HAMeterSensorType(uniqueId);
+    }
+
+    uint8_t allocated() const { return this->used; }
+    uint8_t remaining() const { return METER_ENTITY_POOL_SIZE - this->used; }
+    HAMeterSensorType* at(uint8_t index) { return reinterpret_cast<HAMeterSensorType*>(this->storage[index]); }
+
+private:
+    // entities register themselves with the mqtt object by address, so they are never moved or freed
+    alignas(HAMeterSensorType) uint8_t storage[(METER_ENTITY_POOL_SIZE > 0) ? METER_ENTITY_POOL_SIZE : 1][sizeof(HAMeterSensorType)];
+    uint8_t used = 0;
+};
+
+#include "sys_mqtt_tls.h"               // the network client for the HA MQTT connection, plain or TLS
 
 // a nice herlper class to organise all the HA objects into a neat collection 
 // that makes them easier to navigate in the logic and collects all the configuration 
 // together into a neat package.  Note that the order of construction is very precise
 //
-// find your full list fo mdi:icons here: https://pictogrammers.com/library/mdi/
-// and your full list of Units here: https://github.com/home-assistant/core/blob/d7ac4bd65379e11461c7ce0893d3533d8d8b8cbf/homeassistant/const.py#L384
-//
 class HADataType {
 public:
     HADevice device; // HADevice entity object
@@ -60,173 +198,127 @@ public:
     HADataType(Client& netClient) :
         device(),                       
         mqtt(netClient, this->device, PROVISION_MAX_ENTITIES),  // needs to be constructed here with the newly created device in this order
-        meter1entities(1),                  // volt meter on MODBUS device ID 1
-        meter2entities(2),                  // volt meter on MODBUS device ID 2
         timers()
         {}; 
 
-    // Nested class for defining the Entities on the device
+    // Nested class for holding the state and entities of one meter on the bus
     class HAEntitiesType {
     
     public:            
-        int modbusID;     // store this, it will link to the modbus item ID when we use it in the modbus module
-        HASensorNumber voltage;
-        HASensorNumber current;
-        HASensorNumber activePower;
-        HASensorNumber apparentPower;
-        HASensorNumber reactivePower;
-        HASensorNumber powerFactor;
-        HASensorNumber frequency;
-        HASensorNumber importActiveEnergy;
-        HASensorNumber exportActiveEnergy;
-        HASensorNumber importReactiveEnergy;
-        HASensorNumber exportReactiveEnergy;
-        HASensorNumber totalSystemPowerDemand;
-        HASensorNumber maxTotalSystemPowerDemand;
-        HASensorNumber importSystemPowerDemand;
-        HASensorNumber maxImportSystemPowerDemand;
-        HASensorNumber exportSystemPowerDemand;
-        HASensorNumber maxExportSystemPowerDemand;
-        HASensorNumber currentDemand;
-        HASensorNumber maxCurrentDemand;
-        HASensorNumber totalActiveEnergy;
-        HASensorNumber totalReactiveEnergy;
-
-
-        // Set up all the entities (note that event handlers are added later)
-        HAEntitiesType(int clientID) : 
-            modbusID(clientID), 
-            voltage(                      newUid("voltage",clientID),                    HASensorNumber::PrecisionP2), 
-            current(                      newUid("current",clientID),                    HASensorNumber::PrecisionP2), 
-            activePower(                  newUid("activePower",clientID),                HASensorNumber::PrecisionP2), 
-            apparentPower(                newUid("apparentPower",clientID),              HASensorNumber::PrecisionP2), 
-            reactivePower(                newUid("reactivePower",clientID),              HASensorNumber::PrecisionP2), 
-            powerFactor(                  newUid("powerFactor",clientID),                HASensorNumber::PrecisionP2), 
-            frequency(                    newUid("frequency",clientID),                  HASensorNumber::PrecisionP2), 
-            importActiveEnergy(           newUid("importActiveEnergy",clientID),         HASensorNumber::PrecisionP2), 
-            exportActiveEnergy(           newUid("exportActiveEnergy",clientID),         HASensorNumber::PrecisionP2), 
-            importReactiveEnergy(         newUid("importReactiveEnergy",clientID),       HASensorNumber::PrecisionP2), 
-            exportReactiveEnergy(         newUid("exportReactiveEnergy",clientID),       HASensorNumber::PrecisionP2), 
-            totalSystemPowerDemand(       newUid("totalSystemPowerDemand",clientID),     HASensorNumber::PrecisionP2), 
-            maxTotalSystemPowerDemand(    newUid("maxTotalSystemPowerDemand",clientID),  HASensorNumber::PrecisionP2), 
-            importSystemPowerDemand(      newUid("importSystemPowerDemand",clientID),    HASensorNumber::PrecisionP2), 
-            maxImportSystemPowerDemand(   newUid("maxImportSystemPowerDemand",clientID), HASensorNumber::PrecisionP2), 
-            exportSystemPowerDemand(      newUid("exportSystemPowerDemand",clientID),    HASensorNumber::PrecisionP2), 
-            maxExportSystemPowerDemand(   newUid("maxExportSystemPowerDemand",clientID), HASensorNumber::PrecisionP2), 
-            currentDemand(                newUid("currentDemand",clientID),              HASensorNumber::PrecisionP2), 
-            maxCurrentDemand(             newUid("maxCurrentDemand",clientID),           HASensorNumber::PrecisionP2), 
-            totalActiveEnergy(            newUid("totalActiveEnergy",clientID),          HASensorNumber::PrecisionP2), 
-            totalReactiveEnergy(          newUid("totalReactiveEnergy",clientID),        HASensorNumber::PrecisionP2) 
-            {
-
-              voltage.setIcon("mdi:meter-electric-outline");
-              voltage.setName(storeStaticString("[UPS " + String(clientID) + "] Voltage"));
-              voltage.setUnitOfMeasurement("V");
-
-              current.setIcon("mdi:current-ac");
-              current.setName(storeStaticString("[UPS " + String(clientID) + "] Current"));
-              current.setUnitOfMeasurement("A");
-
-              activePower.setIcon("mdi:transmission-tower");
-              activePower.setName(storeStaticString("[UPS " + String(clientID) + "] Active Power"));
-              activePower.setUnitOfMeasurement("W");
-
-              apparentPower.setIcon("mdi:transmission-tower");
-              apparentPower.setName(storeStaticString("[UPS " + String(clientID) + "] Apparent Power"));
-              apparentPower.setUnitOfMeasurement("W");
-              
-              reactivePower.setIcon("mdi:transmission-tower");
-              reactivePower.setName(storeStaticString("[UPS " + String(clientID) + "] Reactive Power"));
-              reactivePower.setUnitOfMeasurement("W");
-              
-              powerFactor.setIcon("mdi:ab-testing");
-              powerFactor.setName(storeStaticString("[UPS " + String(clientID) + "] Power Factor"));
-
-              frequency.setIcon("mdi:sine-wave");
-              frequency.setName(storeStaticString("[UPS " + String(clientID) + "] Frequency"));
-              frequency.setUnitOfMeasurement("Hz");             
-
-              importActiveEnergy.setIcon("mdi:transmission-tower-import");
-              importActiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Active Energy Import"));
-              importActiveEnergy.setUnitOfMeasurement("kWh");    
-
-              exportActiveEnergy.setIcon("mdi:transmission-tower-export");
-              exportActiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Reactive Energy Export"));
-              exportActiveEnergy.setUnitOfMeasurement("kWh");                  
-
-              importReactiveEnergy.setIcon("mdi:transmission-tower-import");
-              importReactiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Reactive Energy Import"));
-              importReactiveEnergy.setUnitOfMeasurement("kvarh");    
-
-              exportReactiveEnergy.setIcon("mdi:transmission-tower-export");
-              exportReactiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Reactive Energy Export"));
-              exportReactiveEnergy.setUnitOfMeasurement("kvarh");     
-
-              totalSystemPowerDemand.setIcon("mdi:transmission-tower");
-              totalSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Total System Power Demand"));
-              totalSystemPowerDemand.setUnitOfMeasurement("W");
-
-              maxTotalSystemPowerDemand.setIcon("mdi:transmission-tower");
-              maxTotalSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Max Total System Power Demand"));
-              maxTotalSystemPowerDemand.setUnitOfMeasurement("W");
-
-              importSystemPowerDemand.setIcon("mdi:transmission-tower-import");
-              importSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Import System Power Demand"));
-              importSystemPowerDemand.setUnitOfMeasurement("W");
-
-              maxImportSystemPowerDemand.setIcon("mdi:transmission-tower-import");
-              maxImportSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Max Import System Power Demand"));
-              maxImportSystemPowerDemand.setUnitOfMeasurement("W");
-
-              exportSystemPowerDemand.setIcon("mdi:transmission-tower-export");
-              exportSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Export System Power Demand"));
-              exportSystemPowerDemand.setUnitOfMeasurement("W");
-
-              maxExportSystemPowerDemand.setIcon("mdi:transmission-tower-export");
-              maxExportSystemPowerDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Max Export System Power Demand"));
-              maxExportSystemPowerDemand.setUnitOfMeasurement("W");
-
-              currentDemand.setIcon("mdi:current-ac");
-              currentDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Current Demand"));
-              currentDemand.setUnitOfMeasurement("A");
-
-              maxCurrentDemand.setIcon("mdi:current-ac");
-              maxCurrentDemand.setName(storeStaticString("[UPS " + String(clientID) + "] Max Current Demand"));
-              maxCurrentDemand.setUnitOfMeasurement("A");
-
-              totalActiveEnergy.setIcon("mdi:transmission-tower");
-              totalActiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Total Active Energy"));
-              totalActiveEnergy.setUnitOfMeasurement("kWh");
-              totalActiveEnergy.setDeviceClass("energy");      // show up in energy dashboard
-              totalActiveEnergy.setStateClass("total");        // show up in energy dashboard
-
-              totalReactiveEnergy.setIcon("mdi:transmission-tower");
-              totalReactiveEnergy.setName(storeStaticString("[UPS " + String(clientID) + "] Total Reactive Energy"));
-              totalReactiveEnergy.setUnitOfMeasurement("kvarh");
-
-            }
+        // what was last sent to home assistant for each field, indexed in register table order.
+        // this lives with the live entities so it persists between polls
+        struct FieldStateType {
+          float lastPublishedValue = 0.0;     // value last published
+          unsigned long lastPublishedAt = 0;  // millis() when it was published
+          bool published = false;             // false until the first publish since boot
+        };
+
+        // min, max, mean and rms of a field over a window of samples, published at the end of each window
+        struct FieldStatsType {
+          SampleWindowType window;
+          WindowSummaryType latest;                                   // summary of the last complete window
+#ifdef HA_METER_ENTITIES
+          HAMeterSensorType* summaries[WINDOW_SUMMARY_COUNT] = {};    // in WindowSummaryType order
+#endif
+        };
+
+        int modbusID = 0;     // store this, it will link to the modbus item ID when we use it in the modbus module
+        uint8_t bus = 0;      // the RS485 bus the meter is on, an index into modbusBuses
+        char label[METER_LABEL_LENGTH] = "";                  // shown in the entity names
+        MeterFieldMaskType enabledFields = METER_ALL_FIELDS;  // fields read off the meter and published
+        MeterHealthType health;                               // how well the meter is answering on the bus
+        FieldStateType fieldState[METER_FIELD_COUNT];
+        FieldStatsType fieldStats[METER_AGGREGATE_FIELDS];    // in meterAggregateFields order
+        RegisterSnapshotType snapshot;  // raw registers from the bus, belongs to the bus side in dual core mode
+        DerivedMeterType derived;       // energy worked out on the device, belongs to the publishing side
+#ifdef METER_HISTORY
+        HistoryInputsType history;      // what goes in the meter's next history point, publishing side
+#endif
+        uint8_t pendingBlocks = 0;      // block reads queued on the bus and not yet completed
+        bool stateChanged = false;      // aggregated state mode: fields have changed since the last state message
+
+#ifdef HA_METER_ENTITIES
+        // the entity each field is published to, in register table order.  nullptr where there is
+        // none: the field is disabled, or the entity pool ran out
+        HAMeterSensorType* entities[METER_FIELD_COUNT] = {};
+#endif
+
+        // entities are created and described from the register table, see setupSmartMeter
+        HAEntitiesType() {}
+
+        // the live state is referred to by address from queued bus transactions, so the container 
+        // must never be copied - always pass it around by reference
+        HAEntitiesType(const HAEntitiesType&) = delete;
+        HAEntitiesType& operator=(const HAEntitiesType&) = delete;
     }; 
-    // declare the instances
-    HAEntitiesType meter1entities; // container object for entities
-    HAEntitiesType meter2entities; // container object for entities
+    // the meters, taken from the front of the pool in the order they are configured
+    HAEntitiesType meters[METER_POOL_SIZE];
+    uint8_t meterCount = 0;
+    HAMeterSensorPoolType entityPool;   // the entities for all the meters
+
+    // take the next meter from the pool, nullptr if it is full
+    HAEntitiesType* addMeter(int modbusID, const char* label, MeterFieldMaskType fields, uint8_t bus = 0) {
+      if (this->meterCount >= METER_POOL_SIZE) {
+        return nullptr;
+      }
+      HAEntitiesType& meter = this->meters[this->meterCount++];
+      meter.modbusID = modbusID;
+      meter.bus = bus;
+      strncpy(meter.label, label, sizeof(meter.label) - 1);
+      meter.label[sizeof(meter.label) - 1] = '\0';
+      meter.enabledFields = fields & METER_ALL_FIELDS;
+      return &meter;
+    }
 
     // Nested class for defining the events we want to run on a timer
     class ThreadTimersType {
     public: 
       ThreadController controller;  // ThreadController that will controll all threads
-      Thread readSmartMeters;     // timer thread for polling the temperature sensor
+      Thread readSmartMeters;     // timer thread that runs a bus cycle for whatever meter groups are due
+      PollSchedulerType meterPolling; // per group poll timers for the meter registers
+      Thread replayBacklog;       // timer thread that sends readings buffered while offline, a batch at a time
+      Thread publishDiagnostics;  // timer thread that sends the timing and error figures
+      Thread publishDerived;      // timer thread that closes each derived metrics interval and sends it
+      Thread publishDiscovery;    // timer thread that sends the discovery configs a chunk at a time
+#ifdef METER_HISTORY
+      Thread recordHistory;       // timer thread that adds a point per meter to the flash history
+      Thread publishHistory;      // timer thread that sends a history query's answer, a message at a time
+#endif
+#ifdef METER_DUAL_CORE
+      ThreadController acquisition; // the bus side timers, run by the modbus task rather than loop()
+#endif
       ThreadTimersType() :
           controller(),
-          readSmartMeters() 
+          readSmartMeters(),
+          meterPolling(),
+          replayBacklog(),
+          publishDiagnostics(),
+          publishDerived(),
+          publishDiscovery()
           {
               // add all the threads to the controller
+#ifdef METER_DUAL_CORE
+              this->acquisition.add(&this->meterPolling.controller);
+              this->acquisition.add(&this->readSmartMeters);
+#else
+              this->controller.add(&this->meterPolling.controller);
               this->controller.add(&this->readSmartMeters);
+#endif
+              this->controller.add(&this->replayBacklog);
+              this->controller.add(&this->publishDiagnostics);
+              this->controller.add(&this->publishDerived);
+              this->controller.add(&this->publishDiscovery);
+#ifdef METER_HISTORY
+              this->controller.add(&this->recordHistory);
+              this->controller.add(&this->publishHistory);
+#endif
           }
     } timers;
 
     // Method to drive all the polling on the ha object and raise the events
     void loop() {
       this->timers.controller.run();    // poll all the timer events
+      SpanTimerType span(instrumentation.mqtt);
       this->mqtt.loop();                // then propagate any status to MQTT and poll MQTT events
     }
 };
@@ -241,14 +333,102 @@ HADataType ha(networkClient);
 
 // include sensor sub-modules
 #include "sensor_eastron_smart_meter.h" // control module for the smart meters
+#include "home_assistant_diagnostics.h" // timing and error figures for the device
+#include "home_assistant_derived.h"     // energy, balance and cost worked out on the device
+#include "home_assistant_history.h"     // the meters' history in flash, and queries for it over MQTT
+#include "home_assistant_remote_config.h" // poll periods, field masks and deadbands changed over MQTT
 
 // ====================================[ HA setup and connection ]=======================================
- 
+
+// ----[discovery]-----
+// the configs are all retained on the broker, so they go out once after boot and again whenever
+// home assistant announces it is back online on <discovery prefix>/status (which it does when it
+// restarts, and when it reconnects to a broker that has restarted and lost them).  A plain
+// reconnect of ours doesn't resend them, so a flaky link doesn't send hundreds of configs every
+// time it comes back.  Either way they are sent a chunk at a time, see home_assistant_discovery.h
+
+bool discoverySentSinceBoot = false;
+
+// the ArduinoHA meter entities, a discovery scheduler source
+void publishMeterEntityDiscovery(DiscoveryCursorType& cursor) {
+  for (uint8_t i = 0; i < ha.entityPool.allocated(); i++) {
+    if (cursor.next()) {
+      ha.entityPool.at(i)->publishDiscovery();
+    }
+  }
+}
+
+void buildHAStatusTopic(char* topic, size_t size) {
+  snprintf(topic, size, "%s/status", ha.mqtt.getDiscoveryPrefix());
+}
+
+void onMqttMessage(const char* topic, const uint8_t* payload, uint16_t length) {
+  char statusTopic[HA_TOPIC_BUFFER_SIZE];
+  buildHAStatusTopic(statusTopic, sizeof(statusTopic));
+  if ((strcmp(topic, statusTopic) == 0) && (length == 6) && (memcmp(payload, "online", 6) == 0)) {
+    LOG_STATUS("Home Assistant is online, sending discovery");
+    discoveryScheduler.restart();
+    return;
+  }
+  if (onRemoteConfigMqttMessage(topic, payload, length)) {
+    return;
+  }
+#ifdef METER_HISTORY
+  if (onHistoryMqttMessage(topic, payload, length)) {
+    return;
+  }
+#endif
+}
+
+// a chunk of discovery at a time, state messages come first
+void onPublishDiscoveryEvent() {
+  if (!discoveryScheduler.busy() || !ha.mqtt.isConnected()) {
+    return;
+  }
+#ifdef METER_DUAL_CORE
+  if (!sampleQueue.empty()) {
+    return;   // readings are waiting to go out, they always go before discovery
+  }
+#endif
+  discoveryScheduler.run(DISCOVERY_CHUNK);
+  if (!discoveryScheduler.busy()) {
+    LOG_STATUS("Discovery sent, %d configs", discoveryScheduler.sentSoFar());
+  }
+}
+
+void onMqttConnected() {
+  onSmartMeterMqttConnected();
+
+  char statusTopic[HA_TOPIC_BUFFER_SIZE];
+  buildHAStatusTopic(statusTopic, sizeof(statusTopic));
+  ha.mqtt.subscribe(statusTopic);
+  onRemoteConfigMqttConnected();
+#ifdef METER_HISTORY
+  onHistoryMqttConnected();
+#endif
+  if (!discoverySentSinceBoot) {
+    discoverySentSinceBoot = true;
+    discoveryScheduler.restart();
+  }
+}
+
+void setupDiscovery() {
+  discoveryScheduler.addSource(publishMeterEntityDiscovery);
+#ifndef HA_METER_ENTITIES
+  discoveryScheduler.addSource(publishMeterDiscovery);
+#endif
+  discoveryScheduler.addSource(publishDiagnosticsDiscovery);
+  discoveryScheduler.addSource(publishDerivedDiscovery);
+  ha.timers.publishDiscovery.onRun(onPublishDiscoveryEvent);
+  ha.timers.publishDiscovery.setInterval(DISCOVERY_TICK_MS);
+  ha.timers.publishDiscovery.enabled = true;
+}
+
 void setupHA() {
 
   // [1] -- set up the HA device --
 
-  logStatus("Configuring the HA Device.");
+  LOG_STATUS("Configuring the HA Device.");
   // Retrieve MAC address from the wifi card and initialise the HA device with that as the unique ID
 
   byte macAddress[WL_MAC_ADDR_LENGTH]; // a byte string to containg the mac address we need to configure the HA device
@@ -275,22 +455,41 @@ void setupHA() {
   // the Home Assistant Panel.
   ha.device.enableLastWill();
 
+  // discovery is sent by the scheduler, and again when home assistant restarts
+  ha.mqtt.onConnected(onMqttConnected);
+  ha.mqtt.onMessage(onMqttMessage);
+
   // [2] -- set up the HA control plane --
 
-  logStatus("Setting up subsystems and connecting HA control plane...");
+  LOG_STATUS("Setting up subsystems and connecting HA control plane...");
   setupSmartMeter();     
+  setupRemoteConfig();      // the saved tuning, over the defaults setupSmartMeter used
+  setupDiagnostics();
+  setupDerivedMetrics();
+#ifdef METER_HISTORY
+  setupHistory();
+#endif
+  setupDiscovery();
+  logStaticStringStats();   // all the uids and names are in place by now
     
   // [3] -- connect to the WiFiClient and MQTT --
 
-  logStatus("Connecting to MQTT Broker...");
+  LOG_STATUS("Connecting to MQTT Broker...");
   // Initialize the HAMqtt object
-
-  while(!ha.mqtt.begin(config.mqttBrokerAddress, config.secretMqttUser.c_str(), config.secretMqttPassword.c_str())) {
-    logError("Retrying in 5 seconds...");
+  setupMqttTls();
+#ifdef MQTT_TLS
+  ha.mqtt.setKeepAlive(MQTT_TLS_KEEP_ALIVE_S);
+#endif
+
+  // by name if there is one, TLS needs it to check the broker's certificate
+  bool byName = (config.mqttBrokerHost != "none") && (config.mqttBrokerHost.length() > 0);
+  while (!(byName ? ha.mqtt.begin(config.mqttBrokerHost.c_str(), mqttBrokerPort(), config.secretMqttUser.c_str(), config.secretMqttPassword.c_str())
+                  : ha.mqtt.begin(config.mqttBrokerAddress, mqttBrokerPort(), config.secretMqttUser.c_str(), config.secretMqttPassword.c_str()))) {
+    LOG_ERROR("Retrying in 5 seconds...");
     delay(5000);
   }
   
-  logStatus("Connected to MQTT Broker");
+  LOG_STATUS("Connected to MQTT Broker");
   ha.device.publishAvailability();
 
 }
\ No newline at end of file
@@ -0,0 +1,205 @@
+// ----[HOME ASSISTANT DERIVED METRICS]-----
+// energy, balance and cost worked out on the device from the readings (see sys_energy_integrator.h)
+//
+// once an interval every meter sends one json message on <data prefix>/<device id>/meter_<modbus id>/derived
+// with the energy integrated from its active power over the interval (import, export and the net
+// of the two, in Wh), how far its own import and export registers moved over the same interval,
+// and the integrated import and export since boot (kWh, total_increasing, so a reboot is just a
+// new cycle to home assistant).  The device sends <data prefix>/<device id>/derived with the net
+// across all the meters and the cost of the interval and overall at the configured tariff.  The
+// overall cost is a "total" to home assistant, which would take a drop back to 0 as money coming
+// in, so it is kept in Preferences and carries on across a reboot.  The integrated kWh are not,
+// a restored figure a little behind the last one sent would look like a meter reset and be
+// counted again, where starting from 0 is just a new cycle.
+// The net and the cost assume the meters measure separate circuits, a meter that sits downstream
+// of another would be counted twice.
+//
+// like the diagnostics, the entities are hand built so they take nothing from the ArduinoHA
+// entity slots (PROVISION_MAX_ENTITIES), which are all used up by the meter fields on a full bus
+
+#pragma once
+
+#include "home_assistant_discovery.h"
+
+#define DERIVED_INTERVAL_MS   60000   // length of a derived metrics interval
+#define DERIVED_PREFS         "derived" // Preferences namespace for the running cost
+
+// the cost totals for the device, the prices are read from the config once at setup
+struct DerivedTotalsType {
+  float importPrice = 0;      // per kWh
+  float exportPrice = 0;
+  float intervalNetWh = 0;    // across all the meters, in the last completed interval
+  float intervalCost = 0;
+  double totalCost = 0;       // since first set up, restored at boot
+} derivedTotals;
+
+// the per meter figures, in the order they go in the message
+#define DERIVED_METER_FIGURE_COUNT  7
+struct DerivedFigureType {
+  const char* key;
+  const char* name;
+  const char* unit;
+  const char* deviceClass;
+  const char* stateClass;
+  uint8_t inputField;     // only announced when the meter reads this field
+};
+const DerivedFigureType derivedMeterFigures[DERIVED_METER_FIGURE_COUNT] = {
+  { "intervalImport",   "Interval Energy Import",   "Wh",  nullptr,  "measurement",      METER_POWER_FIELD },
+  { "intervalExport",   "Interval Energy Export",   "Wh",  nullptr,  "measurement",      METER_POWER_FIELD },
+  { "intervalNet",      "Interval Energy Net",      "Wh",  nullptr,  "measurement",      METER_POWER_FIELD },
+  { "integratedImport", "Integrated Energy Import", "kWh", "energy", "total_increasing", METER_POWER_FIELD },
+  { "integratedExport", "Integrated Energy Export", "kWh", "energy", "total_increasing", METER_POWER_FIELD },
+  { "importDelta",      "Register Import Delta",    "Wh",  nullptr,  "measurement",      METER_IMPORT_ENERGY_FIELD },
+  { "exportDelta",      "Register Export Delta",    "Wh",  nullptr,  "measurement",      METER_EXPORT_ENERGY_FIELD }
+};
+
+float derivedMeterFigure(const DerivedMeterType& derived, uint8_t figure) {
+  switch (figure) {
+    case 0: return derived.interval.importWh;
+    case 1: return derived.interval.exportWh;
+    case 2: return derived.interval.importWh - derived.interval.exportWh;
+    case 3: return derived.totalImportWh / 1000;
+    case 4: return derived.totalExportWh / 1000;
+    case 5: return derived.interval.registerImportWh;
+    default: return derived.interval.registerExportWh;
+  }
+}
+
+void buildMeterDerivedTopic(char* topic, size_t size, const HADataType::HAEntitiesType& smartMeterHA) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "meter_%d/derived", smartMeterHA.modbusID);
+  buildDeviceTopic(topic, size, suffix);
+}
+
+// announce the derived entities, a discovery scheduler source
+void publishDerivedDiscovery(DiscoveryCursorType& cursor) {
+  if (ha.meterCount == 0) {
+    return;
+  }
+
+  char stateTopic[HA_TOPIC_BUFFER_SIZE];
+  char objectId[UID_BUFFER_SIZE];
+  char name[ENTITY_NAME_BUFFER_SIZE];
+  char valueTemplate[64];
+
+  HADiscoveryEntityType entity;
+  entity.stateTopic = stateTopic;
+  entity.objectId = objectId;
+  entity.name = name;
+  entity.valueTemplate = valueTemplate;
+  entity.icon = "mdi:sigma";
+  entity.expireAfter = 3 * DERIVED_INTERVAL_MS / 1000;    // a few missed intervals
+
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    buildMeterDerivedTopic(stateTopic, sizeof(stateTopic), smartMeterHA);
+    for (uint8_t figure = 0; figure < DERIVED_METER_FIGURE_COUNT; figure++) {
+      const DerivedFigureType& description = derivedMeterFigures[figure];
+      if (!(smartMeterHA.enabledFields & meterFieldBit(description.inputField)) || !cursor.next()) {
+        continue;
+      }
+      snprintf(objectId, sizeof(objectId), "%s_%d_%s", uniqueChipID(), smartMeterHA.modbusID, description.key);
+      snprintf(name, sizeof(name), "[%s] %s", smartMeterHA.label, description.name);
+      snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", description.key);
+      entity.unit = description.unit;
+      entity.deviceClass = description.deviceClass;
+      entity.stateClass = description.stateClass;
+      publishDiscoveryConfig(entity);
+    }
+  }
+
+  // the balance and cost, from the device message
+  buildDeviceTopic(stateTopic, sizeof(stateTopic), "derived");
+  entity.icon = "mdi:scale-balance";
+  entity.unit = "Wh";
+  entity.deviceClass = nullptr;
+  entity.stateClass = "measurement";
+  if (cursor.next()) {
+    snprintf(objectId, sizeof(objectId), "%s_netEnergy", uniqueChipID());
+    snprintf(name, sizeof(name), "Interval Energy Net");
+    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.netEnergy }}");
+    publishDiscoveryConfig(entity);
+  }
+
+  entity.icon = "mdi:cash";
+  entity.unit = config.currency.c_str();
+  if (cursor.next()) {
+    snprintf(objectId, sizeof(objectId), "%s_intervalCost", uniqueChipID());
+    snprintf(name, sizeof(name), "Interval Cost");
+    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.intervalCost }}");
+    publishDiscoveryConfig(entity);
+  }
+  entity.deviceClass = "monetary";
+  entity.stateClass = "total";
+  if (cursor.next()) {
+    snprintf(objectId, sizeof(objectId), "%s_totalCost", uniqueChipID());
+    snprintf(name, sizeof(name), "Cost");
+    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.totalCost }}");
+    publishDiscoveryConfig(entity);
+  }
+}
+
+// close the interval on every meter and work out the totals, whether or not they can be sent
+void closeDerivedInterval() {
+  float importWh = 0;
+  float exportWh = 0;
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    DerivedMeterType& derived = ha.meters[m].derived;
+    derived.closeInterval();
+    importWh += derived.interval.importWh;
+    exportWh += derived.interval.exportWh;
+  }
+  derivedTotals.intervalNetWh = importWh - exportWh;
+  derivedTotals.intervalCost = (importWh * derivedTotals.importPrice - exportWh * derivedTotals.exportPrice) / 1000;
+  if (derivedTotals.intervalCost != 0) {
+    derivedTotals.totalCost += derivedTotals.intervalCost;
+    // one small entry a minute at most, well inside what the NVS wear levelling copes with
+    preferences.begin(DERIVED_PREFS);
+    preferences.putBytes("total_cost", &derivedTotals.totalCost, sizeof(derivedTotals.totalCost));
+    preferences.end();
+  }
+}
+
+void onPublishDerivedEvent() {
+  closeDerivedInterval();
+  if (!ha.mqtt.isConnected() || (ha.meterCount == 0)) {
+    return;   // the totals carry on, only this interval's figures are missed
+  }
+
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    buildMeterDerivedTopic(topic, sizeof(topic), smartMeterHA);
+    PayloadWriterType json(payload, sizeof(payload));
+    json.beginObject();
+    for (uint8_t figure = 0; figure < DERIVED_METER_FIGURE_COUNT; figure++) {
+      json.num(derivedMeterFigures[figure].key, derivedMeterFigure(smartMeterHA.derived, figure), 3);
+    }
+    json.endObject();
+    ha.mqtt.publish(topic, json.c_str());
+  }
+
+  buildDeviceTopic(topic, sizeof(topic), "derived");
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  json.num("netEnergy", derivedTotals.intervalNetWh, 3);
+  json.num("intervalCost", derivedTotals.intervalCost, 4);
+  json.num("totalCost", derivedTotals.totalCost, 2);
+  json.endObject();
+  ha.mqtt.publish(topic, json.c_str());
+}
+
+void setupDerivedMetrics() {
+  derivedTotals.importPrice = atof(config.tariffImport.c_str());
+  derivedTotals.exportPrice = atof(config.tariffExport.c_str());
+  preferences.begin(DERIVED_PREFS, true);
+  if (preferences.getBytes("total_cost", &derivedTotals.totalCost, sizeof(derivedTotals.totalCost)) != sizeof(derivedTotals.totalCost)) {
+    derivedTotals.totalCost = 0;    // first boot
+  }
+  preferences.end();
+  ha.timers.publishDerived.onRun(onPublishDerivedEvent);
+  ha.timers.publishDerived.setInterval(DERIVED_INTERVAL_MS);
+  ha.timers.publishDerived.enabled = true;
+}
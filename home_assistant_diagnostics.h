@@ -0,0 +1,167 @@
+// ----[HOME ASSISTANT DIAGNOSTICS]-----
+// publishes the instrumentation (see sys_instrumentation.h) as diagnostic entities on the device,
+// so the timings can be watched from home assistant while tuning the poll intervals in the field
+//
+// once a minute the device sends one json message on <data prefix>/<device id>/diagnostics with
+// the p50, p95 and peak time of each timed stage over the last minute (in ms) and the free heap,
+// and each meter sends its error counts on <data prefix>/<device id>/meter_<modbus id>/diagnostics.
+// The entities are hand built like the aggregated state ones, so they take nothing from the
+// ArduinoHA entity pool, and they are in the diagnostic category so they stay off the dashboards
+
+#pragma once
+
+#include "home_assistant_discovery.h"
+
+#define DIAGNOSTICS_INTERVAL_MS   60000   // how often the figures go out, and the window the timings cover
+
+// the figures reported for each stage
+#define DIAGNOSTICS_FIGURE_COUNT  3
+constexpr const char* diagnosticsFigureKeys[DIAGNOSTICS_FIGURE_COUNT]  = { "P50", "P95", "Peak" };
+constexpr const char* diagnosticsFigureNames[DIAGNOSTICS_FIGURE_COUNT] = { " P50", " P95", " Peak" };
+
+// the per meter error counts
+#define DIAGNOSTICS_COUNTER_COUNT 3
+constexpr const char* diagnosticsCounterKeys[DIAGNOSTICS_COUNTER_COUNT]  = { "timeouts", "crcErrors", "badResponses" };
+constexpr const char* diagnosticsCounterNames[DIAGNOSTICS_COUNTER_COUNT] = { "Timeouts", "CRC Errors", "Bad Responses" };
+
+SpanReportType diagnosticsReports[INSTRUMENT_STAGE_COUNT];
+
+uint32_t diagnosticsFigureUs(const SpanReportType& report, uint8_t figure) {
+  switch (figure) {
+    case 0: return report.percentileUs(50);
+    case 1: return report.percentileUs(95);
+    default: return report.peakUs();
+  }
+}
+
+uint32_t diagnosticsCounter(const MeterHealthType& health, uint8_t counter) {
+  switch (counter) {
+    case 0: return health.timeouts;
+    case 1: return health.crcErrors;
+    default: return health.badResponses;
+  }
+}
+
+void buildMeterDiagnosticsTopic(char* topic, size_t size, const HADataType::HAEntitiesType& smartMeterHA) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "meter_%d/diagnostics", smartMeterHA.modbusID);
+  buildDeviceTopic(topic, size, suffix);
+}
+
+// announce the diagnostic entities, a discovery scheduler source
+void publishDiagnosticsDiscovery(DiscoveryCursorType& cursor) {
+  char stateTopic[HA_TOPIC_BUFFER_SIZE];
+  char objectId[UID_BUFFER_SIZE];
+  char name[ENTITY_NAME_BUFFER_SIZE];
+  char valueTemplate[64];
+
+  HADiscoveryEntityType entity;
+  entity.stateTopic = stateTopic;
+  entity.objectId = objectId;
+  entity.name = name;
+  entity.valueTemplate = valueTemplate;
+  entity.entityCategory = "diagnostic";
+  entity.stateClass = "measurement";
+  entity.expireAfter = 3 * DIAGNOSTICS_INTERVAL_MS / 1000;    // a few missed reports
+
+  // the stage timings, and the heap, from the device message
+  buildDeviceTopic(stateTopic, sizeof(stateTopic), "diagnostics");
+  entity.icon = "mdi:timer-outline";
+  entity.unit = "ms";
+  entity.deviceClass = "duration";
+  for (uint8_t stage = 0; stage < INSTRUMENT_STAGE_COUNT; stage++) {
+    for (uint8_t figure = 0; figure < DIAGNOSTICS_FIGURE_COUNT; figure++) {
+      if (!cursor.next()) {
+        continue;
+      }
+      snprintf(objectId, sizeof(objectId), "%s_%s%s", uniqueChipID(), instrumentStageKeys[stage], diagnosticsFigureKeys[figure]);
+      snprintf(name, sizeof(name), "%s%s", instrumentStageNames[stage], diagnosticsFigureNames[figure]);
+      snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s%s }}", instrumentStageKeys[stage], diagnosticsFigureKeys[figure]);
+      publishDiscoveryConfig(entity);
+    }
+  }
+
+  entity.icon = "mdi:memory";
+  entity.unit = "B";
+  entity.deviceClass = "data_size";
+  if (cursor.next()) {
+    snprintf(objectId, sizeof(objectId), "%s_freeHeap", uniqueChipID());
+    snprintf(name, sizeof(name), "Free Heap");
+    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.freeHeap }}");
+    publishDiscoveryConfig(entity);
+  }
+  if (cursor.next()) {
+    snprintf(objectId, sizeof(objectId), "%s_minFreeHeap", uniqueChipID());
+    snprintf(name, sizeof(name), "Min Free Heap");
+    snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.minFreeHeap }}");
+    publishDiscoveryConfig(entity);
+  }
+
+  // the error counts, from each meter's message
+  entity.icon = "mdi:alert-circle-outline";
+  entity.unit = nullptr;
+  entity.deviceClass = nullptr;
+  entity.stateClass = "total_increasing";
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    buildMeterDiagnosticsTopic(stateTopic, sizeof(stateTopic), smartMeterHA);
+    for (uint8_t counter = 0; counter < DIAGNOSTICS_COUNTER_COUNT; counter++) {
+      if (!cursor.next()) {
+        continue;
+      }
+      snprintf(objectId, sizeof(objectId), "%s_%d_%s", uniqueChipID(), smartMeterHA.modbusID, diagnosticsCounterKeys[counter]);
+      snprintf(name, sizeof(name), "[%s] %s", smartMeterHA.label, diagnosticsCounterNames[counter]);
+      snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s }}", diagnosticsCounterKeys[counter]);
+      publishDiscoveryConfig(entity);
+    }
+  }
+}
+
+// send the figures, the timing window only moves on when they actually go out
+void onPublishDiagnosticsEvent() {
+  if (!ha.mqtt.isConnected()) {
+    return;   // the next report covers the outage too
+  }
+
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+  char key[32];
+
+  buildDeviceTopic(topic, sizeof(topic), "diagnostics");
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  for (uint8_t stage = 0; stage < INSTRUMENT_STAGE_COUNT; stage++) {
+    SpanReportType& report = diagnosticsReports[stage];
+    report.update(instrumentation.stage(stage));
+    for (uint8_t figure = 0; figure < DIAGNOSTICS_FIGURE_COUNT; figure++) {
+      snprintf(key, sizeof(key), "%s%s", instrumentStageKeys[stage], diagnosticsFigureKeys[figure]);
+      json.num(key, diagnosticsFigureUs(report, figure) / 1000.0f, 3);
+    }
+  }
+  json.integer("freeHeap", freeHeapBytes());
+  json.integer("minFreeHeap", minFreeHeapBytes());
+  json.endObject();
+  if (json.overflowed()) {
+    LOG_ERROR("Diagnostics message too long");
+  } else {
+    ha.mqtt.publish(topic, json.c_str());
+  }
+
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    buildMeterDiagnosticsTopic(topic, sizeof(topic), smartMeterHA);
+    PayloadWriterType meterJson(payload, sizeof(payload));
+    meterJson.beginObject();
+    for (uint8_t counter = 0; counter < DIAGNOSTICS_COUNTER_COUNT; counter++) {
+      meterJson.integer(diagnosticsCounterKeys[counter], diagnosticsCounter(smartMeterHA.health, counter));
+    }
+    meterJson.endObject();
+    ha.mqtt.publish(topic, meterJson.c_str());
+  }
+}
+
+void setupDiagnostics() {
+  ha.timers.publishDiagnostics.onRun(onPublishDiagnosticsEvent);
+  ha.timers.publishDiagnostics.setInterval(DIAGNOSTICS_INTERVAL_MS);
+  ha.timers.publishDiagnostics.enabled = true;
+}
@@ -0,0 +1,301 @@
+// ----[HOME ASSISTANT HAND BUILT MQTT MESSAGES]-----
+// helpers for publishing discovery configs and state messages straight through ha.mqtt, for
+// entities that are not backed by an ArduinoHA device type object (e.g. the aggregated meter
+// state, where many entities read their value out of one json state message)
+//
+// everything is formatted into fixed buffers, there are no String or heap allocations here.
+// property names use the same abbreviations as ArduinoHA so the configs look the same on the broker.
+
+#pragma once
+
+#include "home_assistant.h"
+
+#define HA_TOPIC_BUFFER_SIZE    128     // longest topic we build
+#define HA_PAYLOAD_BUFFER_SIZE  1024    // longest discovery config or state message we build
+
+// appends json to a fixed char buffer, once it runs out of room it stops writing and flags the overflow
+class PayloadWriterType {
+public:
+  PayloadWriterType(char* buffer, size_t size) : buf(buffer), capacity(size) {
+    this->buf[0] = '\0';
+  }
+
+  const char* c_str() const { return this->buf; }
+  size_t length() const { return this->used; }
+  bool overflowed() const { return this->overflow; }
+
+  void raw(const char* text) {
+    size_t n = strlen(text);
+    if (this->overflow || (this->used + n >= this->capacity)) {
+      this->overflow = true;
+      return;
+    }
+    memcpy(this->buf + this->used, text, n + 1);
+    this->used += n;
+  }
+
+  // start or end a json object, with a key if it is nested
+  void beginObject(const char* key = nullptr) {
+    separator();
+    if (key) {
+      writeKey(key);
+    }
+    raw("{");
+    this->first = true;
+  }
+
+  void endObject() {
+    raw("}");
+    this->first = false;
+  }
+
+  // start or end a json array, with a key if it is inside an object
+  void beginArray(const char* key = nullptr) {
+    separator();
+    if (key) {
+      writeKey(key);
+    }
+    raw("[");
+    this->first = true;
+  }
+
+  void endArray() {
+    raw("]");
+    this->first = false;
+  }
+
+  // "key":"value", skipped when value is nullptr so optional properties can be passed straight in.
+  // The value is escaped, it may have come from the config or off the network
+  void str(const char* key, const char* value) {
+    if (!value) {
+      return;
+    }
+    separator();
+    writeKey(key);
+    raw("\"");
+    escaped(value);
+    raw("\"");
+  }
+
+  // "key":value with a fixed number of decimal places.  The numbers take a nullptr key for an
+  // element of an array
+  void num(const char* key, float value, uint8_t decimals = 2) {
+    char number[24];
+    dtostrf(value, 1, decimals, number);
+    separator();
+    if (key) {
+      writeKey(key);
+    }
+    raw(number);
+  }
+
+  void integer(const char* key, long value) {
+    char number[16];
+    snprintf(number, sizeof(number), "%ld", value);
+    separator();
+    if (key) {
+      writeKey(key);
+    }
+    raw(number);
+  }
+
+  void boolean(const char* key, bool value) {
+    separator();
+    writeKey(key);
+    raw(value ? "true" : "false");
+  }
+
+private:
+  char* buf;
+  size_t capacity;
+  size_t used = 0;
+  bool overflow = false;
+  bool first = true;    // no comma needed before the next property
+
+  void separator() {
+    if (!this->first) {
+      raw(",");
+    }
+    this->first = false;
+  }
+
+  // text inside a json string, with the quotes, backslashes and control characters escaped
+  void escaped(const char* text) {
+    char piece[8];
+    for (const char* c = text; *c && !this->overflow; c++) {
+      if ((*c == '"') || (*c == '\\')) {
+        snprintf(piece, sizeof(piece), "\\%c", *c);
+      } else if ((uint8_t)*c < 0x20) {
+        snprintf(piece, sizeof(piece), "\\u%04x", (uint8_t)*c);
+      } else {
+        piece[0] = *c;
+        piece[1] = '\0';
+      }
+      raw(piece);
+    }
+  }
+
+  void writeKey(const char* key) {
+    raw("\"");
+    raw(key);
+    raw("\":");
+  }
+};
+
+// description of an entity to announce, all strings are borrowed and may be nullptr if unused
+struct HADiscoveryEntityType {
+  const char* component = "sensor";       // home assistant platform
+  const char* objectId = nullptr;         // entity part of the unique id (the device id is prefixed)
+  const char* name = nullptr;
+  const char* stateTopic = nullptr;
+  const char* valueTemplate = nullptr;
+  const char* icon = nullptr;
+  const char* unit = nullptr;
+  const char* deviceClass = nullptr;
+  const char* stateClass = nullptr;
+  const char* entityCategory = nullptr;   // "diagnostic" or "config" to keep the entity off the main dashboard
+  uint16_t expireAfter = 0;               // seconds without an update before the entity goes unavailable (0 = never)
+};
+
+// build a topic under the device on the data prefix, e.g. aha/<device id>/<suffix>
+void buildDeviceTopic(char* topic, size_t size, const char* suffix) {
+  snprintf(topic, size, "%s/%s/%s", ha.mqtt.getDataPrefix(), ha.device.getUniqueId(), suffix);
+}
+
+// publish a retained discovery config, so home assistant creates (or updates) the entity
+bool publishDiscoveryConfig(const HADiscoveryEntityType& entity) {
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+  char uniqueId[HA_TOPIC_BUFFER_SIZE];
+  char availabilityTopic[HA_TOPIC_BUFFER_SIZE];
+
+  // same layout ArduinoHA uses with extended unique ids: the device id is prefixed
+  snprintf(uniqueId, sizeof(uniqueId), "%s_%s", ha.device.getUniqueId(), entity.objectId);
+  snprintf(topic, sizeof(topic), "%s/%s/%s/%s/config", ha.mqtt.getDiscoveryPrefix(), entity.component, ha.device.getUniqueId(), entity.objectId);
+  buildDeviceTopic(availabilityTopic, sizeof(availabilityTopic), "avty_t");
+
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  json.str("name", entity.name);
+  json.str("uniq_id", uniqueId);
+  json.str("stat_t", entity.stateTopic);
+  json.str("val_tpl", entity.valueTemplate);
+  json.str("ic", entity.icon);
+  json.str("unit_of_meas", entity.unit);
+  json.str("dev_cla", entity.deviceClass);
+  json.str("stat_cla", entity.stateClass);
+  json.str("ent_cat", entity.entityCategory);
+  if (entity.expireAfter > 0) {
+    json.integer("exp_aft", entity.expireAfter);
+  }
+  json.str("avty_t", availabilityTopic);
+  json.beginObject("dev");
+  json.str("ids", ha.device.getUniqueId());
+  json.str("name", config.deviceID.c_str());
+  json.str("sw", config.deviceSoftwareVersion.c_str());
+  json.str("mf", config.deviceManufacturer.c_str());
+  json.str("mdl", config.deviceModel.c_str());
+  json.endObject();
+  json.endObject();
+
+  if (json.overflowed()) {
+    LOG_ERROR("Discovery config too long for %s", entity.objectId);
+    return false;
+  }
+  return ha.mqtt.publish(topic, json.c_str(), true);
+}
+
+// ----[discovery scheduler]-----
+// sending every discovery config in one go on connect is hundreds of large messages with a few
+// meters on the bus, which holds up loop() for seconds and can overrun the socket buffer on the
+// Nano IoT 33.  So the configs are sent a few at a time from a timer instead (DISCOVERY_CHUNK
+// every DISCOVERY_TICK_MS), and the state messages go out in between as normal.
+//
+// each source is a function that walks its configs in a fixed order, asking the cursor before
+// each one whether it is wanted on this pass, e.g.
+//
+//   for (...) { if (cursor.next()) { ...build the entity...; publishDiscoveryConfig(entity); } }
+//
+// so the source needs no state of its own to pick up where it left off, and the skipped ones
+// cost no more than the loop.  The configs are retained, so they are only sent again when asked:
+// after boot, and when home assistant comes back online (see onMqttMessage in home_assistant.h)
+
+#define DISCOVERY_SOURCES_MAX   6     // functions that can be registered with the scheduler
+#define DISCOVERY_CHUNK         4     // configs sent per tick
+#define DISCOVERY_TICK_MS       100   // gap between chunks
+
+class DiscoveryCursorType {
+public:
+  // pick out count configs starting at first, counting from the start of the source
+  void select(uint16_t first, uint16_t count) {
+    this->index = 0;
+    this->first = first;
+    this->last = first + count;
+  }
+
+  // call before each config, true if this one is to be sent now
+  bool next() {
+    bool wanted = (this->index >= this->first) && (this->index < this->last);
+    this->index++;
+    return wanted;
+  }
+
+  // after the source has run: how many of the selected configs it had, and whether it ran out
+  uint16_t taken() const {
+    uint16_t end = (this->index < this->last) ? this->index : this->last;
+    return (end > this->first) ? end - this->first : 0;
+  }
+  bool exhausted() const { return this->index < this->last; }
+
+private:
+  uint16_t index = 0;
+  uint16_t first = 0;
+  uint16_t last = 0;
+};
+
+typedef void (*DiscoverySourceType)(DiscoveryCursorType& cursor);
+
+class DiscoverySchedulerType {
+public:
+  bool addSource(DiscoverySourceType source) {
+    if (this->sourceCount >= DISCOVERY_SOURCES_MAX) {
+      return false;
+    }
+    this->sources[this->sourceCount++] = source;
+    return true;
+  }
+
+  // send everything again, from the first config of the first source
+  void restart() {
+    this->source = 0;
+    this->item = 0;
+    this->sent = 0;
+  }
+
+  bool busy() const { return this->source < this->sourceCount; }
+  uint16_t sentSoFar() const { return this->sent; }
+
+  // send up to count configs, moving on to the next source as each one runs out
+  void run(uint8_t count) {
+    DiscoveryCursorType cursor;
+    while ((count > 0) && busy()) {
+      cursor.select(this->item, count);
+      this->sources[this->source](cursor);
+      uint16_t taken = cursor.taken();
+      this->item += taken;
+      this->sent += taken;
+      count -= taken;
+      if (cursor.exhausted()) {
+        this->source++;
+        this->item = 0;
+      }
+    }
+  }
+
+private:
+  DiscoverySourceType sources[DISCOVERY_SOURCES_MAX] = {};
+  uint8_t sourceCount = 0;
+  uint8_t source = DISCOVERY_SOURCES_MAX;   // nothing to send until the first restart()
+  uint16_t item = 0;
+  uint16_t sent = 0;
+} discoveryScheduler;
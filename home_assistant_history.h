@@ -0,0 +1,157 @@
+// ----[HOME ASSISTANT HISTORY]-----
+// the last couple of days of power and energy for every meter, kept in flash on the device (see
+// sys_history_log.h), so nothing is lost to a long outage and no database is needed to look back
+//
+// every HISTORY_INTERVAL_MS a point goes into the log for each meter, with its latest active power
+// and import and export energy.  Something on the network (an automation filling a gap in home
+// assistant after an outage, a chart, a script) asks for a range of it by publishing
+//     <modbus id>,<from>,<to>
+// on <data prefix>/<device id>/history/get, the times in unix seconds (leave <to> off for up to
+// now).  The points come back on <data prefix>/<device id>/meter_<modbus id>/history, a message
+// at a time so the rest of the MQTT traffic isn't held up:
+//     {"id":1,"points":[[1760000000,1234.5,10234.567,12.345],...],"more":true}
+// each point is the time, power in W and energy in kWh.  "more" is false on the last message.
+// One query runs at a time, a new one replaces any still being sent.
+//
+// needs the clock, so it is set from NTP here.  Nothing is logged until it has been set.
+//
+// a meter that has read nothing since its last point (it has stopped answering) is left out, so
+// an outage shows up as a gap in its history rather than its last readings carried on as if fresh.
+// A channel that wasn't read in the interval (energy is read less often) keeps its last value
+
+#pragma once
+
+#ifdef METER_HISTORY
+
+#include <time.h>
+#include "home_assistant_discovery.h"
+
+#define HISTORY_INTERVAL_MS     60000       // a point per meter this often, 2 days for 16 meters
+#define HISTORY_FLUSH_MS        600000      // the page in RAM is written to flash this often, what a power cut can lose
+#define HISTORY_REPLY_MS        200         // one reply message this often while a query is running
+#define HISTORY_REPLY_POINTS    16          // points in a reply message, keeps it within HA_PAYLOAD_BUFFER_SIZE
+#define HISTORY_NTP_SERVER      "pool.ntp.org"
+#define HISTORY_MIN_VALID_S     1704067200UL    // 2024-01-01, anything earlier means the clock isn't set yet
+
+// the fixed point steps each channel is kept in, per unit of the reading (see historyFields)
+const float historyScales[HISTORY_CHANNELS] = { 10.0f, 1000.0f, 1000.0f };   // 0.1W, Wh, Wh
+const uint8_t historyDecimals[HISTORY_CHANNELS] = { 1, 3, 3 };
+
+HistoryLogType historyLog;
+HistoryQueryType historyQuery;
+bool historyReplying = false;     // a query has been asked for and its last message isn't out yet
+unsigned long historyLastFlushMs = 0;
+
+void buildHistoryRequestTopic(char* topic, size_t size) {
+  buildDeviceTopic(topic, size, "history/get");
+}
+
+// log a point for every meter that has read something to put in it
+void onRecordHistoryEvent() {
+  uint32_t now = time(nullptr);
+  if (now < HISTORY_MIN_VALID_S) {
+    return;   // no NTP yet
+  }
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    if (smartMeterHA.history.seen == 0) {
+      continue;   // nothing read since the last point
+    }
+    HistoryPointType point;
+    point.timeS = now;
+    point.stream = smartMeterHA.modbusID;
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+      point.values[c] = lroundf(smartMeterHA.history.values[c] * historyScales[c]);
+    }
+    historyLog.append(point);
+    smartMeterHA.history.seen = 0;
+  }
+  if (millis() - historyLastFlushMs >= HISTORY_FLUSH_MS) {
+    historyLastFlushMs = millis();
+    historyLog.flush();
+  }
+}
+
+// send the next message of the query under way
+void onPublishHistoryEvent() {
+  if (!historyReplying || !ha.mqtt.isConnected()) {
+    return;
+  }
+  HistoryPointType points[HISTORY_REPLY_POINTS];
+  HistoryQueryType resumeAt = historyQuery;     // read() moves the query on, back to here if the publish fails
+  uint16_t n = historyLog.read(historyQuery, points, HISTORY_REPLY_POINTS);
+
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "meter_%d/history", historyQuery.stream);
+  buildDeviceTopic(topic, sizeof(topic), suffix);
+
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  json.integer("id", historyQuery.stream);
+  json.beginArray("points");
+  for (uint16_t i = 0; i < n; i++) {
+    json.beginArray();
+    json.integer(nullptr, points[i].timeS);
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+      json.num(nullptr, points[i].values[c] / historyScales[c], historyDecimals[c]);
+    }
+    json.endArray();
+  }
+  json.endArray();
+  json.boolean("more", !historyQuery.done);
+  json.endObject();
+  if (json.overflowed()) {
+    LOG_ERROR("History reply too long, query dropped");
+    historyReplying = false;
+  } else if (ha.mqtt.publish(topic, json.c_str())) {
+    historyReplying = !historyQuery.done;
+  } else {
+    historyQuery = resumeAt;    // send the same points again next time
+  }
+}
+
+// a query on the request topic.  Returns false if the message was for something else
+bool onHistoryMqttMessage(const char* topic, const uint8_t* payload, uint16_t length) {
+  char requestTopic[HA_TOPIC_BUFFER_SIZE];
+  buildHistoryRequestTopic(requestTopic, sizeof(requestTopic));
+  if (strcmp(topic, requestTopic) != 0) {
+    return false;
+  }
+
+  char request[48];
+  uint16_t n = (length < sizeof(request) - 1) ? length : sizeof(request) - 1;
+  memcpy(request, payload, n);
+  request[n] = '\0';
+  unsigned int id = 0;
+  unsigned long fromS = 0;
+  unsigned long toS = UINT32_MAX;
+  if ((sscanf(request, "%u,%lu,%lu", &id, &fromS, &toS) < 2) || (id == 0) || (id > 247)) {
+    LOG_ERROR("Bad history request '%s', expected <modbus id>,<from>,<to>", request);
+    return true;
+  }
+  historyLog.seek(historyQuery, id, fromS, toS);
+  historyReplying = true;   // even an empty range gets its one message, so the asker isn't left waiting
+  LOG_TEXT("History requested for Modbus Client [%u] from %lu", id, fromS);
+  return true;
+}
+
+void onHistoryMqttConnected() {
+  char requestTopic[HA_TOPIC_BUFFER_SIZE];
+  buildHistoryRequestTopic(requestTopic, sizeof(requestTopic));
+  ha.mqtt.subscribe(requestTopic);
+}
+
+void setupHistory() {
+  configTime(0, 0, HISTORY_NTP_SERVER);   // UTC, the log only ever holds unix time
+  historyLog.begin();
+  ha.timers.recordHistory.onRun(onRecordHistoryEvent);
+  ha.timers.recordHistory.setInterval(HISTORY_INTERVAL_MS);
+  ha.timers.recordHistory.enabled = true;
+  ha.timers.publishHistory.onRun(onPublishHistoryEvent);
+  ha.timers.publishHistory.setInterval(HISTORY_REPLY_MS);
+  ha.timers.publishHistory.enabled = true;
+}
+
+#endif
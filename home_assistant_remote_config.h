@@ -0,0 +1,414 @@
+// ----[HOME ASSISTANT REMOTE CONFIG]-----
+// the tuning that otherwise needs the serial console, changed over MQTT while the device runs:
+// the poll periods of the register groups, which fields are read off each meter and the publish
+// deadbands.  A change is applied straight away, no restart, and saved to the config so it is
+// still there after the next boot.  Publish a document of ; separated parts, any of
+//     poll=<power ms>,<demand ms>,<energy ms>      (or poll=default)
+//     fields=<modbus id>:<field mask in hex>,...
+//     deadband=<filter>:<band>,...                 (or deadband=default)
+// on <data prefix>/<device id>/config/set, e.g. "poll=2000,60000,120000;fields=1:7F,2:0" to fleet
+// tune a slower poll and stop reading meter 2.  A poll list shorter than the groups goes on with
+// its last period (as the bus settings do), the filters are the ones in publishFilterNames.  The
+// power period can't go over ENERGY_MAX_POWER_PERIOD_MS, or the energy integrator would see every
+// pair of samples as a gap and stop adding up.
+//
+// the whole document is checked before any of it is applied, so a typo changes nothing.  The
+// outcome comes back on <data prefix>/<device id>/config, with the settings now in force:
+//     {"result":"ok","poll":[2000,60000,120000],"deadband":{"voltage":0.5,...},"meters":[{"id":1,"fields":"7F"},...]}
+// and the same (without a result) is sent on every connect, so it shows what each device runs.
+//
+// only what changed is touched: a new poll period just resets the group's timer, and a new mask
+// is picked up by the read plan on the meter's next read.  A field taken off stops being published
+// and its entity expires in home assistant.  With the ArduinoHA entities a field can only be put
+// back if it had an entity at boot, the pool is sized then; in the other modes the discovery is
+// resent so home assistant picks up the new fields.  Meters can't be added or removed without a
+// restart (they are what the entities were built for), but a mask of 0 stops one being read.  With
+// the entities, a meter saved with a mask of 0 has none after the next boot, so it is back to the console.
+//
+// in dual core mode the masks and the timers are read by the modbus task, but they are single
+// word writes and the worst a read that straddles one sees is the old setting for one more cycle
+
+#pragma once
+
+#include "home_assistant_discovery.h"
+
+#define REMOTE_CONFIG_MAX_LENGTH    256     // longest config document taken, the rest is dropped
+#define REMOTE_CONFIG_ERROR_LENGTH  64
+
+// a config document, checked and ready to apply
+struct RemoteConfigChangeType {
+  bool pollSet = false;
+  unsigned long pollMs[REGISTER_GROUP_COUNT];
+  bool fieldsSet[METER_POOL_SIZE] = {};           // in ha.meters order
+  MeterFieldMaskType fields[METER_POOL_SIZE];
+  bool deadbandSet[PUBLISH_FILTER_COUNT] = {};    // in publishFilterNames order
+  float deadband[PUBLISH_FILTER_COUNT];
+  char error[REMOTE_CONFIG_ERROR_LENGTH] = "";    // why the document was turned down
+};
+
+float publishDefaultDeadbands[PUBLISH_FILTER_COUNT];   // the register table's, for deadband=default
+
+void buildRemoteConfigTopic(char* topic, size_t size, bool request) {
+  buildDeviceTopic(topic, size, request ? "config/set" : "config");
+}
+
+int8_t findPublishFilter(const String& name) {
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    if (name.equalsIgnoreCase(publishFilterNames[f].name)) {
+      return f;
+    }
+  }
+  return -1;
+}
+
+// the fields a meter could be publishing now.  With the ArduinoHA entities that is those given an entity at boot
+MeterFieldMaskType remoteConfigFieldsAvailable(const HADataType::HAEntitiesType& smartMeterHA) {
+#ifdef HA_METER_ENTITIES
+  MeterFieldMaskType available = 0;
+  for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+    if (smartMeterHA.entities[i]) {
+      available |= meterFieldBit(i);
+    }
+  }
+  return available;
+#else
+  (void)smartMeterHA;
+  return METER_ALL_FIELDS;
+#endif
+}
+
+// poll=<ms>,<ms>,<ms> or default
+bool parsePollPeriods(const String& value, RemoteConfigChangeType& change) {
+  for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+    if (value.equalsIgnoreCase("default")) {
+      change.pollMs[group] = registerGroupPeriodMs[group];
+      continue;
+    }
+    long periodMs = configListItem(value, group).toInt();
+    // any slower and the heartbeat would have nothing new to send, or for the power the integrator
+    // would drop the samples as too far apart
+    long maxMs = (group == GROUP_POWER) ? ENERGY_MAX_POWER_PERIOD_MS : METER_HEARTBEAT_MS;
+    if ((periodMs < METER_POLL_TICK_MS) || (periodMs > maxMs)) {
+      snprintf(change.error, sizeof(change.error), "poll period %ld out of %d-%ld ms", periodMs, METER_POLL_TICK_MS, maxMs);
+      return false;
+    }
+    change.pollMs[group] = periodMs;
+  }
+  change.pollSet = true;
+  return true;
+}
+
+// the next <name>:<value> pair of a comma separated list, from start on.  False at the end of the
+// list, or (with change.error set) on an item that isn't a pair
+bool nextRemoteConfigPair(const String& list, int& start, String& name, String& value, RemoteConfigChangeType& change) {
+  while (start < (int)list.length()) {
+    int end = list.indexOf(',', start);
+    if (end < 0) {
+      end = list.length();
+    }
+    String item = list.substring(start, end);
+    start = end + 1;
+    item.trim();
+    if (item.length() == 0) {
+      continue;
+    }
+    int colon = item.indexOf(':');
+    if (colon <= 0) {
+      snprintf(change.error, sizeof(change.error), "'%s' is not <name>:<value>", item.c_str());
+      return false;
+    }
+    name = item.substring(0, colon);
+    value = item.substring(colon + 1);
+    name.trim();
+    value.trim();
+    return true;
+  }
+  return false;
+}
+
+// fields=<modbus id>:<mask>,...
+bool parseMeterFields(const String& list, RemoteConfigChangeType& change) {
+  int start = 0;
+  String name, mask;
+  while (nextRemoteConfigPair(list, start, name, mask, change)) {
+    long modbusID = name.toInt();
+    HADataType::HAEntitiesType* smartMeterHA = ((modbusID >= 1) && (modbusID <= 247)) ? findMeter(modbusID) : nullptr;
+    if (!smartMeterHA) {
+      snprintf(change.error, sizeof(change.error), "no Modbus Client [%s] configured", name.c_str());
+      return false;
+    }
+    char* end = nullptr;
+    MeterFieldMaskType fields = strtoul(mask.c_str(), &end, 16);
+    if ((mask.length() == 0) || (*end != '\0') || (fields & ~METER_ALL_FIELDS)) {
+      snprintf(change.error, sizeof(change.error), "bad field mask '%s' for Modbus Client [%s]", mask.c_str(), name.c_str());
+      return false;
+    }
+    MeterFieldMaskType missing = fields & ~remoteConfigFieldsAvailable(*smartMeterHA);
+    if (missing) {
+      snprintf(change.error, sizeof(change.error), "fields 0x%lX of Modbus Client [%s] have no entity", (unsigned long)missing, name.c_str());
+      return false;
+    }
+    uint8_t m = smartMeterHA - ha.meters;
+    change.fieldsSet[m] = true;
+    change.fields[m] = fields;
+  }
+  return change.error[0] == '\0';
+}
+
+// deadband=<filter>:<band>,... or default
+bool parseDeadbands(const String& list, RemoteConfigChangeType& change) {
+  if (list.equalsIgnoreCase("default")) {
+    for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+      change.deadbandSet[f] = true;
+      change.deadband[f] = publishDefaultDeadbands[f];
+    }
+    return true;
+  }
+  int start = 0;
+  String name, band;
+  while (nextRemoteConfigPair(list, start, name, band, change)) {
+    int8_t f = findPublishFilter(name);
+    if (f < 0) {
+      snprintf(change.error, sizeof(change.error), "no publish filter '%s'", name.c_str());
+      return false;
+    }
+    char* end = nullptr;
+    float deadband = strtod(band.c_str(), &end);
+    bool relative = (publishFilterNames[f].filter->mode == DEADBAND_RELATIVE);
+    if ((band.length() == 0) || (*end != '\0') || (deadband < 0.0f) || (relative && (deadband >= 1.0f))) {
+      // a relative band of 1 or more would never let a reading through
+      snprintf(change.error, sizeof(change.error), "bad %s deadband '%s'", name.c_str(), band.c_str());
+      return false;
+    }
+    change.deadbandSet[f] = true;
+    change.deadband[f] = deadband;
+  }
+  return change.error[0] == '\0';
+}
+
+// check a whole document, false (with change.error set) if any part of it won't do
+bool parseRemoteConfig(const String& document, RemoteConfigChangeType& change) {
+  int start = 0;
+  while (start < (int)document.length()) {
+    int end = document.indexOf(';', start);
+    if (end < 0) {
+      end = document.length();
+    }
+    String part = document.substring(start, end);
+    start = end + 1;
+    part.trim();
+    if (part.length() == 0) {
+      continue;
+    }
+    int equals = part.indexOf('=');
+    String key = (equals < 0) ? part : part.substring(0, equals);
+    String value = (equals < 0) ? String("") : part.substring(equals + 1);
+    key.trim();
+    value.trim();
+    bool ok = false;
+    if (key.equalsIgnoreCase("poll")) {
+      ok = parsePollPeriods(value, change);
+    } else if (key.equalsIgnoreCase("fields")) {
+      ok = parseMeterFields(value, change);
+    } else if (key.equalsIgnoreCase("deadband")) {
+      ok = parseDeadbands(value, change);
+    } else {
+      snprintf(change.error, sizeof(change.error), "unknown setting '%s'", key.c_str());
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the config values, in the form they are loaded from at boot
+String remoteConfigPollList() {
+  String list = "";
+  for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+    list += (group ? "," : "") + String(ha.timers.meterPolling.getPeriod(group));
+  }
+  return list;
+}
+
+String remoteConfigDeadbandList() {
+  String list = "";
+  char band[16];
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    dtostrf(publishFilterNames[f].filter->deadband, 1, 4, band);
+    list += String(f ? "," : "") + publishFilterNames[f].name + ":" + band;
+  }
+  return list;
+}
+
+// the meter list with each meter's bus, label and mask spelled out, see loadMeterList
+String remoteConfigMeterList() {
+  String list = "";
+  char item[48];
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    snprintf(item, sizeof(item), "%s%d@%d:%s:%lX", m ? "," : "", smartMeterHA.modbusID, smartMeterHA.bus + 1, smartMeterHA.label, (unsigned long)smartMeterHA.enabledFields);
+    list += item;
+  }
+  return list;
+}
+
+// take a meter's fields on or off.  What was last sent for a changed field is forgotten, so it goes
+// out in full when it is next read (and drops out of the aggregated state message if it is off)
+void applyMeterFields(HADataType::HAEntitiesType& smartMeterHA, MeterFieldMaskType fields) {
+  MeterFieldMaskType changed = smartMeterHA.enabledFields ^ fields;
+  smartMeterHA.enabledFields = fields;
+  for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+    if (changed & meterFieldBit(i)) {
+      smartMeterHA.fieldState[i].published = false;
+    }
+  }
+  for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+    if (changed & meterFieldBit(meterAggregateFields[a])) {
+      HADataType::HAEntitiesType::FieldStatsType& stats = smartMeterHA.fieldStats[a];
+      stats.window = SampleWindowType();
+      stats.window.windowMs = METER_AGGREGATE_WINDOW_MS;
+      stats.latest = WindowSummaryType();
+    }
+  }
+}
+
+// put a checked document into force and save it.  Each kind of setting is saved in full, so the
+// config always holds a complete list whatever the document left out
+void applyRemoteConfig(const RemoteConfigChangeType& change) {
+  if (change.pollSet) {
+    for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+      ha.timers.meterPolling.setPeriod(group, change.pollMs[group]);
+    }
+    config.pollPeriodsMs = remoteConfigPollList();
+    saveConfigValue("poll_ms", config.pollPeriodsMs);
+    LOG_STATUS("Poll periods now %s ms", config.pollPeriodsMs.c_str());
+  }
+
+  bool fieldsChanged = false;
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    if (change.fieldsSet[m] && (change.fields[m] != ha.meters[m].enabledFields)) {
+      applyMeterFields(ha.meters[m], change.fields[m]);
+      fieldsChanged = true;
+      LOG_STATUS("Modbus Client [%d] now reads fields 0x%lX", ha.meters[m].modbusID, (unsigned long)change.fields[m]);
+    }
+  }
+  if (fieldsChanged) {
+    config.meters = remoteConfigMeterList();
+    saveConfigValue("meters", config.meters);
+#ifndef HA_METER_ENTITIES
+    discoveryScheduler.restart();   // the hand built discovery covers only the enabled fields
+#endif
+  }
+
+  bool deadbandsChanged = false;
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    if (change.deadbandSet[f]) {
+      publishFilterNames[f].filter->deadband = change.deadband[f];
+      deadbandsChanged = true;
+    }
+  }
+  if (deadbandsChanged) {
+    config.publishDeadbands = remoteConfigDeadbandList();
+    saveConfigValue("deadbands", config.publishDeadbands);
+    LOG_STATUS("Publish deadbands now %s", config.publishDeadbands.c_str());
+  }
+}
+
+// the settings in force, and the outcome of a document if there was one
+void publishRemoteConfigState(const char* result) {
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+  char fields[12];
+  buildRemoteConfigTopic(topic, sizeof(topic), false);
+
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  json.str("result", result);
+  json.beginArray("poll");
+  for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+    json.integer(nullptr, ha.timers.meterPolling.getPeriod(group));
+  }
+  json.endArray();
+  json.beginObject("deadband");
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    json.num(publishFilterNames[f].name, publishFilterNames[f].filter->deadband, 4);
+  }
+  json.endObject();
+  json.beginArray("meters");
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    snprintf(fields, sizeof(fields), "%lX", (unsigned long)ha.meters[m].enabledFields);
+    json.beginObject();
+    json.integer("id", ha.meters[m].modbusID);
+    json.str("fields", fields);
+    json.endObject();
+  }
+  json.endArray();
+  json.endObject();
+  if (json.overflowed()) {
+    LOG_ERROR("Config state message too long");
+    return;
+  }
+  ha.mqtt.publish(topic, json.c_str(), true);   // retained, so a fleet tool can see what every device runs
+}
+
+// a document on the config topic.  Returns false if the message was for something else
+bool onRemoteConfigMqttMessage(const char* topic, const uint8_t* payload, uint16_t length) {
+  char requestTopic[HA_TOPIC_BUFFER_SIZE];
+  buildRemoteConfigTopic(requestTopic, sizeof(requestTopic), true);
+  if (strcmp(topic, requestTopic) != 0) {
+    return false;
+  }
+
+  char document[REMOTE_CONFIG_MAX_LENGTH];
+  uint16_t n = (length < sizeof(document) - 1) ? length : sizeof(document) - 1;
+  memcpy(document, payload, n);
+  document[n] = '\0';
+
+  RemoteConfigChangeType change;
+  if (!parseRemoteConfig(String(document), change)) {
+    LOG_ERROR("Config '%s' turned down, %s", document, change.error);
+    publishRemoteConfigState(change.error);
+    return true;
+  }
+  applyRemoteConfig(change);
+  publishRemoteConfigState("ok");
+  return true;
+}
+
+void onRemoteConfigMqttConnected() {
+  char requestTopic[HA_TOPIC_BUFFER_SIZE];
+  buildRemoteConfigTopic(requestTopic, sizeof(requestTopic), true);
+  ha.mqtt.subscribe(requestTopic);
+  publishRemoteConfigState(nullptr);
+}
+
+// put the saved poll periods and deadbands into force, after setupSmartMeter has set up the groups.
+// The field masks are already in the meter list.  A saved value that no longer parses (e.g. the
+// register table changed) is logged and the defaults kept
+void setupRemoteConfig() {
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    publishDefaultDeadbands[f] = publishFilterNames[f].filter->deadband;
+  }
+
+  RemoteConfigChangeType saved;
+  bool ok = true;
+  if (!config.pollPeriodsMs.equalsIgnoreCase("default")) {
+    ok = parsePollPeriods(config.pollPeriodsMs, saved);
+  }
+  if (ok && !config.publishDeadbands.equalsIgnoreCase("default")) {
+    ok = parseDeadbands(config.publishDeadbands, saved);
+  }
+  if (!ok) {
+    LOG_ERROR("Saved tuning not used, %s", saved.error);
+    return;
+  }
+  for (uint8_t group = 0; saved.pollSet && (group < REGISTER_GROUP_COUNT); group++) {
+    ha.timers.meterPolling.setPeriod(group, saved.pollMs[group]);
+  }
+  for (uint8_t f = 0; f < PUBLISH_FILTER_COUNT; f++) {
+    if (saved.deadbandSet[f]) {
+      publishFilterNames[f].filter->deadband = saved.deadband[f];
+    }
+  }
+}
@@ -0,0 +1,182 @@
+// ----[ Eastron SDM120 REGISTER MAP ]-----
+// compile time descriptor table for the input registers we read off the meter and
+// the home assistant entity each one is published to.
+//
+// register values come from the spec for the Eastron SDM120M
+//   https://www.eastroneurope.com/images/uploads/products/protocol/SDM120-MODBUS_Protocol.pdf
+
+#pragma once
+
+#include "home_assistant.h"
+#include "sys_publish_filter.h"     // deadband and rate limits on what gets published
+
+#define MODBUS_INPUT_REGISTER_BASE  30000  // input registers are numbered from the base of 30000 in the spec
+
+// how the raw 16 bit register words are turned into a value
+enum RegisterDecodeType : uint8_t {
+  DECODE_FLOAT32,   // IEEE754 float over 2 registers, high word first (all SDM120 measurements use this)
+  DECODE_UINT32,    // unsigned 32 bit integer over 2 registers, high word first
+  DECODE_INT16      // signed 16 bit integer in a single register
+};
+
+// registers are polled in groups, each group with its own refresh period.  Instantaneous values 
+// change all the time, demand figures are averaged over minutes and energy counters move slowly
+enum RegisterGroupType : uint8_t {
+  GROUP_POWER,      // instantaneous voltage, current, power and frequency
+  GROUP_DEMAND,     // demand and max demand
+  GROUP_ENERGY,     // energy counters
+  REGISTER_GROUP_COUNT
+};
+
+// default poll period for each group
+constexpr unsigned long registerGroupPeriodMs[REGISTER_GROUP_COUNT] = {
+  1000,     // GROUP_POWER
+  30000,    // GROUP_DEMAND
+  60000     // GROUP_ENERGY
+};
+
+// publish filters for the kinds of value on the meter.  The heartbeat must stay well inside the 
+// expire_after on the entities, or they will drop to unavailable while the reading is steady.
+// The deadbands can be tuned at run time (see home_assistant_remote_config.h), so the table 
+// entries point at these rather than holding a copy
+#define METER_HEARTBEAT_MS  120000    // republish unchanged values this often so home assistant knows they are live
+
+//                                              band    mode               min ms  max ms              retain
+PublishFilterType filterVoltage   = { 0.5f,  DEADBAND_ABSOLUTE,  5000, METER_HEARTBEAT_MS, false };  // volts
+PublishFilterType filterCurrent   = { 0.05f, DEADBAND_ABSOLUTE,  2000, METER_HEARTBEAT_MS, false };  // amps
+PublishFilterType filterPower     = { 0.02f, DEADBAND_RELATIVE,  2000, METER_HEARTBEAT_MS, false };  // 2% of the reading
+PublishFilterType filterFactor    = { 0.02f, DEADBAND_ABSOLUTE,  5000, METER_HEARTBEAT_MS, false };  // power factor
+PublishFilterType filterFrequency = { 0.05f, DEADBAND_ABSOLUTE, 10000, METER_HEARTBEAT_MS, false };  // hertz
+PublishFilterType filterDemand    = { 0.01f, DEADBAND_RELATIVE,     0, METER_HEARTBEAT_MS, true  };  // 1% of the reading
+PublishFilterType filterEnergy    = { 0.0f,  DEADBAND_ABSOLUTE,     0, METER_HEARTBEAT_MS, true  };  // every step of the counter
+
+// the filters by the name they are tuned by
+struct PublishFilterNameType {
+  const char* name;
+  PublishFilterType* filter;
+};
+#define PUBLISH_FILTER_COUNT  7
+const PublishFilterNameType publishFilterNames[PUBLISH_FILTER_COUNT] = {
+  { "voltage",   &filterVoltage },
+  { "current",   &filterCurrent },
+  { "power",     &filterPower },
+  { "factor",    &filterFactor },
+  { "frequency", &filterFrequency },
+  { "demand",    &filterDemand },
+  { "energy",    &filterEnergy }
+};
+
+struct MeterRegisterType {
+  uint16_t address;                                     // register number offset from the 30000 base (1 based, as in the spec)
+  uint8_t  words;                                       // number of 16 bit registers holding the value
+  RegisterDecodeType decode;                            // how to decode the raw registers
+  RegisterGroupType group;                              // poll group, sets how often it is read
+
+  // home assistant entity metadata
+  const char* key;                                      // short id, used for unique ids and as the json key in state messages
+  const char* name;                                     // display name, prefixed with the meter label
+  const char* icon;                                     // mdi: icon
+  const char* unit;                                     // unit of measurement (or nullptr)
+  const char* deviceClass;                              // home assistant device class (or nullptr)
+  const char* stateClass;                               // home assistant state class (or nullptr)
+  const PublishFilterType* filter;                      // when a new reading is worth publishing
+};
+
+// keep this table in ascending address order, the decoder relies on it to stop early
+//
+// find your full list fo mdi:icons here: https://pictogrammers.com/library/mdi/
+// and your full list of Units here: https://github.com/home-assistant/core/blob/d7ac4bd65379e11461c7ce0893d3533d8d8b8cbf/homeassistant/const.py#L384
+constexpr MeterRegisterType meterRegisters[] = {
+  {   1, 2, DECODE_FLOAT32, GROUP_POWER,
+      "voltage", "Voltage", "mdi:meter-electric-outline", "V", nullptr, nullptr, &filterVoltage },
+  {   7, 2, DECODE_FLOAT32, GROUP_POWER,
+      "current", "Current", "mdi:current-ac", "A", nullptr, nullptr, &filterCurrent },
+  {  13, 2, DECODE_FLOAT32, GROUP_POWER,
+      "activePower", "Active Power", "mdi:transmission-tower", "W", nullptr, nullptr, &filterPower },
+  {  19, 2, DECODE_FLOAT32, GROUP_POWER,
+      "apparentPower", "Apparent Power", "mdi:transmission-tower", "W", nullptr, nullptr, &filterPower },
+  {  25, 2, DECODE_FLOAT32, GROUP_POWER,
+      "reactivePower", "Reactive Power", "mdi:transmission-tower", "W", nullptr, nullptr, &filterPower },
+  {  31, 2, DECODE_FLOAT32, GROUP_POWER,
+      "powerFactor", "Power Factor", "mdi:ab-testing", nullptr, nullptr, nullptr, &filterFactor },
+  {  71, 2, DECODE_FLOAT32, GROUP_POWER,
+      "frequency", "Frequency", "mdi:sine-wave", "Hz", nullptr, nullptr, &filterFrequency },
+  {  73, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "importActiveEnergy", "Active Energy Import", "mdi:transmission-tower-import", "kWh", nullptr, nullptr, &filterEnergy },
+  {  75, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "exportActiveEnergy", "Active Energy Export", "mdi:transmission-tower-export", "kWh", nullptr, nullptr, &filterEnergy },
+  {  77, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "importReactiveEnergy", "Reactive Energy Import", "mdi:transmission-tower-import", "kvarh", nullptr, nullptr, &filterEnergy },
+  {  79, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "exportReactiveEnergy", "Reactive Energy Export", "mdi:transmission-tower-export", "kvarh", nullptr, nullptr, &filterEnergy },
+  {  85, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "totalSystemPowerDemand", "Total System Power Demand", "mdi:transmission-tower", "W", nullptr, nullptr, &filterDemand },
+  {  87, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "maxTotalSystemPowerDemand", "Max Total System Power Demand", "mdi:transmission-tower", "W", nullptr, nullptr, &filterDemand },
+  {  89, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "importSystemPowerDemand", "Import System Power Demand", "mdi:transmission-tower-import", "W", nullptr, nullptr, &filterDemand },
+  {  91, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "maxImportSystemPowerDemand", "Max Import System Power Demand", "mdi:transmission-tower-import", "W", nullptr, nullptr, &filterDemand },
+  {  93, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "exportSystemPowerDemand", "Export System Power Demand", "mdi:transmission-tower-export", "W", nullptr, nullptr, &filterDemand },
+  {  95, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "maxExportSystemPowerDemand", "Max Export System Power Demand", "mdi:transmission-tower-export", "W", nullptr, nullptr, &filterDemand },
+  { 259, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "currentDemand", "Current Demand", "mdi:current-ac", "A", nullptr, nullptr, &filterDemand },
+  { 265, 2, DECODE_FLOAT32, GROUP_DEMAND,
+      "maxCurrentDemand", "Max Current Demand", "mdi:current-ac", "A", nullptr, nullptr, &filterDemand },
+  { 343, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "totalActiveEnergy", "Total Active Energy", "mdi:transmission-tower", "kWh", "energy", "total", &filterEnergy },
+  { 345, 2, DECODE_FLOAT32, GROUP_ENERGY,
+      "totalReactiveEnergy", "Total Reactive Energy", "mdi:transmission-tower", "kvarh", nullptr, nullptr, &filterEnergy }
+};
+constexpr uint8_t METER_REGISTER_COUNT = sizeof(meterRegisters) / sizeof(meterRegisters[0]);
+
+// compile time check that the table is sorted and that no two entries overlap
+constexpr bool meterRegistersAreOrdered(uint8_t i = 1) {
+  return (i >= METER_REGISTER_COUNT) ||
+         ((meterRegisters[i - 1].address + meterRegisters[i - 1].words <= meterRegisters[i].address) && meterRegistersAreOrdered(i + 1));
+}
+
+// the set of fields in a poll group
+constexpr MeterFieldMaskType meterGroupFields(RegisterGroupType group, uint8_t i = 0) {
+  return (i >= METER_REGISTER_COUNT) ? 0 :
+         (((meterRegisters[i].group == group) ? meterFieldBit(i) : 0) | meterGroupFields(group, i + 1));
+}
+
+// where a field's registers sit in the meter's snapshot, the entries are packed end to end in table order
+constexpr uint16_t meterSnapshotOffset(uint8_t field) {
+  return (field == 0) ? 0 : meterSnapshotOffset(field - 1) + meterRegisters[field - 1].words;
+}
+
+static_assert(METER_REGISTER_COUNT == METER_FIELD_COUNT, "METER_FIELD_COUNT must match the number of entries in meterRegisters");
+static_assert(meterSnapshotOffset(METER_REGISTER_COUNT) == METER_SNAPSHOT_WORDS, "METER_SNAPSHOT_WORDS must match the total words in meterRegisters");
+static_assert(meterRegistersAreOrdered(), "meterRegisters must be in ascending, non-overlapping address order");
+
+// find the field (table index) for a register address, METER_REGISTER_COUNT if it isn't in the table
+constexpr uint8_t meterFieldAt(uint16_t address, uint8_t i = 0) {
+  return ((i >= METER_REGISTER_COUNT) || (meterRegisters[i].address == address)) ? i : meterFieldAt(address, i + 1);
+}
+
+// fields that are also summarised over a window of samples, each one gets min, max, mean and rms 
+// entities.  The field must be in a poll group that samples it fast enough to fill a window
+#define METER_AGGREGATE_WINDOW_MS   60000     // length of a summary window
+
+constexpr uint8_t meterAggregateFields[] = {
+  meterFieldAt(13),   // active power
+  meterFieldAt(7)     // current
+};
+constexpr uint8_t METER_AGGREGATE_COUNT = sizeof(meterAggregateFields) / sizeof(meterAggregateFields[0]);
+
+constexpr bool meterAggregatesAreValid(uint8_t i = 0) {
+  return (i >= METER_AGGREGATE_COUNT) || ((meterAggregateFields[i] < METER_REGISTER_COUNT) && meterAggregatesAreValid(i + 1));
+}
+static_assert(METER_AGGREGATE_COUNT == METER_AGGREGATE_FIELDS, "METER_AGGREGATE_FIELDS must match the number of entries in meterAggregateFields");
+static_assert(meterAggregatesAreValid(), "meterAggregateFields must only refer to registers in meterRegisters");
+
+// the fields the derived metrics are worked out from, see home_assistant_derived.h
+constexpr uint8_t METER_POWER_FIELD         = meterFieldAt(13);   // active power, W
+constexpr uint8_t METER_IMPORT_ENERGY_FIELD = meterFieldAt(73);   // active energy import, kWh
+constexpr uint8_t METER_EXPORT_ENERGY_FIELD = meterFieldAt(75);   // active energy export, kWh
+static_assert((METER_POWER_FIELD < METER_REGISTER_COUNT) && (METER_IMPORT_ENERGY_FIELD < METER_REGISTER_COUNT)
+              && (METER_EXPORT_ENERGY_FIELD < METER_REGISTER_COUNT), "the derived metrics fields must be in meterRegisters");
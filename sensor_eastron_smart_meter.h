@@ -1,240 +1,1187 @@
 // ----[ Eastron SDM120 Modbus Sensor CONTROL MODULE]----- 
 
 /*
-  This module creates a Modbus RTU Client and uses that to read the status 
-  off the power meter and write it to the home-assistant entites
+  This module creates a Modbus RTU Client on each RS485 bus and uses them to read the status 
+  off the power meter and write it to the home-assistant entites.  Reads are 
+  queued on an asynchronous client and serviced from loop(), see sys_modbus_async.h
 
   Circuit:
    - Iot Nano 33 board
    - RS485 peripheral board : DollaTek 5PCS 5V MAX485 / RS485 Module TTL to RS-485 MCU Development Board
 */
 
-#include <cstring> // For memcpy
 #include "sys_logStatus.h"
 
 #include "home_assistant.h"
+#include "sensor_eastron_registers.h"   // register descriptor table
+#include "sys_modbus_planner.h"         // works out which blocks to read
+#include "home_assistant_discovery.h"   // hand built discovery and state messages for the aggregated state mode
+#include "sys_offline_buffer.h"         // readings taken while we are offline, sent on once we are back
+#include "sys_sample_queue.h"           // readings handed from the modbus task to loop() in dual core mode
 
-// ArduinoModbus depends on the ArduinoRS485 library - had to edit this library for the ESP32
-// see https://github.com/arduino-libraries/ArduinoRS485/issues/54
+// the modbus client is our own (sys_modbus_async.h), ArduinoRS485 only drives the MAX485 and its
+// DE/RE pins.  It needs an edit to build for the ESP32, see https://github.com/arduino-libraries/ArduinoRS485/issues/54
 #include <ArduinoRS485.h>  
-#include <ArduinoModbus.h>        // HAD TO EDIT THIS INCLUDE TO WORK (see above)
+#include "sys_modbus_bus.h"       // an RS485 port with its modbus client (or sniffer) and line settings
+#include "sys_modbus_tcp_server.h"  // the gateway other systems read the cached registers from
 #define MODBUS_DE_PIN       4     // connect DE pin of MAX485 to D4
 #define MODBUS_RE_PIN       5     // connect RE pin of MAX485 to D5
 #define MODBUS_RX_PIN       3     // connect RO pin of MAX485 to D3
 #define MODBUS_TX_PIN       2     // connect DI pin of MAX485 to D2 
-#define MODBUS_SERIAL_BAUD  9600  // Baud rate for esp32 and max485 communication
+#define MODBUS_BUS2_DE_PIN  8     // second bus (ESP32 only), a MAX485 on D6 to D9 in the same order
+#define MODBUS_BUS2_RE_PIN  9
+#define MODBUS_BUS2_RX_PIN  7
+#define MODBUS_BUS2_TX_PIN  6
+#define MODBUS_BUS3_DE_PIN  A2    // third bus (ESP32-S3 with the log on USB), a MAX485 on A0 to A3, D13 is the LED
+#define MODBUS_BUS3_RE_PIN  A3
+#define MODBUS_BUS3_RX_PIN  A1
+#define MODBUS_BUS3_TX_PIN  A0
+#define METER_POLL_TICK_MS  100   // how often the bus cycle checks for poll groups that are due
+#define METER_EXPIRE_AFTER_S  300   // home assistant marks a meter's entities unavailable after this long without an update
+#define BACKLOG_REPLAY_INTERVAL_MS  250   // gap between backlog batches, so a long outage doesn't flood the broker
+#define BACKLOG_REPLAY_BATCH        16    // samples sent per backlog message
+#define METER_TASK_CORE       0       // dual core mode, the modbus task runs here and loop() stays on ARDUINO_RUNNING_CORE
+#define METER_TASK_STACK      8192    // bytes
+#define METER_TASK_PRIORITY   2       // above loop() (1), below the wifi and lwip tasks
+#define SAMPLE_DRAIN_BATCH    64      // most records taken off the sample queue per pass of loop()
 
-// setup the RS485 class on Serial1, we will need to begin Serial1 with the same params
-RS485Class RS485(Serial1, MODBUS_TX_PIN, MODBUS_DE_PIN, MODBUS_RE_PIN); 
+// the RS485 buses, each on its own UART and MAX485.  Meters are put on a bus with <id>@<bus> in 
+// the meter list, bus 1 (modbusBuses[0]) if not given.  The RS485 class on each bus is begun 
+// along with its UART, see ModbusBusType::startSerial()
+ModbusBusType modbusBuses[MODBUS_MAX_BUSES] = {
+  { Serial1, { MODBUS_RX_PIN, MODBUS_TX_PIN, MODBUS_DE_PIN, MODBUS_RE_PIN } },
+#if MODBUS_MAX_BUSES > 1
+  { Serial2, { MODBUS_BUS2_RX_PIN, MODBUS_BUS2_TX_PIN, MODBUS_BUS2_DE_PIN, MODBUS_BUS2_RE_PIN } },
+#endif
+#if MODBUS_MAX_BUSES > 2
+  { Serial0, { MODBUS_BUS3_RX_PIN, MODBUS_BUS3_TX_PIN, MODBUS_BUS3_DE_PIN, MODBUS_BUS3_RE_PIN } },
+#endif
+};
 
-//floats are 32bit values.  Modbus registers are 16 bit, so 2 registers are used to 
-// hold the value, therefore we have to do 2 reads and combine them.
-// Alternatively, to read a single Holding Register value use: ModbusRTUClient.holdingRegisterRead(...)
-float readFloatFromRegisters(int& registerCounter) {
-    uint16_t highRegister = 0x0000; // Default value to 0
-    uint16_t lowRegister = 0x0000;  // Default value to 0 
+// progress through the current cycle on one bus, meters are queued on its client one at a time as 
+// there is room, so the transaction queue never has to hold a whole cycle.  Each bus runs its own 
+// cycle over its own meters, so the buses are all busy at once
+struct MeterCycleType {
+  bool active = false;              // a cycle is in progress
+  MeterFieldMaskType fields = 0;    // fields that are due in this cycle
+  MeterFieldMaskType dueFields = 0; // fields that fell due since this cycle started, read in the next one
+  uint8_t queuedMeters = 0;         // meters queued so far in this cycle
+  uint8_t firstMeter = 0;           // meter the cycle starts at, moves round one each cycle so no meter is always last
+  uint8_t meters[METER_POOL_SIZE];  // the meters on this bus, indexes into ha.meters
+  uint8_t meterCount = 0;
+} meterCycles[MODBUS_MAX_BUSES];
 
-    // try and read two registers
-//    Serial.print("R " + String(registerCounter) + " : h");
+OfflineBufferType offlineBuffer;
+ModbusTcpServerType modbusGateway;
+unsigned long modbusGatewayMaxAgeMs = 0;
 
-    // first register
-    if (ModbusRTUClient.available()) {
-      highRegister = ModbusRTUClient.read();
-    } else {
-      logError("Could not read data from register " + String(registerCounter) + " - modbus register (high) not available");
-    }
-    registerCounter += 1; // increment anyway to continue switching through the registers
+// ----[offline store and forward]-----
+// while the broker can't be reached, every reading that would have been published goes into the
+// offline buffer instead.  Once we are back, the backlog is sent oldest first as json batches on
+// <data prefix>/<device id>/backlog, e.g. {"samples":[{"id":1,"key":"voltage","value":239.80,"age_ms":61000},...]}
+// age_ms is how long before the message was sent the reading was taken, so the receiver can put 
+// a time on it without us needing a clock.  Home assistant itself can't back fill entity history 
+// from mqtt, so this is for a recorder/billing consumer listening on that topic.
+//
+// sample fields are the register table index, or above that a window summary:
+// METER_FIELD_COUNT + (aggregate * WINDOW_SUMMARY_COUNT) + summary
 
-    // second register
-    if (ModbusRTUClient.available()) {
-      lowRegister = ModbusRTUClient.read();
-    } else {
-      logError("Could not read data from register " + String(registerCounter) + " - modbus register (low) not available");
+uint8_t summarySampleField(uint8_t aggregate, uint8_t summary) {
+  return METER_FIELD_COUNT + aggregate * WINDOW_SUMMARY_COUNT + summary;
+}
+
+// the json key for a sample field, as used in the aggregated state message
+void sampleFieldKey(uint8_t field, char* key, size_t size) {
+  if (field < METER_FIELD_COUNT) {
+    snprintf(key, size, "%s", meterRegisters[field].key);
+  } else {
+    uint8_t summary = field - METER_FIELD_COUNT;
+    snprintf(key, size, "%s%s", meterRegisters[meterAggregateFields[summary / WINDOW_SUMMARY_COUNT]].key, windowSummaryKeys[summary % WINDOW_SUMMARY_COUNT]);
+  }
+}
+
+void storeOfflineSample(const HADataType::HAEntitiesType& smartMeterHA, uint8_t field, float value) {
+  OfflineSampleType sample;
+  sample.timestampMs = millis();
+  sample.meterID = smartMeterHA.modbusID;
+  sample.field = field;
+  sample.value = value;
+  offlineBuffer.push(sample);
+}
+
+// write a batch of the backlog as json, returns false if it didn't fit in the buffer
+bool buildBacklogBatch(const OfflineSampleType* samples, uint16_t n, char* payload, size_t size) {
+  char key[48];
+  unsigned long now = millis();
+  PayloadWriterType json(payload, size);
+  json.beginObject();
+  json.beginArray("samples");
+  for (uint16_t i = 0; i < n; i++) {
+    sampleFieldKey(samples[i].field, key, sizeof(key));
+    json.beginObject();
+    json.integer("id", samples[i].meterID);
+    json.str("key", key);
+    json.num("value", samples[i].value);
+    json.integer("age_ms", now - samples[i].timestampMs);
+    json.endObject();
+  }
+  json.endArray();
+  json.endObject();
+  return !json.overflowed();
+}
+
+// send the next batch of the backlog, the batch is only dropped once it has been published
+void onReplayBacklogEvent() {
+  if (!ha.mqtt.isConnected() || (offlineBuffer.pending() == 0)) {
+    return;
+  }
+
+  OfflineSampleType samples[BACKLOG_REPLAY_BATCH];
+  uint16_t n = offlineBuffer.peek(samples, BACKLOG_REPLAY_BATCH);
+  if (n == 0) {
+    return;
+  }
+
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
+  buildDeviceTopic(topic, sizeof(topic), "backlog");
+  // long keys (the window summaries) can make a full batch too long, send fewer at a time then
+  while ((n > 0) && !buildBacklogBatch(samples, n, payload, sizeof(payload))) {
+    n /= 2;
+  }
+
+  if (n == 0) {
+    LOG_ERROR("Backlog sample too long, dropping it");
+    offlineBuffer.pop(1);
+  } else if (ha.mqtt.publish(topic, payload)) {
+    offlineBuffer.pop(n);
+    if (offlineBuffer.pending() == 0) {
+      if (offlineBuffer.dropped() > 0) {
+        LOG_STATUS("Offline backlog sent, %lu readings were lost", (unsigned long)offlineBuffer.dropped());
+      } else {
+        LOG_STATUS("Offline backlog sent");
+      }
     }
-    registerCounter += 1; // increment anyway to continue switching through the registers
+  }
+}
 
-//    Serial.print(highRegister, HEX);
-//    Serial.print(" l");
-//    Serial.print(lowRegister, HEX);
+// turn the raw registers for one table entry into a value for home assistant, read straight 
+// out of the meter's snapshot.  Floats are 32bit values, Modbus registers are 16 bit, so 2 
+// registers are used to hold the value (high word first)
+float decodeRegisterValue(const RegisterSnapshotType& snapshot, uint8_t field) {
+  const MeterRegisterType& reg = meterRegisters[field];
+  uint16_t offset = meterSnapshotOffset(field);
+  switch (reg.decode) {
+    case DECODE_FLOAT32:
+      return snapshot.float32At(offset);
+    case DECODE_UINT32:
+      return static_cast<float>(snapshot.uint32At(offset));
+    case DECODE_INT16:
+      return static_cast<float>(snapshot.int16At(offset));
+  }
+  return 0.0f;
+}
 
-    // combine 2 x 16 bit ints into a 32 bit float
-    uint32_t combinedBits = (static_cast<uint32_t>(highRegister) << 16) | lowRegister; // Combine bits
-    float result;
-    std::memcpy(&result, &combinedBits, sizeof(float)); // Interpret as float
-//    Serial.println(" = f" + String(result));
+#ifdef HA_LEAN_PUBLISH
+// ----[lean publish mode]-----
+// each field goes out on its own topic, <data prefix>/<device id>/<object id>/stat_t, the same 
+// topic and payload its ArduinoHA entity would use, but formatted straight into buffers on the 
+// stack.  So there is nothing per field in RAM apart from the readings we already keep, and the
+// discovery for them is built from the register table when it is sent
 
-    return result;
+void buildMeterFieldTopic(char* topic, size_t size, const HADataType::HAEntitiesType& smartMeterHA, const char* key, const char* keySuffix) {
+  char suffix[UID_BUFFER_SIZE + 8];
+  snprintf(suffix, sizeof(suffix), "%s_%d_%s%s/stat_t", uniqueChipID(), smartMeterHA.modbusID, key, keySuffix);
+  buildDeviceTopic(topic, size, suffix);
 }
 
-/*
-void printRegistersToSerial(int id, int type, int address, int nb) {
-  uint16_t value;           // value to sink unused values when read
-  int status = 0;           // call status
+// retained or not as the field's publish filter says, an entity would always retain it
+bool publishLeanValue(const HADataType::HAEntitiesType& smartMeterHA, const MeterRegisterType& reg, const char* keySuffix, float value) {
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[24];
+  buildMeterFieldTopic(topic, sizeof(topic), smartMeterHA, reg.key, keySuffix);
+  dtostrf(value, 1, 2, payload);
+  return ha.mqtt.publish(topic, payload, reg.filter->retain);
+}
+#endif
 
-  logText("requestFrom(" + String(id) + ", " + String(type) + ", " + String(address) + ", " + String(nb) + ")");
-  status = ModbusRTUClient.requestFrom(id, type, address, nb); 
+// publish a value to the entity bound to a register table entry, if it gets through the field's
+// publish filter (see the register table).  The last published value is kept on the live entity 
+// container so this persists between polls.  The first read, and anything forced, always goes out
+bool publishMeterField(HADataType::HAEntitiesType& smartMeterHA, uint8_t field, float value, bool force = false) {
+  HADataType::HAEntitiesType::FieldStateType& state = smartMeterHA.fieldState[field];
 
-  if (status == 0) {
-    logError("Sensor read over Modbus failed");
-    logError(ModbusRTUClient.lastError());
+  bool online = ha.mqtt.isConnected();
+  if (!force && state.published) {
+    switch (meterRegisters[field].filter->check(value, state.lastPublishedValue, millis() - state.lastPublishedAt)) {
+      case PUBLISH_SKIP:
+        return false;   // nothing new to tell home assistant
+      case PUBLISH_HEARTBEAT:
+        force = true;   // unchanged values are only sent by the entity when forced
+        break;
+      case PUBLISH_CHANGE:
+        break;
+    }
+  }
+  if (!online) {
+    // keep it for later, it still counts as published so the filter keeps the backlog down
+    storeOfflineSample(smartMeterHA, field, value);
   } else {
-    for (int i = 0; i < status; i+=2) {
-        Serial.print(String(30000 + i + 1) + " : ");
-        value = ModbusRTUClient.read();
-        Serial.printf("%04X", value);
-        Serial.print(" ");
-        value = ModbusRTUClient.read();
-        Serial.printf("%04X", value);
-        Serial.println();
+#if defined(HA_AGGREGATED_STATE)
+    // staged for the meter's state message, which goes out once all the blocks in the cycle are in
+    smartMeterHA.stateChanged = true;
+#elif defined(HA_LEAN_PUBLISH)
+    if (!publishLeanValue(smartMeterHA, meterRegisters[field], "", value)) {
+      return false;   // publish failed (e.g. not connected), try again next time
+    }
+#else
+    HAMeterSensorType* entity = smartMeterHA.entities[field];
+    if (!entity || !entity->setValue(value, force)) {
+      return false;   // publish failed (e.g. not connected), try again next time
     }
+#endif
   }
+  state.lastPublishedValue = value;
+  state.lastPublishedAt = millis();
+  state.published = true;
+  return true;
+}
 
-  promptWaitForUser();
+#ifdef HA_AGGREGATED_STATE
+// ----[aggregated state mode]-----
+// each meter publishes all its readings as one json message, e.g. {"voltage":239.80,"current":1.25,...}
+// on <data prefix>/<device id>/meter_<modbus id>/stat_t, and the discovery config of each field
+// picks its own value out of that with a value_template
 
+void buildMeterStateTopic(char* topic, size_t size, const HADataType::HAEntitiesType& smartMeterHA) {
+  char suffix[24];
+  snprintf(suffix, sizeof(suffix), "meter_%d/stat_t", smartMeterHA.modbusID);
+  buildDeviceTopic(topic, size, suffix);
 }
-*/
 
-void readRegisterBlockAndUpdateHA(HADataType::HAEntitiesType smartMeterHA, int startRegister, int endRegister) {
-  uint16_t unusedRegister;  // value to sink unused values when read
-  int currentRegister;      // tracks the address of the current register
-  int baseRegister = 30000; // holding registers start at the base of 30000
-  int status = 0;           // call status
+// send every field we hold a value for, so the message is complete even when only some groups were read
+void publishMeterState(HADataType::HAEntitiesType& smartMeterHA) {
+  char topic[HA_TOPIC_BUFFER_SIZE];
+  char payload[HA_PAYLOAD_BUFFER_SIZE];
 
-  // register values come from the spec for the Eastron SDM120M
-  //   https://www.eastroneurope.com/images/uploads/products/protocol/SDM120-MODBUS_Protocol.pdf
+  buildMeterStateTopic(topic, sizeof(topic), smartMeterHA);
+  PayloadWriterType json(payload, sizeof(payload));
+  json.beginObject();
+  for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+    if (smartMeterHA.fieldState[i].published) {
+      json.num(meterRegisters[i].key, smartMeterHA.fieldState[i].lastPublishedValue);
+    }
+  }
+  // and the last window summaries, keyed e.g. activePowerMax
+  char key[48];
+  for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+    const WindowSummaryType& summary = smartMeterHA.fieldStats[a].latest;
+    if (summary.samples == 0) {
+      continue;
+    }
+    for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+      snprintf(key, sizeof(key), "%s%s", meterRegisters[meterAggregateFields[a]].key, windowSummaryKeys[s]);
+      json.num(key, windowSummaryValue(summary, s));
+    }
+  }
+  json.endObject();
+
+  if (json.overflowed()) {
+    LOG_ERROR("State message too long for Modbus Client [%d]", smartMeterHA.modbusID);
+  } else if (ha.mqtt.publish(topic, json.c_str())) {
+    smartMeterHA.stateChanged = false;    // otherwise keep it flagged and try again after the next cycle
+  }
+}
+#endif
 
-  startRegister += baseRegister;  
-  endRegister += baseRegister;    
-  logText("Reading Block " + String(startRegister) + "-" + String(endRegister) +" Register values for Modbus Client [" + String(smartMeterHA.modbusID) + "]");
+#ifndef HA_METER_ENTITIES
+// ----[hand built meter discovery]-----
+// with no entities behind the fields, their discovery is built here from the register table
 
-//  printRegistersToSerial(smartMeterHA.modbusID, INPUT_REGISTERS, startRegister - 1 - baseRegister, endRegister - startRegister + 1);
+// announce one entity for a field (or one of its window summaries).  In aggregated mode they all
+// read from the meter's state topic and pick their value out, in lean mode each has its own topic.
+// The object ids are built the same way as newUid(), so the entities keep their unique ids (and 
+// history) when switching between the modes
+void publishMeterFieldDiscovery(const HADataType::HAEntitiesType& smartMeterHA, const MeterRegisterType& reg, const char* keySuffix = "", const char* nameSuffix = "") {
+  char objectId[UID_BUFFER_SIZE];
+  char name[ENTITY_NAME_BUFFER_SIZE];
+  char stateTopic[HA_TOPIC_BUFFER_SIZE];
+  snprintf(objectId, sizeof(objectId), "%s_%d_%s%s", uniqueChipID(), smartMeterHA.modbusID, reg.key, keySuffix);
+  snprintf(name, sizeof(name), "[%s] %s%s", smartMeterHA.label, reg.name, nameSuffix);
 
-  // read a block Input Register values from (client) id, address between the two register addresses 
-  // (start register offset from base)
-  // count of registers to load
-  status = ModbusRTUClient.requestFrom(smartMeterHA.modbusID, INPUT_REGISTERS, startRegister - 1 - baseRegister, endRegister - startRegister + 1); 
-  if (status == 0) {
-    logError("Sensor read over Modbus failed");
-    logError(ModbusRTUClient.lastError());
+  HADiscoveryEntityType entity;
+  entity.objectId = objectId;
+  entity.name = name;
+  entity.stateTopic = stateTopic;
+#ifdef HA_AGGREGATED_STATE
+  char valueTemplate[64];
+  snprintf(valueTemplate, sizeof(valueTemplate), "{{ value_json.%s%s }}", reg.key, keySuffix);
+  buildMeterStateTopic(stateTopic, sizeof(stateTopic), smartMeterHA);
+  entity.valueTemplate = valueTemplate;
+#else
+  buildMeterFieldTopic(stateTopic, sizeof(stateTopic), smartMeterHA, reg.key, keySuffix);    // the payload is the value
+#endif
+  entity.icon = reg.icon;
+  entity.unit = reg.unit;
+  if (keySuffix[0] == '\0') {
+    entity.deviceClass = reg.deviceClass;
+    entity.stateClass = reg.stateClass;
+    entity.expireAfter = METER_EXPIRE_AFTER_S;
   } else {
-    logStatus("Read " + String(status) + " registers successfully");
-    // need to iterate through the registers 
-    currentRegister = startRegister;
-    while (currentRegister <= endRegister) {
-      // read the float for each value, send to home assistant and move the current registers on
-      switch (currentRegister) {
-        case 30001:
-          smartMeterHA.voltage.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30007:
-          smartMeterHA.current.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30013:
-          smartMeterHA.activePower.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30019:
-          smartMeterHA.apparentPower.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30025:
-          smartMeterHA.reactivePower.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30031:
-          smartMeterHA.powerFactor.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30071:
-          smartMeterHA.frequency.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30073:
-          smartMeterHA.importActiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30075:
-          smartMeterHA.exportActiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30077:
-          smartMeterHA.importReactiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30079:
-          smartMeterHA.exportReactiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30085:
-          smartMeterHA.totalSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30087:
-          smartMeterHA.maxTotalSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30089:
-          smartMeterHA.importSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30091:
-          smartMeterHA.maxImportSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30093:
-          smartMeterHA.exportSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30095:
-          smartMeterHA.maxExportSystemPowerDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30259:
-          smartMeterHA.currentDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30265:
-          smartMeterHA.maxCurrentDemand.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30343:
-          smartMeterHA.totalActiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        case 30345:
-          smartMeterHA.totalReactiveEnergy.setValue(readFloatFromRegisters(currentRegister));
-          break;
-        default:
-          // no parameter to load, do a read and move to next register
-          unusedRegister = ModbusRTUClient.read(); 
-          currentRegister += 1;
+    entity.stateClass = "measurement";
+    entity.expireAfter = 3 * METER_AGGREGATE_WINDOW_MS / 1000;    // a few missed windows
+  }
+  publishDiscoveryConfig(entity);
+}
+
+// announce the meter fields, a discovery scheduler source
+void publishMeterDiscovery(DiscoveryCursorType& cursor) {
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    const HADataType::HAEntitiesType& smartMeterHA = ha.meters[m];
+    for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+      if ((smartMeterHA.enabledFields & meterFieldBit(i)) && cursor.next()) {
+        publishMeterFieldDiscovery(smartMeterHA, meterRegisters[i]);
+      }
+    }
+    for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+      if (!(smartMeterHA.enabledFields & meterFieldBit(meterAggregateFields[a]))) {
+        continue;
+      }
+      for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+        if (cursor.next()) {
+          publishMeterFieldDiscovery(smartMeterHA, meterRegisters[meterAggregateFields[a]], windowSummaryKeys[s], windowSummaryNames[s]);
+        }
+      }
+    }
+  }
+}
+#endif
+
+// feed a reading into any window summaries on the field, and publish the summaries when the window ends
+void sampleMeterField(HADataType::HAEntitiesType& smartMeterHA, uint8_t field, float value) {
+  for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+    if (meterAggregateFields[a] != field) {
+      continue;
+    }
+    HADataType::HAEntitiesType::FieldStatsType& stats = smartMeterHA.fieldStats[a];
+    stats.window.add(value);
+    if (stats.window.windowComplete(millis())) {
+      stats.latest = stats.window.close(millis());
+      if (!ha.mqtt.isConnected()) {
+        for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+          storeOfflineSample(smartMeterHA, summarySampleField(a, s), windowSummaryValue(stats.latest, s));
+        }
+        continue;
       }
+#if defined(HA_AGGREGATED_STATE)
+      smartMeterHA.stateChanged = true;   // goes out with the state message at the end of this cycle
+#elif defined(HA_LEAN_PUBLISH)
+      for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+        publishLeanValue(smartMeterHA, meterRegisters[field], windowSummaryKeys[s], windowSummaryValue(stats.latest, s));
+      }
+#else
+      for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+        if (stats.summaries[s]) {
+          // forced, so a steady load still shows up as a fresh figure every window
+          stats.summaries[s]->setValue(windowSummaryValue(stats.latest, s), true);
+        }
+      }
+#endif
     }
   }
+}
+
+// ----[acquisition to publishing hand over]-----
+// everything read off the bus reaches the publishing side (filters, windows, entities, MQTT) as a 
+// MeterSampleType record.  Normally the record is processed there and then, in dual core mode it is 
+// queued by the modbus task and processed by loop() on the other core.  Each side only touches its 
+// own parts of the meter: the bus side has the health and pendingBlocks, the publishing side the 
+// field state and stats
 
+#ifdef METER_DUAL_CORE
+SampleQueueType sampleQueue;
+#endif
+
+// feed the readings the derived metrics are worked out from, with the time they were taken
+void sampleDerivedInputs(HADataType::HAEntitiesType& smartMeterHA, const MeterSampleType& sample) {
+  if (sample.field == METER_POWER_FIELD) {
+    smartMeterHA.derived.power.add(sample.value, sample.timestampMs);
+  } else if (sample.field == METER_IMPORT_ENERGY_FIELD) {
+    smartMeterHA.derived.importEnergy.note(sample.value);
+  } else if (sample.field == METER_EXPORT_ENERGY_FIELD) {
+    smartMeterHA.derived.exportEnergy.note(sample.value);
+  }
 }
 
-void readMeterAndUpdateHA(HADataType::HAEntitiesType smartMeterHA) {
-  // break the meter reading into multiple blocks (the readings are spread out in 
-  // the register spectrum) and do one read and then parse out each block
-  // there are three blocks with large gaps between them
-  // within each block there are a lot of unused registers
-  // register values come from the spec for the Eastron SDM120M
-  //   https://www.eastroneurope.com/images/uploads/products/protocol/SDM120-MODBUS_Protocol.pdf
+#ifdef METER_HISTORY
+// the readings kept in the flash history, by channel (see home_assistant_history.h)
+const uint8_t historyFields[HISTORY_CHANNELS] = { METER_POWER_FIELD, METER_IMPORT_ENERGY_FIELD, METER_EXPORT_ENERGY_FIELD };
 
-  readRegisterBlockAndUpdateHA(smartMeterHA,1,32);
-  readRegisterBlockAndUpdateHA(smartMeterHA,71,96);
-  readRegisterBlockAndUpdateHA(smartMeterHA,259,266);
-  readRegisterBlockAndUpdateHA(smartMeterHA,343,346);
+void sampleHistoryInputs(HADataType::HAEntitiesType& smartMeterHA, const MeterSampleType& sample) {
+  for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+    if (historyFields[c] == sample.field) {
+      smartMeterHA.history.values[c] = sample.value;
+      smartMeterHA.history.seen |= 1 << c;
+    }
+  }
 }
+#endif
 
+// publishing side, act on one record from the bus
+void processMeterSample(const MeterSampleType& sample) {
+  SpanTimerType span(instrumentation.publish);
+  HADataType::HAEntitiesType& smartMeterHA = ha.meters[sample.meterIndex];
+  switch (sample.kind) {
+    case SAMPLE_READING:
+      sampleDerivedInputs(smartMeterHA, sample);
+#ifdef METER_HISTORY
+      sampleHistoryInputs(smartMeterHA, sample);
+#endif
+      sampleMeterField(smartMeterHA, sample.field, sample.value);
+      publishMeterField(smartMeterHA, sample.field, sample.value);
+      break;
+    case SAMPLE_METER_DONE:
+#ifdef HA_AGGREGATED_STATE
+      if (smartMeterHA.stateChanged) {
+        publishMeterState(smartMeterHA);
+      }
+#endif
+      break;
+    case SAMPLE_METER_RECOVERED:
+      // resend everything, whether it changed or not, so home assistant brings the entities back
+      for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+        smartMeterHA.fieldState[i].published = false;
+      }
+      break;
+  }
+}
+
+// bus side, pass a record over to the publishing side
+void handOverMeterSample(const HADataType::HAEntitiesType& smartMeterHA, MeterSampleKindType kind, uint8_t field = 0, float value = 0.0f) {
+  MeterSampleType sample;
+  sample.timestampMs = millis();
+  sample.meterIndex = &smartMeterHA - ha.meters;
+  sample.kind = kind;
+  sample.field = field;
+  sample.value = value;
+#ifdef METER_DUAL_CORE
+  sampleQueue.push(sample);     // if it's full the record is counted as dropped, and reported from loop()
+#else
+  processMeterSample(sample);
+#endif
+}
+
+// called when a block read for a meter has completed, however it ended
+void completeMeterBlock(HADataType::HAEntitiesType& smartMeterHA) {
+  if (smartMeterHA.pendingBlocks > 0) {
+    smartMeterHA.pendingBlocks--;
+  }
+  if (smartMeterHA.pendingBlocks == 0) {
+    smartMeterHA.snapshot.endFrame();
+    handOverMeterSample(smartMeterHA, SAMPLE_METER_DONE);
+  }
+}
+
+// walk the register table once over a block of consecutive registers that has already been 
+// read off the bus, starting at startRegister.  Each table entry in the block is copied into the 
+// meter's snapshot (unused registers in the block are never touched, we jump straight from one 
+// table entry to the next) and decoded from there.  wire is the response data, high byte first
+void decodeRegisterBlock(HADataType::HAEntitiesType& smartMeterHA, int startRegister, const uint8_t* wire, int count) {
+  int endRegister = startRegister + count - 1;
+  uint16_t offset = 0;    // where the entry sits in the snapshot
+  for (uint8_t i = 0; i < METER_REGISTER_COUNT; offset += meterRegisters[i].words, i++) {
+    const MeterRegisterType& reg = meterRegisters[i];
+    if (reg.address < startRegister) {
+      continue;   // before this block
+    }
+    if (reg.address + reg.words - 1 > endRegister) {
+      break;      // table is in address order, so nothing further is in this block
+    }
+    smartMeterHA.snapshot.store(i, offset, reg.words, &wire[2 * (reg.address - startRegister)]);
+    if (smartMeterHA.enabledFields & meterFieldBit(i)) {
+      handOverMeterSample(smartMeterHA, SAMPLE_READING, i, decodeRegisterValue(smartMeterHA.snapshot, i));
+    }
+  }
+}
+
+// completion callback for a block read, decode the response into the meter it was read for
+void onRegisterBlockRead(ModbusTransactionType& transaction) {
+  HADataType::HAEntitiesType& smartMeterHA = *static_cast<HADataType::HAEntitiesType*>(transaction.context);
+
+  if (transaction.result == MODBUS_CANCELLED) {
+    completeMeterBlock(smartMeterHA);
+    return;   // skipped after an earlier block on this meter failed
+  }
+
+  if (transaction.result != MODBUS_OK) {
+    LOG_ERROR("Sensor read over Modbus failed for Modbus Client [%d]: %s", smartMeterHA.modbusID, modbusResultText(transaction.result));
+    switch (transaction.result) {
+      case MODBUS_TIMEOUT:   smartMeterHA.health.timeouts++; break;
+      case MODBUS_CRC_ERROR: smartMeterHA.health.crcErrors++; break;
+      default:               smartMeterHA.health.badResponses++; break;
+    }
+    // don't let the rest of this meter's blocks wait out their own timeouts
+    modbusBuses[smartMeterHA.bus].client.cancel(smartMeterHA.modbusID);
+    if (smartMeterHA.health.recordFailure(millis())) {
+      // nothing is published for this, home assistant only finds out when the entities expire
+      LOG_ERROR("Modbus Client [%d] is not answering, it will expire in HA after %ds", smartMeterHA.modbusID, METER_EXPIRE_AFTER_S);
+    }
+    completeMeterBlock(smartMeterHA);
+    return;
+  }
+
+  instrumentation.modbus.record(transaction.latencyMs * 1000UL);   // the client only times to the ms
+  if (smartMeterHA.health.recordSuccess(millis(), transaction.latencyMs)) {
+    LOG_STATUS("Modbus Client [%d] is answering again", smartMeterHA.modbusID);
+    handOverMeterSample(smartMeterHA, SAMPLE_METER_RECOVERED);
+  }
+
+  LOG_TEXT("Read %d registers successfully in %lums", transaction.count, transaction.latencyMs);
+  decodeRegisterBlock(smartMeterHA, transaction.startRegister, transaction.data, transaction.count);
+  completeMeterBlock(smartMeterHA);
+}
+
+// queue a read of a block of registers, the values are published when the response comes in
+bool readRegisterBlockAndUpdateHA(HADataType::HAEntitiesType& smartMeterHA, int startRegister, int endRegister) {
+  int count = endRegister - startRegister + 1;  // count of registers to load
+
+  if ((count <= 0) || (count > MODBUS_MAX_BLOCK_REGISTERS)) {
+    LOG_ERROR("Invalid register block %d-%d", startRegister, endRegister);
+    return false;
+  }
+
+  LOG_TEXT("Reading Block %d-%d Register values for Modbus Client [%d]", MODBUS_INPUT_REGISTER_BASE + startRegister, MODBUS_INPUT_REGISTER_BASE + endRegister, smartMeterHA.modbusID);
+
+  // read a block Input Register values from (client) id, starting at the start register 
+  // (offset from base) for the count of registers
+  ModbusTransactionType transaction;
+  transaction.id = smartMeterHA.modbusID;
+  transaction.startRegister = startRegister;
+  transaction.count = count;
+  transaction.onComplete = onRegisterBlockRead;
+  transaction.context = &smartMeterHA;
+  if (!modbusBuses[smartMeterHA.bus].client.enqueue(transaction)) {
+    return false;
+  }
+  smartMeterHA.pendingBlocks++;
+  return true;
+}
+
+// queue all the block reads for the wanted fields on one meter.  Returns false, with nothing 
+// queued, if the client does not have room for the whole meter yet
+bool readMeterAndUpdateHA(HADataType::HAEntitiesType& smartMeterHA, MeterFieldMaskType fields = METER_ALL_FIELDS) {
+  // the readings are spread out in the register spectrum with large gaps between them, and 
+  // within each group there are a lot of unused registers.  Let the planner work out which 
+  // blocks to read for the fields that are wanted, then do one read per block and parse it
+  if (!smartMeterHA.health.shouldPoll(millis())) {
+    return true;    // backing off after failures, leave it out of this cycle
+  }
+
+  ModbusBusType& bus = modbusBuses[smartMeterHA.bus];
+  ModbusReadPlanType plan;
+  planRegisterReads(fields & smartMeterHA.enabledFields, bus.settings.baud, plan, bus.settings.bitsPerChar);
+
+  if (plan.blockCount > bus.client.available()) {
+    return false;
+  }
+  if (plan.blockCount > 0) {
+    smartMeterHA.snapshot.beginFrame(millis());
+  }
+  for (uint8_t i = 0; i < plan.blockCount; i++) {
+    const ModbusReadBlockType& block = plan.blocks[i];
+    readRegisterBlockAndUpdateHA(smartMeterHA, block.startRegister, block.startRegister + block.count - 1);
+  }
+  return true;
+}
+
+// feed the meters in the current cycle on a bus to its client as room comes free
+void continueMeterCycle(uint8_t b) {
+  MeterCycleType& cycle = meterCycles[b];
+  while (cycle.active && (cycle.queuedMeters < cycle.meterCount)) {
+    uint8_t m = cycle.meters[(cycle.firstMeter + cycle.queuedMeters) % cycle.meterCount];
+    if (!readMeterAndUpdateHA(ha.meters[m], cycle.fields)) {
+      return;   // no room yet, carry on next time round
+    }
+    cycle.queuedMeters++;
+  }
+  if (cycle.active && modbusBuses[b].client.isIdle()) {
+    cycle.active = false;
+    cycle.firstMeter = (cycle.meterCount > 0) ? (cycle.firstMeter + 1) % cycle.meterCount : 0;
+  }
+}
+
+// start a cycle on each bus: read every poll group that has fallen due since its last cycle, on 
+// every meter on the bus.  A bus that is still working through its last cycle keeps what is due 
+// now for its next one, and the others don't wait for it
 void onSensorUpdateEvent() {
-  readMeterAndUpdateHA(ha.meter1entities);
-  readMeterAndUpdateHA(ha.meter2entities);
+  uint32_t dueGroups = ha.timers.meterPolling.takeDueGroups();
+
+  MeterFieldMaskType fields = 0;
+  for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+    if (dueGroups & bit(group)) {
+      fields |= meterGroupFields(static_cast<RegisterGroupType>(group));
+    }
+  }
+
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    MeterCycleType& cycle = meterCycles[b];
+    if (modbusBuses[b].listening || (cycle.meterCount == 0)) {
+      continue;
+    }
+    cycle.dueFields |= fields;
+    if (cycle.active || (cycle.dueFields == 0)) {
+      continue;
+    }
+    cycle.fields = cycle.dueFields;
+    cycle.dueFields = 0;
+    cycle.queuedMeters = 0;
+    cycle.active = true;
+    continueMeterCycle(b);
+  }
 }
 
+// ----[listen mode]-----
+// another master is polling the meters, so rather than read them ourselves we take the values 
+// out of the responses to its reads as they go by (see sys_modbus_sniffer.h).  Whatever blocks it
+// reads go through the same decode and publish path as our own reads, with each response as a frame
+
+HADataType::HAEntitiesType* findMeter(uint8_t modbusID) {
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    if (ha.meters[m].modbusID == modbusID) {
+      return &ha.meters[m];
+    }
+  }
+  return nullptr;
+}
+
+void onSniffedRead(const ModbusSniffedReadType& read) {
+  uint8_t b = static_cast<ModbusBusType*>(read.context) - modbusBuses;
+  HADataType::HAEntitiesType* smartMeterHA = findMeter(read.id);
+  if (!smartMeterHA || (smartMeterHA->bus != b) || (read.function != MODBUS_READ_INPUT_REGISTERS)) {
+    return;   // not a meter we are watching (on this bus), or not its measurements
+  }
+  LOG_TEXT("Heard %d registers from %d for Modbus Client [%d]", read.count, MODBUS_INPUT_REGISTER_BASE + read.startRegister, read.id);
+  instrumentation.modbus.record(read.latencyMs * 1000UL);
+  if (smartMeterHA->health.recordSuccess(millis(), read.latencyMs)) {
+    handOverMeterSample(*smartMeterHA, SAMPLE_METER_RECOVERED);
+  }
+  smartMeterHA->snapshot.beginFrame(millis());
+  decodeRegisterBlock(*smartMeterHA, read.startRegister, read.data, read.count);
+  smartMeterHA->snapshot.endFrame();
+  handOverMeterSample(*smartMeterHA, SAMPLE_METER_DONE);
+}
+
+// run whichever side of each bus we are on, as often as possible
+void serviceModbusBus() {
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    if (meterCycles[b].meterCount == 0) {
+      continue;   // never started
+    }
+    modbusBuses[b].poll();
+    if (!modbusBuses[b].listening) {
+      continueMeterCycle(b);
+    }
+  }
+}
+
+// ----[modbus tcp gateway]-----
+// other systems on the network (an EMS, the inverter monitoring) can read the meters over Modbus
+// TCP, with the unit id as the meter's Modbus ID and the same input register addresses as on the
+// meter.  The answers come from the meter's register snapshot, never the bus, so any number of
+// readers cost no extra RS485 traffic.  Registers between the table entries (and fields the meter
+// isn't set to read) read as 0, a block with none of the fields we read gets an illegal address
+// exception, and if any of the values in it 
+// were read longer ago than mbtcp_max_age (or never) the answer is a gateway target exception, 
+// so a reader can tell a dead meter from a quiet one.  A meter we don't have gets a gateway path 
+// exception
+
+uint8_t onGatewayRead(uint8_t unitID, uint16_t startRegister, uint16_t count, uint8_t* data) {
+  const HADataType::HAEntitiesType* smartMeterHA = findMeter(unitID);
+  if (!smartMeterHA) {
+    return MODBUS_EXCEPTION_GATEWAY_PATH;
+  }
+
+  memset(data, 0, 2 * count);
+  uint32_t endRegister = (uint32_t)startRegister + count;   // one past the last
+  unsigned long now = millis();
+  bool found = false;
+  uint16_t offset = 0;    // where the entry sits in the snapshot
+  for (uint8_t i = 0; i < METER_REGISTER_COUNT; offset += meterRegisters[i].words, i++) {
+    const MeterRegisterType& reg = meterRegisters[i];
+    if (reg.address + reg.words <= startRegister) {
+      continue;   // before this block
+    }
+    if (reg.address >= endRegister) {
+      break;      // table is in address order, so nothing further is in this block
+    }
+    if (!(smartMeterHA->enabledFields & meterFieldBit(i))) {
+      continue;   // not read off this meter, so it reads as 0 like the gaps
+    }
+    uint16_t words[2];
+    unsigned long readMs;
+    if (!smartMeterHA->snapshot.copyField(i, offset, reg.words, words, readMs) || (now - readMs > modbusGatewayMaxAgeMs)) {
+      return MODBUS_EXCEPTION_GATEWAY_TARGET;
+    }
+    // the block can start or end part way into a 32 bit value, only copy what is inside it
+    for (uint8_t w = 0; w < reg.words; w++) {
+      uint32_t address = reg.address + w;
+      if ((address >= startRegister) && (address < endRegister)) {
+        data[2 * (address - startRegister)] = words[w] >> 8;
+        data[2 * (address - startRegister) + 1] = words[w] & 0xFF;
+      }
+    }
+    found = true;
+  }
+  return found ? 0 : MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+}
+
+void setupModbusGateway() {
+  long port = config.modbusGatewayPort.toInt();
+  if (port == 0) {
+    return;   // off
+  }
+  if ((port < 0) || (port > 65535)) {
+    LOG_ERROR("Invalid Modbus TCP gateway port %s, using %d", config.modbusGatewayPort.c_str(), MODBUS_TCP_PORT);
+    port = MODBUS_TCP_PORT;
+  }
+  long maxAgeS = config.modbusGatewayMaxAgeS.toInt();
+  if (maxAgeS <= 0) {
+    LOG_ERROR("Invalid Modbus TCP gateway reading age %s, using %lus", config.modbusGatewayMaxAgeS.c_str(), 3 * registerGroupPeriodMs[GROUP_ENERGY] / 1000);
+    maxAgeS = 3 * registerGroupPeriodMs[GROUP_ENERGY] / 1000;
+  }
+  modbusGatewayMaxAgeMs = maxAgeS * 1000UL;
+  modbusGateway.begin(port, onGatewayRead);
+}
+
+#ifdef METER_DUAL_CORE
+// ----[dual core mode]-----
+// the bus timers, the modbus client and the bus cycle all run in this task, pinned to the other
+// core from loop().  A stall in loop() (a slow TCP write, a wifi reconnect) then can't hold up a 
+// response on the bus and make a good read time out.  The one tick delay gives the idle task on 
+// this core a look in, so the task watchdog stays happy, and is short next to a modbus character
+void meterAcquisitionTask(void* parameters) {
+  for (;;) {
+    ha.timers.acquisition.run();
+    serviceModbusBus();
+    vTaskDelay(1);
+  }
+}
+
+void startMeterAcquisitionTask() {
+  if (xTaskCreatePinnedToCore(meterAcquisitionTask, "modbus", METER_TASK_STACK, nullptr, METER_TASK_PRIORITY, nullptr, METER_TASK_CORE) != pdPASS) {
+    logSuspend("Could not start the modbus task");
+  }
+  LOG_STATUS("Modbus task running on core %d", METER_TASK_CORE);
+}
+
+// take what the modbus task has read off the queue, a batch at a time so loop() keeps moving
+void drainSampleQueue() {
+  static uint32_t reportedDrops = 0;
+  MeterSampleType sample;
+  for (uint8_t i = 0; (i < SAMPLE_DRAIN_BATCH) && sampleQueue.pop(sample); i++) {
+    processMeterSample(sample);
+  }
+  uint32_t dropped = sampleQueue.dropped();
+  if (dropped != reportedDrops) {
+    LOG_ERROR("Sample queue full, %lu readings dropped", (unsigned long)(dropped - reportedDrops));
+    reportedDrops = dropped;
+  }
+}
+#endif
+
+// create and describe the entities for a meter's enabled fields.  Entities go unavailable in home
+// assistant if a meter stops answering and they are no longer updated (shared device availability
+// can't be set per meter).  In aggregated state and lean publish modes there are no entities, it's
+// all in the hand built discovery, so any number of meters can be configured without running out
+void setupMeterEntities(HADataType::HAEntitiesType& smartMeterHA) {
+  for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+    smartMeterHA.fieldStats[a].window.windowMs = METER_AGGREGATE_WINDOW_MS;
+  }
+#ifdef HA_METER_ENTITIES
+  MeterFieldMaskType dropped = 0;
+  for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+    if (!(smartMeterHA.enabledFields & meterFieldBit(i))) {
+      continue;
+    }
+    const MeterRegisterType& reg = meterRegisters[i];
+    // check for room first, so no uid is stored for an entity we can't have
+    HAMeterSensorType* entity = ha.entityPool.remaining() ? ha.entityPool.allocate(newUid(reg.key, smartMeterHA.modbusID)) : nullptr;
+    if (!entity) {
+      dropped |= meterFieldBit(i);
+      continue;
+    }
+    entity->setIcon(reg.icon);
+    entity->setMeterName(smartMeterHA.label, reg.name);
+    if (reg.unit) {
+      entity->setUnitOfMeasurement(reg.unit);
+    }
+    if (reg.deviceClass) {
+      entity->setDeviceClass(reg.deviceClass);     // e.g. show up in energy dashboard
+    }
+    if (reg.stateClass) {
+      entity->setStateClass(reg.stateClass);
+    }
+    entity->setExpireAfter(METER_EXPIRE_AFTER_S);
+    smartMeterHA.entities[i] = entity;
+  }
+
+  // the window summary entities take their description from the field they summarise
+  for (uint8_t a = 0; a < METER_AGGREGATE_COUNT; a++) {
+    uint8_t field = meterAggregateFields[a];
+    if (!(smartMeterHA.enabledFields & meterFieldBit(field))) {
+      continue;
+    }
+    const MeterRegisterType& reg = meterRegisters[field];
+    for (uint8_t s = 0; s < WINDOW_SUMMARY_COUNT; s++) {
+      HAMeterSensorType* entity = ha.entityPool.remaining() ? ha.entityPool.allocate(newUid(reg.key, smartMeterHA.modbusID, windowSummaryKeys[s])) : nullptr;
+      if (!entity) {
+        continue;   // the field itself is still published, just not this summary
+      }
+      entity->setIcon(reg.icon);
+      entity->setMeterName(smartMeterHA.label, reg.name, windowSummaryNames[s]);
+      if (reg.unit) {
+        entity->setUnitOfMeasurement(reg.unit);
+      }
+      entity->setStateClass("measurement");
+      entity->setExpireAfter(3 * METER_AGGREGATE_WINDOW_MS / 1000);   // a few missed windows
+      smartMeterHA.fieldStats[a].summaries[s] = entity;
+    }
+  }
+
+  // no point reading what we have nowhere to publish
+  if (dropped) {
+    smartMeterHA.enabledFields &= ~dropped;
+    LOG_ERROR("Out of entities for Modbus Client [%d], fields 0x%lX dropped. Narrow the field masks or use HA_LEAN_PUBLISH", smartMeterHA.modbusID, (unsigned long)dropped);
+  }
+#endif
+}
+
+// read the meter list from the config: comma separated <id>[@<bus>][:<label>[:<field mask in hex>]],
+// e.g. "1,2" or "1:Kitchen,2@2:Garage:7F".  The bus defaults to 1, the label to "UPS <id>" and the 
+// mask to every field.  The ids must differ across all the buses, they go into the entity ids
+void loadMeterList(const String& list) {
+  int start = 0;
+  while (start < (int)list.length()) {
+    int end = list.indexOf(',', start);
+    if (end < 0) {
+      end = list.length();
+    }
+    String item = list.substring(start, end);
+    start = end + 1;
+    item.trim();
+    if (item.length() == 0) {
+      continue;
+    }
+
+    String label = "";
+    MeterFieldMaskType fields = METER_ALL_FIELDS;
+    int labelAt = item.indexOf(':');
+    if (labelAt >= 0) {
+      label = item.substring(labelAt + 1);
+      item = item.substring(0, labelAt);
+      int maskAt = label.indexOf(':');
+      if (maskAt >= 0) {
+        fields = strtoul(label.substring(maskAt + 1).c_str(), nullptr, 16);
+        label = label.substring(0, maskAt);
+      }
+    }
+    int bus = 1;
+    int busAt = item.indexOf('@');
+    if (busAt >= 0) {
+      bus = item.substring(busAt + 1).toInt();
+      item = item.substring(0, busAt);
+    }
+    int modbusID = item.toInt();
+    if ((modbusID < 1) || (modbusID > 247)) {
+      LOG_ERROR("Ignoring meter with invalid Modbus ID: %s", item.c_str());
+      continue;
+    }
+    if ((bus < 1) || (bus > MODBUS_MAX_BUSES)) {
+      LOG_ERROR("Ignoring Modbus Client [%d], there is no bus %d on this board (%d available)", modbusID, bus, MODBUS_MAX_BUSES);
+      continue;
+    }
+    if (findMeter(modbusID)) {
+      LOG_ERROR("Ignoring Modbus Client [%d] on bus %d, that id is already configured", modbusID, bus);
+      continue;
+    }
+    if (label.length() == 0) {
+      label = "UPS " + String(modbusID);
+    }
+    HADataType::HAEntitiesType* meter = ha.addMeter(modbusID, label.c_str(), fields, bus - 1);
+    if (!meter) {
+      LOG_ERROR("Only %d meters can be configured, ignoring Modbus Client [%d]", METER_POOL_SIZE, modbusID);
+      continue;
+    }
+    MeterCycleType& cycle = meterCycles[meter->bus];
+    cycle.meters[cycle.meterCount++] = meter - ha.meters;
+  }
+}
+
+// ----[modbus line settings]-----
+// baud rate, framing, timeout and frame gap come from the config, a comma separated value per bus
+// or one for them all (see configListItem).  Anything that doesn't parse is logged and left at 
+// the default so the bus still comes up
+
+void loadBusSettings(uint8_t b) {
+  ModbusLineSettingsType& busSettings = modbusBuses[b].settings;
+  String value = configListItem(config.modbusBaud, b);
+  unsigned long baud = strtoul(value.c_str(), nullptr, 10);
+  if ((baud >= 1200) && (baud <= 115200)) {
+    busSettings.baud = baud;
+  } else {
+    LOG_ERROR("Invalid Modbus baud rate %s on bus %d, using %d", value.c_str(), b + 1, MODBUS_SERIAL_BAUD);
+  }
+
+  String framing = configListItem(config.modbusFraming, b);
+  framing.toUpperCase();
+  if (framing == "8N1") {
+    busSettings.serialConfig = SERIAL_8N1;
+    busSettings.bitsPerChar = 10;
+  } else if (framing == "8E1") {
+    busSettings.serialConfig = SERIAL_8E1;
+    busSettings.bitsPerChar = 11;
+  } else if (framing == "8O1") {
+    busSettings.serialConfig = SERIAL_8O1;
+    busSettings.bitsPerChar = 11;
+  } else if (framing == "8N2") {
+    busSettings.serialConfig = SERIAL_8N2;
+    busSettings.bitsPerChar = 11;
+  } else {
+    LOG_ERROR("Invalid Modbus framing %s on bus %d, using 8N1", framing.c_str(), b + 1);
+  }
+
+  value = configListItem(config.modbusTimeoutMs, b);
+  unsigned long timeoutMs = strtoul(value.c_str(), nullptr, 10);
+  if (timeoutMs > 0) {
+    busSettings.timeoutMs = timeoutMs;
+  } else {
+    LOG_ERROR("Invalid Modbus timeout %s on bus %d, using %dms", value.c_str(), b + 1, MODBUS_TIMEOUT_MS);
+  }
+
+  busSettings.frameGapUs = strtoul(configListItem(config.modbusFrameDelayUs, b).c_str(), nullptr, 10);
+  modbusBuses[b].listening = configListItem(config.busMode, b).equalsIgnoreCase("listen");
+}
+
+// ----[modbus auto-tune]-----
+// with mb_autotune set to yes, the next boot probes every meter on each polled bus at each of the 
+// baud rates the SDM120 supports, slowest first, and keeps the fastest that every meter on that bus
+// answers at.  The meters are then read a few times at that rate to measure how long they really 
+// take to answer, and the bus timeout is set from the slowest of them with room for the longest 
+// frame, in place of the 3s that allows for anything.  The results are saved to the config (a 
+// value per bus) and mb_autotune goes back to no, so this only costs boot time once.
+//
+// note that this finds the rate the meters are set to, it can't move them to a faster one.  The
+// SDM120 only takes a new baud rate in its set-up mode (from the front panel), so set the meters
+// to 38400 there first and this will pick it up along with a timeout to suit
+
+#define AUTOTUNE_PROBES             5     // reads per meter at each baud rate
+#define AUTOTUNE_PROBE_TIMEOUT_MS   500   // a meter that hasn't answered by now isn't at this baud rate
+#define AUTOTUNE_MARGIN_MS          20    // added to the worked out timeout for jitter on our side
+#define AUTOTUNE_MIN_TIMEOUT_MS     50
+
+const unsigned long autoTuneBaudRates[] = { 2400, 4800, 9600, 19200, 38400 };
+
+struct AutoTuneProbeType {
+  bool done = false;
+  bool answered = false;
+  unsigned long latencyMs = 0;
+} autoTuneProbe;
+
+void onAutoTuneProbe(ModbusTransactionType& transaction) {
+  autoTuneProbe.done = true;
+  // an exception is still an answer, the meter heard us at this rate
+  autoTuneProbe.answered = (transaction.result == MODBUS_OK) || (transaction.result == MODBUS_EXCEPTION);
+  autoTuneProbe.latencyMs = transaction.latencyMs;
+}
+
+// read the voltage off a meter and wait for the answer, returns false if it didn't answer
+bool probeMeter(ModbusBusType& bus, uint8_t modbusID, unsigned long& latencyMs) {
+  ModbusTransactionType transaction;
+  transaction.id = modbusID;
+  transaction.startRegister = meterRegisters[0].address;
+  transaction.count = 2;
+  transaction.timeoutMs = AUTOTUNE_PROBE_TIMEOUT_MS;
+  transaction.onComplete = onAutoTuneProbe;
+
+  autoTuneProbe.done = false;
+  if (!bus.client.enqueue(transaction)) {
+    LOG_ERROR("Auto-tune: no room on the bus queue to probe Modbus Client [%d]", modbusID);
+    return false;   // the callback would never come, count it as no answer
+  }
+  while (!autoTuneProbe.done) {
+    bus.client.poll();    // completes one way or the other by the probe timeout
+    yield();
+  }
+  latencyMs = autoTuneProbe.latencyMs;
+  return autoTuneProbe.answered;
+}
+
+// the slowest answer from any meter on a bus at the current rate, or false if one of them didn't answer
+bool probeAllMeters(uint8_t b, unsigned long& worstLatencyMs) {
+  const MeterCycleType& cycle = meterCycles[b];
+  worstLatencyMs = 0;
+  for (uint8_t i = 0; i < cycle.meterCount; i++) {
+    for (uint8_t probe = 0; probe < AUTOTUNE_PROBES; probe++) {
+      unsigned long latencyMs;
+      if (!probeMeter(modbusBuses[b], ha.meters[cycle.meters[i]].modbusID, latencyMs)) {
+        return false;
+      }
+      if (latencyMs > worstLatencyMs) {
+        worstLatencyMs = latencyMs;
+      }
+    }
+  }
+  return true;
+}
+
+// returns false if the meters on the bus don't all answer at any one rate, the settings are left alone then
+bool autoTuneModbusBus(uint8_t b) {
+  ModbusLineSettingsType& busSettings = modbusBuses[b].settings;
+  LOG_STATUS("Auto-tuning Modbus bus %d for %d meters", b + 1, meterCycles[b].meterCount);
+  unsigned long configuredBaud = busSettings.baud;
+  unsigned long bestBaud = 0;
+  unsigned long bestLatencyMs = 0;
+
+  for (unsigned long baud : autoTuneBaudRates) {
+    busSettings.baud = baud;
+    modbusBuses[b].startClient();
+    unsigned long worstLatencyMs;
+    if (probeAllMeters(b, worstLatencyMs)) {
+      LOG_STATUS("Auto-tune: every meter on bus %d answered at %lu baud, slowest in %lums", b + 1, baud, worstLatencyMs);
+      bestBaud = baud;
+      bestLatencyMs = worstLatencyMs;
+    } else {
+      LOG_TEXT("Auto-tune: not every meter on bus %d answered at %lu baud", b + 1, baud);
+    }
+  }
+
+  if (bestBaud == 0) {
+    LOG_ERROR("Auto-tune: the meters on bus %d don't all answer at any one baud rate, keeping %lu baud", b + 1, configuredBaud);
+    busSettings.baud = configuredBaud;
+    return false;
+  }
+
+  // the probe latency is the meter's turnaround plus the probe response on the wire, allow twice
+  // the turnaround and the longest frame there can be
+  unsigned long charUs = modbusCharTimeUs(bestBaud, busSettings.bitsPerChar);
+  unsigned long probeWireMs = (MODBUS_RESPONSE_BYTES + 4) * charUs / 1000;
+  unsigned long turnaroundMs = (bestLatencyMs > probeWireMs) ? bestLatencyMs - probeWireMs : 0;
+  unsigned long timeoutMs = 2 * turnaroundMs + (MODBUS_MAX_FRAME_BYTES * charUs + 999) / 1000 + AUTOTUNE_MARGIN_MS;
+  timeoutMs = constrain(timeoutMs, (unsigned long)AUTOTUNE_MIN_TIMEOUT_MS, (unsigned long)MODBUS_TIMEOUT_MS);
+
+  busSettings.baud = bestBaud;
+  busSettings.timeoutMs = timeoutMs;
+  LOG_STATUS("Auto-tune: using %lu baud with a %lums timeout on bus %d", bestBaud, timeoutMs, b + 1);
+  return true;
+}
+
+// tune every polled bus, and save the rates and timeouts as a list with a value per bus
+void autoTuneModbusBuses() {
+  bool allTuned = true;
+  String baudList = "";
+  String timeoutList = "";
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    if (!modbusBuses[b].listening && (meterCycles[b].meterCount > 0) && !autoTuneModbusBus(b)) {
+      allTuned = false;
+    }
+    if (b > 0) {
+      baudList += ",";
+      timeoutList += ",";
+    }
+    baudList += String(modbusBuses[b].settings.baud);
+    timeoutList += String(modbusBuses[b].settings.timeoutMs);
+  }
+
+  config.modbusBaud = baudList;
+  config.modbusTimeoutMs = timeoutList;
+  saveConfigValue("mb_baud", config.modbusBaud);
+  saveConfigValue("mb_timeout", config.modbusTimeoutMs);
+  if (allTuned) {
+    config.modbusAutoTune = "no";   // otherwise leave it set, so the failed buses try again next boot
+    saveConfigValue("mb_autotune", config.modbusAutoTune);
+  }
+}
 
 void setupSmartMeter() {
-  logStatus("Setting up RS485 Serial Port");
-  //create the RS485 serial port
-  Serial1.begin(MODBUS_SERIAL_BAUD, SERIAL_8N1, MODBUS_RX_PIN, MODBUS_TX_PIN);
-  RS485.begin(MODBUS_SERIAL_BAUD);
-
-  logStatus("Setting up Modbus RTU Client to connect to Eastron");
-  // start the Modbus RTU client (note that params must be the same as above)
-  while (!ModbusRTUClient.begin(RS485, MODBUS_SERIAL_BAUD, SERIAL_8N1)) {
-    logError("Failed to start Modbus RTU Client!  Retrying in 5 seconds...");
-    delay(5000);
-  }
-  ModbusRTUClient.setTimeout(3000);
- 
-  // set up the timer thread
+  LOG_STATUS("Setting up RS485 Serial Ports");
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    loadBusSettings(b);
+  }
+
+  // build the meters from the config, and their entities from the register table
+  loadMeterList(config.meters);
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    setupMeterEntities(ha.meters[m]);
+  }
+  LOG_STATUS("%d meters configured, %d of %d meter entities used", ha.meterCount, ha.entityPool.allocated(), METER_ENTITY_POOL_SIZE);
+
+  bool polling = false;
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    if (meterCycles[b].meterCount == 0) {
+      continue;   // nothing on this bus, leave the UART and its pins alone
+    }
+    polling |= !modbusBuses[b].listening;
+  }
+  // we are the only master on the polled buses, so we can probe them
+  if (config.modbusAutoTune.equalsIgnoreCase("yes") && polling) {
+    autoTuneModbusBuses();
+  }
+
+  for (uint8_t b = 0; b < MODBUS_MAX_BUSES; b++) {
+    ModbusBusType& bus = modbusBuses[b];
+    if (meterCycles[b].meterCount == 0) {
+      continue;
+    }
+    if (bus.listening) {
+      LOG_STATUS("Listening in on the Modbus traffic on bus %d, its %d meters will not be polled", b + 1, meterCycles[b].meterCount);
+      bus.startListening(onSniffedRead);
+    } else {
+      LOG_STATUS("Setting up Modbus RTU Client on bus %d for %d meters at %lu baud, %lums timeout", b + 1, meterCycles[b].meterCount, bus.settings.baud, bus.settings.timeoutMs);
+      bus.startClient();
+    }
+  }
+
+  // set up a poll timer for each register group (in group order, so the scheduler ids line up)
+  for (uint8_t group = 0; group < REGISTER_GROUP_COUNT; group++) {
+    ha.timers.meterPolling.addGroup(registerGroupPeriodMs[group]);
+  }
+
+  // readings taken while offline are sent on from here
+  offlineBuffer.begin();
+  ha.timers.replayBacklog.onRun(onReplayBacklogEvent);
+  ha.timers.replayBacklog.setInterval(BACKLOG_REPLAY_INTERVAL_MS);
+  ha.timers.replayBacklog.enabled = true;
+
+  // the network may not be up yet, the gateway starts listening once it is
+  setupModbusGateway();
+
+  // set up the timer thread that checks for due groups and runs the bus cycles
   ha.timers.readSmartMeters.onRun(onSensorUpdateEvent);
-	ha.timers.readSmartMeters.setInterval(10 * 1000);   // poll every X seconds
-  ha.timers.readSmartMeters.enabled = true;           // ensure that the thread is enabled
+	ha.timers.readSmartMeters.setInterval(METER_POLL_TICK_MS);  // check for due groups every X milliseconds
+  ha.timers.readSmartMeters.enabled = polling; // ensure that the thread is enabled, unless someone else is polling every bus
 
+#ifdef METER_DUAL_CORE
+  startMeterAcquisitionTask();    // from here on the buses belong to the modbus task
+#endif
 }
 
+// (re)announce the meters each time the broker connection comes up
+void onSmartMeterMqttConnected() {
+  // anything read while we were away went to the backlog, so resend the current values in full
+  for (uint8_t m = 0; m < ha.meterCount; m++) {
+    for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+      ha.meters[m].fieldState[i].published = false;
+    }
+  }
+}
 
+// service the modbus transactions on every bus (or in dual core mode, what the modbus task has 
+// read) and the gateway, call this on every pass of loop()
+void loopSmartMeter() {
+#ifdef METER_DUAL_CORE
+  drainSampleQueue();
+#else
+  serviceModbusBus();
+#endif
+  modbusGateway.poll();
+}
@@ -30,6 +30,23 @@ struct ConfigurationStructType {
 #endif
   String timeZone               = "Europe/London";                  // used by NTP Time Libraries
   IPAddress mqttBrokerAddress   = IPAddress(0,0,0,0);               // used by Home Assistant for MQTT broker
+  String mqttBrokerHost         = "none";                           // host name of the broker, which TLS needs to check its certificate, or none to use the IP address
+  String mqttBrokerPort         = "0";                              // MQTT broker port, 0 for the standard one (1883, or 8883 over TLS)
+  String meters                 = "1,2";                            // modbus meters, comma separated <id>[@<bus>][:<label>[:<field mask in hex>]]
+  // the bus settings below take a comma separated value per bus, or one value for all the buses
+  String busMode                = "poll";                           // "poll" to read the meters, "listen" to pick up another master's reads
+  String modbusBaud             = "9600";                           // modbus baud rate, must match the meters (the SDM120 does 2400 to 38400)
+  String modbusFraming          = "8N1";                            // modbus data bits, parity (N, E or O) and stop bits, must match the meters
+  String modbusTimeoutMs        = "3000";                           // how long to wait for a meter to answer a request
+  String modbusFrameDelayUs     = "0";                              // silence between modbus frames, 0 for the standard 3.5 characters
+  String modbusAutoTune         = "no";                             // "yes" to probe the meters for the fastest baud rate and a tight timeout on the next boot
+  String modbusGatewayPort      = "0";                              // port for the modbus TCP gateway to the cached registers (502 is standard), 0 for off
+  String modbusGatewayMaxAgeS   = "180";                            // the gateway answers with an exception rather than serve a reading older than this
+  String pollPeriodsMs          = "default";                        // poll period of the power, demand and energy registers, comma separated, or default
+  String publishDeadbands       = "default";                        // publish filter deadbands, comma separated <filter>:<band>, or default for the register table's
+  String tariffImport           = "0.25";                           // price per kWh imported, for the cost estimate
+  String tariffExport           = "0.00";                           // price paid per kWh exported
+  String currency               = "GBP";                            // unit the cost estimate is shown in
 
   // Secret Items (really should NOT have defaults specificed here in the source code)
   String secretWiFiSSID         = "";                               // used by WiFi
@@ -51,11 +68,11 @@ String loadConfig(String key, String defaultValue = "", String prompt = "", bool
 
   // no value found
   while (value == "") {
-    //logStatus("No value found for key: " + key);
+    //LOG_STATUS("No value found for key: %s", key.c_str());
     value = promptAndReadLine(prompt.c_str(), defaultValue.c_str());
     // if mandatory, keep asking
     if (mandatory && (value == "")) {
-      logStatus("A value is required for this key to proceed.");
+      LOG_STATUS("A value is required for this key to proceed.");
     } else {
       // ok, let's save it
       break;
@@ -66,7 +83,7 @@ String loadConfig(String key, String defaultValue = "", String prompt = "", bool
   preferences.putString(key.c_str(), value);
 
   // uncomment this line to get a serial readout of your configuraiton on startup
-  // logText("Config: " + key + " = " + value);
+  // LOG_TEXT("Config: %s = %s", key.c_str(), value.c_str());
 
   return value;
 
@@ -118,6 +135,118 @@ void setupConfig() {
       doReconfigure
     );
 
+    config.meters = loadConfig(
+      "meters", 
+      config.meters,
+      "Enter the Modbus IDs of the meters, comma separated. Each can have @ and the bus it is on (1 if not given), a label and a hex mask of the fields to read, e.g. 1:Kitchen,2@2:Garage:7F : ",
+      true,
+      doReconfigure
+    );
+
+    config.busMode = loadConfig(
+      "bus_mode", 
+      config.busMode,
+      "Enter poll to read the meters, or listen if something else (e.g. a solar inverter) already polls them and we should only listen in. Comma separated for each bus if they differ: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusBaud = loadConfig(
+      "mb_baud", 
+      config.modbusBaud,
+      "Enter the Modbus baud rate the meters are set to (2400, 4800, 9600, 19200 or 38400). Comma separated for each bus if they differ: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusFraming = loadConfig(
+      "mb_framing", 
+      config.modbusFraming,
+      "Enter the Modbus data bits, parity and stop bits the meters are set to (8N1, 8E1, 8O1 or 8N2). Comma separated for each bus if they differ: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusTimeoutMs = loadConfig(
+      "mb_timeout", 
+      config.modbusTimeoutMs,
+      "Enter how long to wait for a meter to answer, in milliseconds. Comma separated for each bus if they differ: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusFrameDelayUs = loadConfig(
+      "mb_frame_us", 
+      config.modbusFrameDelayUs,
+      "Enter the silence between Modbus frames in microseconds, or 0 for the standard 3.5 characters. Comma separated for each bus if they differ: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusAutoTune = loadConfig(
+      "mb_autotune", 
+      config.modbusAutoTune,
+      "Enter yes to probe the meters for the fastest baud rate and a tight timeout when the device starts: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusGatewayPort = loadConfig(
+      "mbtcp_port", 
+      config.modbusGatewayPort,
+      "Enter the port for a Modbus TCP gateway that serves the last readings to other systems (502 is the standard one), or 0 for none: ",
+      true,
+      doReconfigure
+    );
+
+    config.modbusGatewayMaxAgeS = loadConfig(
+      "mbtcp_max_age", 
+      config.modbusGatewayMaxAgeS,
+      "Enter the oldest reading in seconds the Modbus TCP gateway will serve, older ones get a gateway target exception: ",
+      true,
+      doReconfigure
+    );
+
+    config.pollPeriodsMs = loadConfig(
+      "poll_ms", 
+      config.pollPeriodsMs,
+      "Enter the poll periods in ms of the power, demand and energy registers (e.g. 1000,30000,60000), or default: ",
+      true,
+      doReconfigure
+    );
+
+    config.publishDeadbands = loadConfig(
+      "deadbands", 
+      config.publishDeadbands,
+      "Enter the publish deadbands as <filter>:<band> (e.g. power:0.05,voltage:1), or default: ",
+      true,
+      doReconfigure
+    );
+
+    config.tariffImport = loadConfig(
+      "tariff_imp", 
+      config.tariffImport,
+      "Enter the price you pay per kWh imported, for the cost estimate: ",
+      true,
+      doReconfigure
+    );
+
+    config.tariffExport = loadConfig(
+      "tariff_exp", 
+      config.tariffExport,
+      "Enter the price you are paid per kWh exported, or 0: ",
+      true,
+      doReconfigure
+    );
+
+    config.currency = loadConfig(
+      "currency", 
+      config.currency,
+      "Enter the currency the prices are in, e.g. GBP: ",
+      true,
+      doReconfigure
+    );
+
     while (!config.mqttBrokerAddress.fromString( 
       loadConfig(
         "mqtt_broker_ip", 
@@ -127,8 +256,24 @@ void setupConfig() {
         doReconfigure 
       ).c_str() )) 
     {
-      logStatus("Could not parse IP Address, or IP address is unconfigured value 0.0.0.0, please try again.");
+      LOG_STATUS("Could not parse IP Address, or IP address is unconfigured value 0.0.0.0, please try again.");
     }
+
+    config.mqttBrokerHost = loadConfig(
+      "mqtt_host", 
+      config.mqttBrokerHost,
+      "Enter the host name of the MQTT broker (needed for TLS), or none to connect to the IP address: ",
+      true,
+      doReconfigure
+    );
+
+    config.mqttBrokerPort = loadConfig(
+      "mqtt_port", 
+      config.mqttBrokerPort,
+      "Enter the MQTT broker port, or 0 for the standard one: ",
+      true,
+      doReconfigure
+    );
     
   preferences.end();
 
@@ -170,6 +315,30 @@ void setupConfig() {
 
 }
 
+// change a saved config value from outside setupConfig(), e.g. once the modbus settings have been tuned
+void saveConfigValue(const char* key, const String& value) {
+  preferences.begin("config");
+  preferences.putString(key, value);
+  preferences.end();
+}
+
+// one item of a comma separated config value, e.g. the baud rate for a bus out of "9600,38400".
+// A list shorter than index+1 gives its last item, so a single value goes for every bus
+String configListItem(const String& list, uint8_t index) {
+  int start = 0;
+  for (uint8_t i = 0; i < index; i++) {
+    int comma = list.indexOf(',', start);
+    if (comma < 0) {
+      break;    // ran out, stay on the last item
+    }
+    start = comma + 1;
+  }
+  int end = list.indexOf(',', start);
+  String item = list.substring(start, (end < 0) ? list.length() : end);
+  item.trim();
+  return item;
+}
+
 String getUniqueChipID() {
 
 #ifdef ARDUINO_ARCH_SAMD
@@ -44,7 +44,7 @@ void configureCrypto() {
       logSuspend("Locking ECCX08 configuration failed!");
     }
 
-    logStatus("ECCX08 locked successfully");
+    LOG_STATUS("ECCX08 locked successfully");
   }
 
   // CONFIGURE CRYPTO_SLOT IN CONSTANTS of the module header
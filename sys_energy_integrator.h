@@ -0,0 +1,122 @@
+// ----[ENERGY INTEGRATOR MODULE]-----
+// energy worked out on the device from the power readings, rather than waiting on the meter's
+// energy registers (which only move in 10Wh steps) or leaving home assistant to do the sums
+//
+// each power sample is joined to the one before it with a straight line and the area under it
+// is added on (the trapezoidal rule), using the time the samples were actually taken, so a late
+// or missed poll is weighted properly rather than assumed to be one period.  Where the line
+// crosses zero it is split there, so import (power > 0) and export (power < 0) are kept apart.
+// Everything is a running total, a few words per meter and a handful of sums per sample, so it
+// keeps up with 1s polling over a full bus.  Samples more than ENERGY_MAX_GAP_MS apart (the meter
+// was offline or backed off) are not joined, we don't know what happened in between.
+//
+// the interval sums are floats and small, they are folded into the double totals once an interval
+
+#pragma once
+
+#include <Arduino.h>
+
+#define ENERGY_MAX_GAP_MS   30000     // longest gap between power samples that is integrated over
+#define ENERGY_MAX_POWER_PERIOD_MS  (ENERGY_MAX_GAP_MS / 2)   // slowest power poll, a missed poll is still joined
+#define MS_PER_HOUR         3600000.0f
+
+class PowerIntegratorType {
+public:
+  float intervalImportWh = 0;     // energy in and out since the interval started
+  float intervalExportWh = 0;
+  uint32_t gaps = 0;              // times samples were too far apart to join
+
+  // add a power sample, in W (negative when exporting)
+  void add(float powerW, unsigned long timestampMs) {
+    if (this->primed) {
+      unsigned long dt = timestampMs - this->lastMs;
+      if (dt > ENERGY_MAX_GAP_MS) {
+        this->gaps++;
+      } else if (dt > 0) {
+        addSegment(this->lastW, powerW, dt / MS_PER_HOUR);
+      }
+    }
+    this->lastW = powerW;
+    this->lastMs = timestampMs;
+    this->primed = true;
+  }
+
+  // start a new interval, the last sample carries over so nothing falls between intervals
+  void resetInterval() {
+    this->intervalImportWh = 0;
+    this->intervalExportWh = 0;
+  }
+
+private:
+  float lastW = 0;
+  unsigned long lastMs = 0;
+  bool primed = false;
+
+  // the area under a straight line from a to b over hours, split where it crosses zero
+  void addSegment(float a, float b, float hours) {
+    if ((a >= 0) && (b >= 0)) {
+      this->intervalImportWh += (a + b) * 0.5f * hours;
+    } else if ((a <= 0) && (b <= 0)) {
+      this->intervalExportWh -= (a + b) * 0.5f * hours;
+    } else {
+      float crossing = hours * a / (a - b);     // time from a to the zero crossing
+      float positive = (a > 0) ? a : b;
+      float negative = (a > 0) ? b : a;
+      float positiveHours = (a > 0) ? crossing : hours - crossing;
+      this->intervalImportWh += positive * 0.5f * positiveHours;
+      this->intervalExportWh -= negative * 0.5f * (hours - positiveHours);
+    }
+  }
+};
+
+// how far a meter's energy register moved over an interval
+class RegisterDeltaType {
+public:
+  void note(float value) {
+    this->latest = value;
+    if (!this->hasBaseline) {
+      this->baseline = value;
+      this->hasBaseline = true;
+    }
+  }
+
+  // the movement in the register since the last call, in its own units.  A register that has
+  // gone backwards (the meter was reset or replaced) counts from where it is now
+  float take() {
+    float delta = this->latest - this->baseline;
+    this->baseline = this->latest;
+    return (delta > 0) ? delta : 0;
+  }
+
+private:
+  float baseline = 0;
+  float latest = 0;
+  bool hasBaseline = false;
+};
+
+// the derived figures for one meter
+struct DerivedMeterType {
+  PowerIntegratorType power;
+  RegisterDeltaType importEnergy;     // kWh registers
+  RegisterDeltaType exportEnergy;
+  double totalImportWh = 0;           // integrated since boot
+  double totalExportWh = 0;
+
+  // the last completed interval
+  struct {
+    float importWh = 0;               // integrated from the power
+    float exportWh = 0;
+    float registerImportWh = 0;       // from the meter's own registers
+    float registerExportWh = 0;
+  } interval;
+
+  void closeInterval() {
+    this->interval.importWh = this->power.intervalImportWh;
+    this->interval.exportWh = this->power.intervalExportWh;
+    this->interval.registerImportWh = this->importEnergy.take() * 1000;
+    this->interval.registerExportWh = this->exportEnergy.take() * 1000;
+    this->totalImportWh += this->power.intervalImportWh;
+    this->totalExportWh += this->power.intervalExportWh;
+    this->power.resetInterval();
+  }
+};
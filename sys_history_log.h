@@ -0,0 +1,454 @@
+// ----[HISTORY LOG MODULE]-----
+// a rolling history of a few readings per meter, kept in flash so it survives a reboot
+//
+// the log is a ring of pages, each one a file on the LittleFS partition of one flash sector.  The
+// page being filled is held in RAM and only written out when it is full, or every so often (see
+// flush()), so a sector is written a few times an hour rather than on every reading.  LittleFS
+// writes a file out in full before it lets go of the old copy, so a reset in the middle of a
+// write leaves the page as it was before.
+//
+// the readings are stored in fixed point (e.g. 0.1W steps) as the difference from the previous
+// point for the same meter in the page, zigzag and varint encoded.  Meter readings move slowly
+// from one point to the next, so most differences fit one or two bytes, and a point with its
+// timestamp takes around 6 bytes rather than 16.  Each page starts its differences over, so a
+// page can be decoded on its own.
+//
+// every page header holds the time of its first and last points, and the headers are kept in
+// RAM, so a time range query goes straight to the first page it needs with a binary search.
+//
+// timestamps are unix time in seconds, so the clock must be set (NTP) before anything is logged.
+// Points must be added in time order, a point earlier than the last one is refused
+
+#pragma once
+
+#include <Arduino.h>
+#include "sys_logStatus.h"
+
+// uncomment this line to keep the history on the ESP32 (needs a LittleFS partition)
+// #define METER_HISTORY
+
+#if defined(METER_HISTORY) && defined(ARDUINO_ARCH_ESP32)
+  #include <LittleFS.h>
+#else
+  #undef METER_HISTORY
+#endif
+
+#ifdef METER_HISTORY
+
+#define HISTORY_PAGE_BYTES    4096      // one flash sector, header included
+#define HISTORY_PAGES         96        // pages in the ring, about 380KB of flash
+#define HISTORY_CHANNELS      3         // readings in a point
+#define HISTORY_MAX_STREAMS   16        // meters that can share a page, as many as the meter pool
+#define HISTORY_MAX_RECORD    (1 + 5 + HISTORY_CHANNELS * 5)    // meter id and varints, the worst case
+#define HISTORY_PAGE_MAGIC    0x31545348UL                      // "HST1"
+#define HISTORY_FILE_FORMAT   "/history_%02u.bin"
+
+struct HistoryPointType {
+  uint32_t timeS = 0;                       // unix time
+  uint8_t stream = 0;                       // modbus id of the meter
+  int32_t values[HISTORY_CHANNELS] = {};    // fixed point, the steps are up to the caller
+};
+
+struct HistoryPageHeaderType {
+  uint32_t magic;
+  uint32_t sequence;      // counts up from 1 with every new page, 0 for a free slot
+  uint32_t firstS;        // time of the first and last points in the page
+  uint32_t lastS;
+  uint16_t used;          // bytes of records after the header
+  uint16_t records;
+};
+
+#define HISTORY_PAGE_CAPACITY ((uint16_t)(HISTORY_PAGE_BYTES - sizeof(HistoryPageHeaderType)))
+
+// the latest readings of a meter, what its next point is made from
+struct HistoryInputsType {
+  float values[HISTORY_CHANNELS] = {};
+  uint8_t seen = 0;       // bit per channel read since the last point, nothing means the meter has gone quiet
+};
+
+// the last values of each meter seen in a page, what the next point for it is a difference from.
+// Both the encoder and the decoder keep one, built up the same way as they go through the page
+struct HistoryDeltaStateType {
+  uint8_t streams[HISTORY_MAX_STREAMS];
+  int32_t values[HISTORY_MAX_STREAMS][HISTORY_CHANNELS];
+  uint8_t count = 0;
+  uint32_t lastS = 0;
+
+  void reset(uint32_t firstS) {
+    this->count = 0;
+    this->lastS = firstS;
+  }
+
+  // the previous values for a stream, added (as all zero) if it hasn't been seen in the page
+  // yet.  nullptr if the table is full
+  int32_t* find(uint8_t stream) {
+    for (uint8_t i = 0; i < this->count; i++) {
+      if (this->streams[i] == stream) {
+        return this->values[i];
+      }
+    }
+    if (this->count >= HISTORY_MAX_STREAMS) {
+      return nullptr;
+    }
+    this->streams[this->count] = stream;
+    memset(this->values[this->count], 0, sizeof(this->values[this->count]));
+    return this->values[this->count++];
+  }
+
+  bool full() const { return this->count >= HISTORY_MAX_STREAMS; }
+};
+
+// walk the points in a page, oldest first
+class HistoryPageDecoderType {
+public:
+  HistoryPageDecoderType(const HistoryPageHeaderType& header, const uint8_t* records) :
+      data(records), length(header.used) {
+    this->state.reset(header.firstS);
+  }
+
+  // false at the end of the page, or if the rest of it doesn't make sense
+  bool next(HistoryPointType& point) {
+    if (this->position >= this->length) {
+      return false;
+    }
+    point.stream = this->data[this->position++];
+    uint32_t timeDelta;
+    int32_t* previous = this->state.find(point.stream);
+    if (!previous || !readVarint(timeDelta)) {
+      this->position = this->length;
+      return false;
+    }
+    this->state.lastS += timeDelta;
+    point.timeS = this->state.lastS;
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+      uint32_t zigzag;
+      if (!readVarint(zigzag)) {
+        this->position = this->length;
+        return false;
+      }
+      previous[c] += (int32_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+      point.values[c] = previous[c];
+    }
+    return true;
+  }
+
+private:
+  const uint8_t* data;
+  uint16_t length;
+  uint16_t position = 0;
+  HistoryDeltaStateType state;
+
+  bool readVarint(uint32_t& value) {
+    value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7) {
+      if (this->position >= this->length) {
+        return false;
+      }
+      uint8_t byte = this->data[this->position++];
+      value |= (uint32_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// where a range query has got to, filled in by HistoryLogType::seek()
+struct HistoryQueryType {
+  uint8_t stream = 0;
+  uint32_t fromS = 0;
+  uint32_t toS = 0;
+  uint16_t slot = 0;        // the page it has got to, and that page's sequence so we can tell
+  uint32_t sequence = 0;    // if it has been reused for newer points since
+  uint16_t record = 0;      // points already gone through in that page
+  bool done = true;
+};
+
+class HistoryLogType {
+public:
+  // call once at startup, finds the pages already in flash and carries on from the newest
+  bool begin() {
+    this->ready = LittleFS.begin(true);
+    if (!this->ready) {
+      LOG_ERROR("LittleFS unavailable, no history will be kept");
+      return false;
+    }
+
+    uint32_t newest = 0;
+    for (uint16_t slot = 0; slot < HISTORY_PAGES; slot++) {
+      HistoryPageHeaderType& header = this->index[slot];
+      if (!loadPage(slot, header, nullptr)) {
+        memset(&header, 0, sizeof(header));
+      } else if (header.sequence > newest) {
+        newest = header.sequence;
+        this->current = slot;
+      }
+    }
+    this->nextSequence = newest + 1;
+
+    this->header = this->index[this->current];
+    if (newest == 0) {
+      startPage(0);
+    } else if (loadPage(this->current, this->header, this->page) && (this->header.used + HISTORY_MAX_RECORD <= HISTORY_PAGE_CAPACITY)) {
+      // carry on filling the newest page where it left off, which needs the deltas it ended on
+      HistoryPageDecoderType decoder(this->header, this->page);
+      HistoryPointType point;
+      this->encoder.reset(this->header.firstS);
+      for (uint16_t i = 0; (i < this->header.records) && decoder.next(point); i++) {
+        memcpy(this->encoder.find(point.stream), point.values, sizeof(point.values));
+        this->encoder.lastS = point.timeS;
+      }
+    } else {
+      startPage((this->current + 1) % HISTORY_PAGES);
+    }
+    LOG_STATUS("History has %u of %u pages in use", pagesInUse(), HISTORY_PAGES);
+    return true;
+  }
+
+  // add a point to the page in RAM, moving on to the next page if it's full
+  bool append(const HistoryPointType& point) {
+    if (!this->ready || (point.timeS < this->header.lastS)) {
+      this->refused++;
+      return false;
+    }
+    if (this->header.records == 0) {
+      this->header.firstS = point.timeS;
+      this->encoder.reset(point.timeS);
+    } else if ((this->header.used + HISTORY_MAX_RECORD > HISTORY_PAGE_CAPACITY) || (this->encoder.full() && !hasStream(point.stream))) {
+      flush();
+      startPage((this->current + 1) % HISTORY_PAGES);
+      this->header.firstS = point.timeS;
+      this->encoder.reset(point.timeS);
+    }
+
+    int32_t* previous = this->encoder.find(point.stream);
+    uint8_t* out = this->page + this->header.used;
+    *out++ = point.stream;
+    out = writeVarint(out, point.timeS - this->encoder.lastS);
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+      int32_t delta = point.values[c] - previous[c];
+      out = writeVarint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+      previous[c] = point.values[c];
+    }
+    this->encoder.lastS = point.timeS;
+    this->header.used = out - this->page;
+    this->header.records++;
+    this->header.lastS = point.timeS;
+    this->index[this->current] = this->header;
+    this->dirty = true;
+    return true;
+  }
+
+  // write the page in RAM out to its slot, if anything was added since the last time.  Call this
+  // every so often, it is how much history a power cut can take
+  bool flush() {
+    if (!this->ready || !this->dirty) {
+      return true;
+    }
+    char path[24];
+    snprintf(path, sizeof(path), HISTORY_FILE_FORMAT, this->current);
+    File file = LittleFS.open(path, FILE_WRITE);
+    bool written = file &&
+        (file.write(reinterpret_cast<const uint8_t*>(&this->header), sizeof(this->header)) == sizeof(this->header)) &&
+        (file.write(this->page, this->header.used) == this->header.used);
+    if (file) {
+      file.close();
+    }
+    if (!written) {
+      LOG_ERROR("Could not write history page %u", this->current);
+      return false;
+    }
+    this->dirty = false;
+    this->flushes++;
+    if (this->readSlot == this->current) {
+      this->readSlot = -1;
+    }
+    return true;
+  }
+
+  // start a query for the points of one stream from fromS to toS (inclusive)
+  void seek(HistoryQueryType& query, uint8_t stream, uint32_t fromS, uint32_t toS) {
+    query.stream = stream;
+    query.fromS = fromS;
+    query.toS = toS;
+    query.record = 0;
+    // the first page that ends at or after fromS, the pages are in time order
+    uint16_t low = 0;
+    uint16_t high = pagesInUse();
+    while (low < high) {
+      uint16_t middle = (low + high) / 2;
+      if (this->index[slotOf(middle)].lastS < fromS) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    query.slot = slotOf(low);
+    query.sequence = this->index[query.slot].sequence;
+    query.done = (low >= pagesInUse()) || (fromS > toS);
+  }
+
+  // up to max more points for a query, 0 once it's done
+  uint16_t read(HistoryQueryType& query, HistoryPointType* out, uint16_t max) {
+    uint16_t n = 0;
+    while (!query.done && (n < max)) {
+      if (this->index[query.slot].sequence != query.sequence) {
+        // the ring has come round and reused the page, carry on from what is now the oldest
+        query.slot = slotOf(0);
+        query.sequence = this->index[query.slot].sequence;
+        query.record = 0;
+      }
+      uint16_t slot = query.slot;
+      if (this->index[slot].firstS > query.toS) {
+        query.done = true;
+        break;
+      }
+      const uint8_t* records = recordsOf(slot);
+      if (!records) {
+        LOG_ERROR("Could not read history page %u, skipping it", slot);
+        nextPage(query);
+        continue;
+      }
+      HistoryPageDecoderType decoder((slot == this->current) ? this->header : this->readHeader, records);
+      HistoryPointType point;
+      uint16_t record = 0;
+      bool more = true;
+      while (more && (n < max)) {
+        more = decoder.next(point);
+        if (!more) {
+          break;
+        }
+        if (record++ < query.record) {
+          continue;     // sent already
+        }
+        query.record = record;
+        if (point.timeS > query.toS) {
+          query.done = true;
+          break;
+        }
+        if ((point.stream == query.stream) && (point.timeS >= query.fromS)) {
+          out[n++] = point;
+        }
+      }
+      if (!more) {
+        nextPage(query);
+      }
+    }
+    return n;
+  }
+
+  uint16_t pagesInUse() const {
+    return (this->index[(this->current + 1) % HISTORY_PAGES].sequence != 0) ? HISTORY_PAGES : this->current + 1;
+  }
+  uint32_t oldestS() const { return this->index[slotOf(0)].firstS; }
+  uint32_t newestS() const { return this->header.lastS; }
+  uint32_t refusedPoints() const { return this->refused; }    // points out of time order, or with no flash
+  uint32_t pageWrites() const { return this->flushes; }
+
+private:
+  bool ready = false;
+  HistoryPageHeaderType index[HISTORY_PAGES] = {};   // the header of every slot, 0 sequence for a free one
+  uint16_t current = 0;                              // slot of the page in RAM
+  uint32_t nextSequence = 1;
+  HistoryPageHeaderType header = {};                 // of the page in RAM
+  uint8_t page[HISTORY_PAGE_CAPACITY];
+  HistoryDeltaStateType encoder;
+  bool dirty = false;
+  uint32_t refused = 0;
+  uint32_t flushes = 0;
+
+  // the last page read back from flash for a query, so a query that takes several reads to send
+  // doesn't load its page again every time
+  int16_t readSlot = -1;
+  HistoryPageHeaderType readHeader;
+  uint8_t readPage[HISTORY_PAGE_CAPACITY];
+
+  // pages from the oldest to a slot in the ring
+  uint16_t slotOf(uint16_t page) const {
+    uint16_t oldest = (pagesInUse() == HISTORY_PAGES) ? (this->current + 1) % HISTORY_PAGES : 0;
+    return (oldest + page) % HISTORY_PAGES;
+  }
+
+  // on to the page written after the query's one, if there is one
+  void nextPage(HistoryQueryType& query) {
+    if (query.slot == this->current) {
+      query.done = true;
+      return;
+    }
+    query.slot = (query.slot + 1) % HISTORY_PAGES;
+    query.sequence++;
+    query.record = 0;
+    query.done = this->index[query.slot].sequence != query.sequence;
+  }
+
+  bool hasStream(uint8_t stream) const {
+    for (uint8_t i = 0; i < this->encoder.count; i++) {
+      if (this->encoder.streams[i] == stream) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void startPage(uint16_t slot) {
+    this->current = slot;
+    this->header.magic = HISTORY_PAGE_MAGIC;
+    this->header.sequence = this->nextSequence++;
+    this->header.used = 0;
+    this->header.records = 0;
+    this->header.firstS = this->header.lastS;     // until the first point, keeps the index in time order
+    this->index[slot] = this->header;
+    this->dirty = false;
+    if (this->readSlot == slot) {
+      this->readSlot = -1;
+    }
+  }
+
+  // read a slot's header, and its records if there is somewhere to put them
+  bool loadPage(uint16_t slot, HistoryPageHeaderType& pageHeader, uint8_t* records) {
+    char path[24];
+    snprintf(path, sizeof(path), HISTORY_FILE_FORMAT, slot);
+    if (!LittleFS.exists(path)) {
+      return false;
+    }
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+      return false;
+    }
+    bool valid = (file.read(reinterpret_cast<uint8_t*>(&pageHeader), sizeof(pageHeader)) == sizeof(pageHeader)) &&
+        (pageHeader.magic == HISTORY_PAGE_MAGIC) && (pageHeader.used <= HISTORY_PAGE_CAPACITY) &&
+        (file.size() == sizeof(pageHeader) + pageHeader.used);
+    if (valid && records) {
+      valid = file.read(records, pageHeader.used) == pageHeader.used;
+    }
+    file.close();
+    return valid;
+  }
+
+  // the records of a slot, from RAM for the page being filled
+  const uint8_t* recordsOf(uint16_t slot) {
+    if (slot == this->current) {
+      return this->page;
+    }
+    if (this->readSlot != (int16_t)slot) {
+      this->readSlot = -1;
+      if (!loadPage(slot, this->readHeader, this->readPage)) {
+        return nullptr;
+      }
+      this->readSlot = slot;
+    }
+    return this->readPage;
+  }
+
+  static uint8_t* writeVarint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+      *out++ = (value & 0x7F) | 0x80;
+      value >>= 7;
+    }
+    *out++ = value;
+    return out;
+  }
+};
+
+#endif
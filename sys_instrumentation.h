@@ -0,0 +1,140 @@
+// ----[INSTRUMENTATION MODULE]-----
+// cheap timing of the hot paths, so we can see where the time goes on a running board
+//
+// each stage that is timed gets a histogram of how long it took, in power of two buckets of
+// microseconds (bucket 0 is under 2us, bucket n is 2^n to 2^(n+1) us).  Recording a span is a
+// couple of micros() calls and an increment, there is no heap and nothing is ever cleared.  The
+// counts only ever go up, so whoever reports on them keeps a copy from the last report and works
+// the percentiles out over the difference.  That way the writer (which may be the modbus task in
+// dual core mode) never has to be stopped to reset anything.  A report that lands part way through
+// an update may be one sample off, which is fine for this.
+
+#pragma once
+
+#include <Arduino.h>
+
+#define HISTOGRAM_BUCKETS   24    // up to 2^24 us, about 16 seconds
+
+struct SpanHistogramType {
+  uint32_t counts[HISTOGRAM_BUCKETS] = {};
+
+  void record(uint32_t us) {
+    uint8_t bucket = 0;
+    while ((us > 1) && (bucket < HISTOGRAM_BUCKETS - 1)) {
+      us >>= 1;
+      bucket++;
+    }
+    this->counts[bucket]++;
+  }
+};
+
+// the spans recorded since the last report of a histogram
+class SpanReportType {
+public:
+  uint32_t samples = 0;
+
+  // compare a histogram against where it was at the last report, and move the report on
+  void update(const SpanHistogramType& histogram) {
+    this->samples = 0;
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      uint32_t count = histogram.counts[i];
+      this->window[i] = count - this->previous[i];
+      this->previous[i] = count;
+      this->samples += this->window[i];
+    }
+  }
+
+  // the time that pct percent of the spans came in under, as the top of its bucket in us
+  uint32_t percentileUs(uint8_t pct) const {
+    if (this->samples == 0) {
+      return 0;
+    }
+    uint32_t wanted = ((uint64_t)this->samples * pct + 99) / 100;   // round up, so p100 is the last span
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      seen += this->window[i];
+      if (seen >= wanted) {
+        return bucketTopUs(i);
+      }
+    }
+    return bucketTopUs(HISTOGRAM_BUCKETS - 1);
+  }
+
+  // the slowest span, as the top of its bucket
+  uint32_t peakUs() const { return percentileUs(100); }
+
+private:
+  uint32_t previous[HISTOGRAM_BUCKETS] = {};
+  uint32_t window[HISTOGRAM_BUCKETS] = {};
+
+  static uint32_t bucketTopUs(uint8_t bucket) { return (2UL << bucket) - 1; }
+};
+
+// times a scope into a histogram, e.g. { SpanTimerType span(instrumentation.wifi); connectToWiFi(); }
+class SpanTimerType {
+public:
+  explicit SpanTimerType(SpanHistogramType& histogram) : histogram(histogram), startUs(micros()) {}
+  ~SpanTimerType() { this->histogram.record(micros() - this->startUs); }
+
+private:
+  SpanHistogramType& histogram;
+  uint32_t startUs;
+};
+
+// the stages we time, in the order they are reported
+#define INSTRUMENT_STAGE_COUNT  5
+struct InstrumentationType {
+  SpanHistogramType loop;       // one pass of loop(), start to start, so this is the loop jitter too
+  SpanHistogramType wifi;       // connectToWiFi()
+  SpanHistogramType mqtt;       // ha.mqtt.loop()
+  SpanHistogramType publish;    // filters, windows and entity updates for one reading off the bus
+  SpanHistogramType modbus;     // request to end of response for one register block
+
+  unsigned long lastLoopUs = 0;
+  uint32_t minFreeHeap = 0xFFFFFFFF;
+
+  SpanHistogramType& stage(uint8_t index) {
+    SpanHistogramType* stages[INSTRUMENT_STAGE_COUNT] = { &this->loop, &this->wifi, &this->mqtt, &this->publish, &this->modbus };
+    return *stages[index];
+  }
+} instrumentation;
+
+constexpr const char* instrumentStageKeys[INSTRUMENT_STAGE_COUNT]  = { "loop", "wifi", "mqtt", "publish", "modbus" };
+constexpr const char* instrumentStageNames[INSTRUMENT_STAGE_COUNT] = { "Loop Time", "WiFi Check", "MQTT Loop", "Publish Path", "Modbus Block" };
+
+#ifdef ARDUINO_ARCH_SAMD
+extern "C" char* sbrk(int increment);
+#endif
+
+// bytes left on the heap, and the least there has been since boot
+uint32_t freeHeapBytes() {
+#ifdef ARDUINO_ARCH_ESP32
+  return ESP.getFreeHeap();
+#else
+  char top;
+  return &top - sbrk(0);    // the gap between the top of the heap and the stack
+#endif
+}
+
+uint32_t minFreeHeapBytes() {
+#ifdef ARDUINO_ARCH_ESP32
+  return ESP.getMinFreeHeap();
+#else
+  return instrumentation.minFreeHeap;   // only as good as how often instrumentLoop() samples it
+#endif
+}
+
+// call at the top of loop(), times the previous pass
+void instrumentLoop() {
+  unsigned long now = micros();
+  if (instrumentation.lastLoopUs != 0) {
+    instrumentation.loop.record(now - instrumentation.lastLoopUs);
+  }
+  instrumentation.lastLoopUs = now;
+#ifndef ARDUINO_ARCH_ESP32
+  uint32_t heap = freeHeapBytes();
+  if (heap < instrumentation.minFreeHeap) {
+    instrumentation.minFreeHeap = heap;
+  }
+#endif
+}
@@ -1,9 +1,24 @@
-// ----[LOGGING AND DEBUG MODULE]----- 
+// ----[LOGGING AND DEBUG MODULE]-----
 // set of standard routines for logging and debugging
 // Variadic macros used for debugging to print information in de-bugging mode from LarryD, Arduino forum
+//
+// log messages are printf style and leveled, e.g. LOG_STATUS("Read %d registers in %lums", count, ms).
+// Anything below LOG_LEVEL is compiled out completely, arguments and all, so a detailed message
+// on the hot path costs nothing in a quiet build.  Messages that are kept are formatted into a
+// fixed buffer on the stack, there are no String or heap allocations.  Note that %f is not
+// supported by printf on every board, use dtostrf into a buffer for floats.
+//
+// the LED blinks for status and errors without holding anything up, the pattern is started by
+// the log call and played out by loopLED() from loop()
 
 #pragma once
 
+#include <Arduino.h>
+#include <stdarg.h>
+#if defined(ARDUINO_ARCH_ESP32) && defined(ARDUINO_USB_CDC_ON_BOOT) && ARDUINO_USB_CDC_ON_BOOT && !ARDUINO_USB_MODE
+  #include "tusb.h"     // tud_mounted()
+#endif
+
 // un-comment this line to print the debugging statements
 #define DEBUG
 // uncomment this line to use the internal LED for debugging
@@ -18,6 +33,71 @@
   #define DPRINTLN(...)
 #endif
 
+// log levels, messages above LOG_LEVEL are compiled out
+#define LOG_LEVEL_NONE    0
+#define LOG_LEVEL_ERROR   1     // something went wrong
+#define LOG_LEVEL_STATUS  2     // progress and state changes
+#define LOG_LEVEL_TEXT    3     // detail, e.g. every modbus read
+
+// set LOG_LEVEL before this file is included to override it, otherwise everything is logged
+// in DEBUG builds and nothing without
+#ifndef LOG_LEVEL
+  #ifdef DEBUG
+    #define LOG_LEVEL     LOG_LEVEL_TEXT
+  #else
+    #define LOG_LEVEL     LOG_LEVEL_NONE
+  #endif
+#endif
+
+#define LOG_BUFFER_SIZE   192   // longest log line, anything longer is cut short
+
+// ----[non-blocking LED signalling]-----
+struct LedSignalType {
+  uint8_t phases = 0;             // on/off phases left to play out of the current pattern
+  unsigned long phaseMs = 0;      // length of each phase
+  unsigned long nextPhaseAt = 0;  // millis() when the next phase starts
+  bool restState = false;         // what the LED shows when no pattern is playing
+} ledSignal;
+
+void writeLED(bool on) {
+#ifdef DEBUG_LED
+  digitalWrite(LED_BUILTIN, on ? HIGH : LOW);
+#endif
+}
+
+// set what the LED shows between patterns, and stop any pattern that is playing
+void setLED(bool on) {
+  ledSignal.restState = on;
+  ledSignal.phases = 0;
+  writeLED(on);
+}
+
+// start blinking the LED, a longer blink (an error) takes over from a shorter one that is playing
+void signalLED(unsigned long duration, uint8_t numberOfTimes = 1) {
+#ifdef DEBUG_LED
+  if ((ledSignal.phases > 0) && (duration < ledSignal.phaseMs)) {
+    return;
+  }
+  ledSignal.phases = 2 * numberOfTimes;
+  ledSignal.phaseMs = duration;
+  ledSignal.nextPhaseAt = millis();
+#endif
+}
+
+// play out the LED pattern, call this on every pass of loop()
+void loopLED() {
+#ifdef DEBUG_LED
+  if ((ledSignal.phases == 0) || ((long)(millis() - ledSignal.nextPhaseAt) < 0)) {
+    return;
+  }
+  ledSignal.phases--;
+  // the phases alternate away from and back to the rest state, ending on it
+  writeLED((ledSignal.phases % 2 == 1) ? !ledSignal.restState : ledSignal.restState);
+  ledSignal.nextPhaseAt += ledSignal.phaseMs;
+#endif
+}
+
+// blocking blink, only for when nothing else is going to run again
 void blinkLED(int duration, int numberOfTimes = 1) {
 #ifdef DEBUG_LED
   bool state = (digitalRead(LED_BUILTIN) == HIGH);
@@ -30,16 +110,38 @@ void blinkLED(int duration, int numberOfTimes = 1) {
 #endif
 }
 
+#define USB_HOST_DETECT_MS    500     // a USB host has enumerated us by now if there is one
+#define SERIAL_MONITOR_WAIT_MS  5000  // how long to wait for the serial monitor to be opened on it
+
+// is there a USB host on the other end of the cable, rather than just a power supply
+bool usbHostPresent() {
+#if defined(ARDUINO_ARCH_SAMD)
+  return USBDevice.connected();       // frames are arriving from a host
+#elif defined(ARDUINO_ARCH_ESP32) && defined(ARDUINO_USB_MODE) && ARDUINO_USB_MODE
+  return Serial.isPlugged();          // hardware USB CDC
+#elif defined(ARDUINO_ARCH_ESP32) && defined(ARDUINO_USB_CDC_ON_BOOT) && ARDUINO_USB_CDC_ON_BOOT
+  return tud_mounted();               // TinyUSB CDC, e.g. the Nano ESP32
+#else
+  return true;                        // can't tell, so wait for the monitor as if there was one
+#endif
+}
+
 void setupLog() {
 #ifdef DEBUG_LED
   pinMode(LED_BUILTIN, OUTPUT);
 #endif
-  Serial.begin(115200); 
-  // Add a timeout to prevent infinite loop when no serial monitor is connected
+  Serial.begin(115200);
+  // with no USB host there is nothing to open a serial monitor, so there is no point waiting for
+  // one (this is what makes a boot after a power cut quick).  Otherwise add a timeout to prevent 
+  // an infinite loop when no serial monitor is connected
   unsigned long startTime = millis();
-  const unsigned long timeout = 5000; // 5 seconds timeout
-  while (!Serial && (millis() - startTime < timeout)) {
-    ; // Wait for serial port to connect, but with a timeout
+  while (!usbHostPresent() && (millis() - startTime < USB_HOST_DETECT_MS)) {
+    ; // give the host a moment to enumerate us
+  }
+  if (usbHostPresent()) {
+    while (!Serial && (millis() - startTime < SERIAL_MONITOR_WAIT_MS)) {
+      ; // Wait for serial port to connect, but with a timeout
+    }
   }
   if (Serial) {
     DPRINTLN("\nSerial port connected.");
@@ -48,37 +150,74 @@ void setupLog() {
   }
 }
 
-void logText(String msg) { 
-  DPRINTLN(msg); 
+// ----[log messages]-----
+// format a message into the stack buffer and print it with a prefix, use the LOG_ macros rather
+// than calling this so the message can be compiled out
+void logFormatted(const char* prefix, const char* format, va_list args) {
+  char line[LOG_BUFFER_SIZE];
+  vsnprintf(line, sizeof(line), format, args);
+  Serial.print(prefix);
+  Serial.println(line);
 }
 
-void logStatus(String msg) {
-  logText(msg);
-  blinkLED(50);
+void logMessage(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void logMessage(uint8_t level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logFormatted((level == LOG_LEVEL_ERROR) ? "Error: " : "", format, args);
+  va_end(args);
+#ifdef DEBUG_LED
+  if (level == LOG_LEVEL_ERROR) {
+    signalLED(100, 3);
+  } else if (level == LOG_LEVEL_STATUS) {
+    signalLED(50);
+  }
+#endif
 }
 
-void logError(String msg) {
-  logText("Error: " + msg);
-  blinkLED(100, 3);
-}
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+  #define LOG_ERROR(...)    logMessage(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+  #define LOG_ERROR(...)    do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_STATUS
+  #define LOG_STATUS(...)   logMessage(LOG_LEVEL_STATUS, __VA_ARGS__)
+#else
+  #define LOG_STATUS(...)   do {} while (0)
+#endif
 
-void logSuspend(String msg) {
-  logText("Execution suspended: " + msg);
+#if LOG_LEVEL >= LOG_LEVEL_TEXT
+  #define LOG_TEXT(...)     logMessage(LOG_LEVEL_TEXT, __VA_ARGS__)
+#else
+  #define LOG_TEXT(...)     do {} while (0)
+#endif
+
+// stop here for good, always printed whatever the log level
+void logSuspend(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void logSuspend(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logFormatted("Execution suspended: ", format, args);
+  va_end(args);
   while (true) {
     // Stop execution.
 #ifdef DEBUG_LED
     blinkLED(1000);
+#else
+    delay(1000);
 #endif
   }
 }
 
 void logByteArrayAsHex(const byte* byteArray, size_t len) {
-  for (size_t i = 0; i < len; ++i) {
-    DPRINT(byteArray[i] >> 4, HEX); // Print high nibble
-    DPRINT(byteArray[i] & 0xF, HEX); // Print low nibble
-    if (i < len - 1) {
-      DPRINT(" "); // Add space between bytes
-    }
+#if LOG_LEVEL >= LOG_LEVEL_STATUS
+  char line[LOG_BUFFER_SIZE];
+  size_t used = 0;
+  for (size_t i = 0; (i < len) && (used + 4 <= sizeof(line)); ++i) {
+    used += snprintf(&line[used], sizeof(line) - used, (i < len - 1) ? "%02X " : "%02X", byteArray[i]);   // space between bytes
   }
-  DPRINTLN();
+  line[used] = '\0';
+  Serial.println(line);
+#endif
 }
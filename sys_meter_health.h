@@ -0,0 +1,70 @@
+// ----[METER HEALTH MODULE]-----
+// tracks how well each meter on the bus is answering, and backs off meters that keep failing
+//
+// a meter that does not answer costs a full timeout on the bus for every request, so after a
+// failure the meter is left alone for a while before it is tried again, doubling the wait on
+// each further failure up to a ceiling.  After a few failures in a row the meter is treated as
+// unavailable (the circuit is open) until it answers again.
+
+#pragma once
+
+#include <Arduino.h>
+
+#define METER_BACKOFF_BASE_MS         2000      // wait after the first failure
+#define METER_BACKOFF_MAX_MS          300000    // longest wait between retries (5 minutes)
+#define METER_UNAVAILABLE_FAILURES    3         // failures in a row before the meter is marked unavailable
+#define METER_LATENCY_SMOOTHING       8         // response latency is averaged over roughly this many reads
+
+struct MeterHealthType {
+  uint16_t consecutiveFailures = 0;     // failed cycles since the last good read
+  uint32_t totalFailures = 0;           // failed cycles since boot
+  uint32_t timeouts = 0;                // requests since boot that got no complete response
+  uint32_t crcErrors = 0;               // responses since boot that failed the CRC check
+  uint32_t badResponses = 0;            // any other failed response since boot (exceptions, wrong id...)
+  unsigned long lastSuccessMs = 0;      // millis() of the last good read
+  unsigned long nextAttemptMs = 0;      // millis() when a failing meter may be tried again
+  unsigned long averageLatencyMs = 0;   // smoothed time from request to complete response
+  bool available = true;                // false once the meter has failed METER_UNAVAILABLE_FAILURES times in a row
+
+  // is the meter due to be read (always, unless it is backing off)
+  bool shouldPoll(unsigned long now) const {
+    return (this->consecutiveFailures == 0) || ((long)(now - this->nextAttemptMs) >= 0);
+  }
+
+  // a response came back, returns true if this brings the meter back from being unavailable
+  bool recordSuccess(unsigned long now, unsigned long latencyMs) {
+    bool recovered = !this->available;
+    if (this->lastSuccessMs == 0) {
+      this->averageLatencyMs = latencyMs;
+    } else {
+      this->averageLatencyMs = (this->averageLatencyMs * (METER_LATENCY_SMOOTHING - 1) + latencyMs) / METER_LATENCY_SMOOTHING;
+    }
+    this->lastSuccessMs = now;
+    this->consecutiveFailures = 0;
+    this->available = true;
+    return recovered;
+  }
+
+  // no good response this cycle, returns true if this is the failure that makes the meter unavailable
+  bool recordFailure(unsigned long now) {
+    this->totalFailures++;
+    if (this->consecutiveFailures < 0xFFFF) {
+      this->consecutiveFailures++;
+    }
+
+    unsigned long backoff = METER_BACKOFF_BASE_MS;
+    for (uint16_t i = 1; (i < this->consecutiveFailures) && (backoff < METER_BACKOFF_MAX_MS); i++) {
+      backoff *= 2;
+    }
+    if (backoff > METER_BACKOFF_MAX_MS) {
+      backoff = METER_BACKOFF_MAX_MS;
+    }
+    this->nextAttemptMs = now + backoff;
+
+    if (this->available && (this->consecutiveFailures >= METER_UNAVAILABLE_FAILURES)) {
+      this->available = false;
+      return true;
+    }
+    return false;
+  }
+};
@@ -0,0 +1,259 @@
+// ----[ASYNCHRONOUS MODBUS RTU CLIENT]-----
+// a non-blocking modbus RTU master that runs as a state machine polled from loop()
+//
+// ModbusRTUClient.requestFrom() holds the whole sketch for the response time, and for the full
+// timeout when a meter does not answer.  This client sends the request frame and returns, then
+// each call to poll() picks up whatever bytes have arrived.  The transaction completes through
+// its callback when a full response frame is in, or when its deadline expires, so a dead meter
+// only ever costs bus time and never stalls MQTT or the rest of the loop.
+//
+// transactions are queued and run one at a time, in order, as the bus is half duplex.
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoRS485.h>
+#include "sys_logStatus.h"
+
+#define MODBUS_QUEUE_SIZE           8       // transactions that can be waiting for the bus
+#define MODBUS_MAX_FRAME_BYTES      256     // largest RTU frame allowed by the spec
+#define MODBUS_READ_HOLDING_REGISTERS 0x03  // function code for reading holding registers
+#define MODBUS_READ_INPUT_REGISTERS 0x04    // function code for reading input registers
+#define MODBUS_EXCEPTION_FLAG       0x80    // set on the function code of an exception response
+
+enum ModbusResultType : uint8_t {
+  MODBUS_OK,            // response received and checked
+  MODBUS_TIMEOUT,       // no complete response before the deadline
+  MODBUS_CRC_ERROR,     // response failed the CRC check
+  MODBUS_BAD_FRAME,     // response from the wrong slave or function, or the wrong length
+  MODBUS_EXCEPTION,     // slave returned an exception code
+  MODBUS_CANCELLED      // dropped from the queue before it was sent
+};
+
+struct ModbusTransactionType;
+typedef void (*ModbusCallbackType)(ModbusTransactionType& transaction);
+
+struct ModbusTransactionType {
+  uint8_t id = 0;                         // slave id
+  uint8_t function = MODBUS_READ_INPUT_REGISTERS;
+  uint16_t startRegister = 0;             // first register, 1 based as in the meter spec
+  uint8_t count = 0;                      // number of registers
+  unsigned long timeoutMs = 0;            // deadline from the time the request is sent (0 = client default)
+  ModbusCallbackType onComplete = nullptr;
+  void* context = nullptr;                // passed through untouched for the callback
+
+  // filled in on completion
+  ModbusResultType result = MODBUS_OK;
+  uint8_t exceptionCode = 0;
+  unsigned long latencyMs = 0;            // time from sending the request to the end of the response
+  const uint8_t* data = nullptr;          // register data, high byte first, only valid during the callback
+};
+
+// standard modbus CRC-16 (polynomial 0xA001, reflected), sent low byte first
+uint16_t modbusCRC16(const uint8_t* data, size_t length, uint16_t crc = 0xFFFF) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc & 0x0001) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+// RTU frames are delimited by 3.5 characters of silence, fixed at 1750us above 19200 baud
+unsigned long modbusFrameGapUs(unsigned long baud, uint8_t bitsPerChar = 10) {
+  if (baud > 19200) {
+    return 1750;
+  }
+  return (35UL * bitsPerChar * 1000000UL / baud + 9) / 10;
+}
+
+const char* modbusResultText(ModbusResultType result) {
+  switch (result) {
+    case MODBUS_OK:         return "OK";
+    case MODBUS_TIMEOUT:    return "Response timed out";
+    case MODBUS_CRC_ERROR:  return "CRC check failed";
+    case MODBUS_BAD_FRAME:  return "Invalid response frame";
+    case MODBUS_EXCEPTION:  return "Exception response";
+    case MODBUS_CANCELLED:  return "Cancelled";
+  }
+  return "Unknown";
+}
+
+class ModbusAsyncClientType {
+public:
+  ModbusAsyncClientType(RS485Class& rs485) : bus(rs485) {}
+
+  // the serial port must already have been started at the same baud rate and framing.  The frame
+  // gap is worked out from the baud rate unless frameGapUs is given
+  void begin(unsigned long baudRate, unsigned long defaultTimeoutMs, uint8_t bitsPerChar = 10, unsigned long frameGapUs = 0) {
+    this->baud = baudRate;
+    this->timeoutMs = defaultTimeoutMs;
+    this->gapUs = frameGapUs ? frameGapUs : modbusFrameGapUs(baudRate, bitsPerChar);
+    this->bus.receive();
+  }
+
+  // queue a read, returns false when the queue is full
+  bool enqueue(const ModbusTransactionType& transaction) {
+    if (this->queued >= MODBUS_QUEUE_SIZE) {
+      return false;
+    }
+    this->queue[(this->head + this->queued) % MODBUS_QUEUE_SIZE] = transaction;
+    this->queued++;
+    return true;
+  }
+
+  // free slots in the queue
+  uint8_t available() const {
+    return MODBUS_QUEUE_SIZE - this->queued;
+  }
+
+  // nothing waiting and nothing in flight
+  bool isIdle() const {
+    return (this->queued == 0) && (this->state == STATE_IDLE);
+  }
+
+  // drop every queued (not yet sent) transaction for a slave, each one completes as cancelled
+  void cancel(uint8_t id) {
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < this->queued; i++) {
+      ModbusTransactionType& transaction = this->queue[(this->head + i) % MODBUS_QUEUE_SIZE];
+      // the transaction at the head is the one on the wire while we are busy, leave it alone
+      if ((transaction.id == id) && !((i == 0) && (this->state != STATE_IDLE))) {
+        transaction.result = MODBUS_CANCELLED;
+        transaction.data = nullptr;
+        if (transaction.onComplete) {
+          transaction.onComplete(transaction);
+        }
+      } else {
+        this->queue[(this->head + kept) % MODBUS_QUEUE_SIZE] = transaction;
+        kept++;
+      }
+    }
+    this->queued = kept;
+  }
+
+  // drive the state machine, call this as often as possible from loop()
+  void poll() {
+    switch (this->state) {
+      case STATE_IDLE:
+        if ((this->queued > 0) && (micros() - this->lastFrameUs >= this->gapUs)) {
+          sendRequest(this->queue[this->head]);
+        }
+        break;
+
+      case STATE_WAITING:
+        receiveResponse(this->queue[this->head]);
+        break;
+    }
+  }
+
+private:
+  enum StateType : uint8_t { STATE_IDLE, STATE_WAITING };
+
+  RS485Class& bus;
+  unsigned long baud = 9600;
+  unsigned long timeoutMs = 1000;
+  unsigned long gapUs = 4010;
+
+  ModbusTransactionType queue[MODBUS_QUEUE_SIZE];
+  uint8_t head = 0;                 // index of the oldest transaction (the one on the wire when waiting)
+  uint8_t queued = 0;
+
+  StateType state = STATE_IDLE;
+  uint8_t frame[MODBUS_MAX_FRAME_BYTES];
+  uint16_t frameLength = 0;         // bytes received so far
+  uint16_t expectedLength = 0;      // full length of a normal response
+  unsigned long sentAtMs = 0;
+  unsigned long lastByteUs = 0;
+  unsigned long lastFrameUs = 0;    // end of the last frame on the bus, to honour the inter-frame gap
+
+  void sendRequest(ModbusTransactionType& transaction) {
+    uint8_t request[8];
+    uint16_t address = transaction.startRegister - 1;   // modbus addresses are 0 based
+    request[0] = transaction.id;
+    request[1] = transaction.function;
+    request[2] = address >> 8;
+    request[3] = address & 0xFF;
+    request[4] = 0;
+    request[5] = transaction.count;
+    uint16_t crc = modbusCRC16(request, 6);
+    request[6] = crc & 0xFF;
+    request[7] = crc >> 8;
+
+    // throw away any stray bytes left on the line
+    while (this->bus.available()) {
+      this->bus.read();
+    }
+
+    this->bus.noReceive();
+    this->bus.beginTransmission();
+    this->bus.write(request, sizeof(request));
+    this->bus.endTransmission();    // returns once the frame has left the UART
+    this->bus.receive();
+
+    this->frameLength = 0;
+    this->expectedLength = 5 + 2 * transaction.count;   // id + function + byte count + data + crc
+    this->sentAtMs = millis();
+    this->lastByteUs = micros();
+    this->state = STATE_WAITING;
+  }
+
+  void receiveResponse(ModbusTransactionType& transaction) {
+    while (this->bus.available() && (this->frameLength < MODBUS_MAX_FRAME_BYTES)) {
+      this->frame[this->frameLength++] = this->bus.read();
+      this->lastByteUs = micros();
+    }
+
+    bool isException = (this->frameLength >= 2) && (this->frame[1] & MODBUS_EXCEPTION_FLAG);
+    if ((this->frameLength >= this->expectedLength) || (isException && (this->frameLength >= 5))) {
+      finish(transaction, checkResponse(transaction));
+    } else if ((this->frameLength > 0) && (micros() - this->lastByteUs > this->gapUs)) {
+      // the line went quiet part way through, so this is all we are getting
+      finish(transaction, checkResponse(transaction));
+    } else if (millis() - this->sentAtMs >= (transaction.timeoutMs ? transaction.timeoutMs : this->timeoutMs)) {
+      finish(transaction, MODBUS_TIMEOUT);
+    }
+  }
+
+  ModbusResultType checkResponse(ModbusTransactionType& transaction) {
+    if (this->frameLength < 5) {
+      return MODBUS_BAD_FRAME;
+    }
+    uint16_t crc = modbusCRC16(this->frame, this->frameLength - 2);
+    if ((this->frame[this->frameLength - 2] != (crc & 0xFF)) || (this->frame[this->frameLength - 1] != (crc >> 8))) {
+      return MODBUS_CRC_ERROR;
+    }
+    if ((this->frame[0] != transaction.id) || ((this->frame[1] & ~MODBUS_EXCEPTION_FLAG) != transaction.function)) {
+      return MODBUS_BAD_FRAME;
+    }
+    if (this->frame[1] & MODBUS_EXCEPTION_FLAG) {
+      transaction.exceptionCode = this->frame[2];
+      return MODBUS_EXCEPTION;
+    }
+    if ((this->frameLength != this->expectedLength) || (this->frame[2] != 2 * transaction.count)) {
+      return MODBUS_BAD_FRAME;
+    }
+    transaction.data = &this->frame[3];
+    return MODBUS_OK;
+  }
+
+  void finish(ModbusTransactionType& transaction, ModbusResultType result) {
+    transaction.result = result;
+    transaction.latencyMs = millis() - this->sentAtMs;
+    if (result != MODBUS_OK) {
+      transaction.data = nullptr;
+    }
+
+    // take it off the queue before the callback, so the callback is free to queue more work
+    ModbusTransactionType completed = transaction;
+    this->head = (this->head + 1) % MODBUS_QUEUE_SIZE;
+    this->queued--;
+    this->state = STATE_IDLE;
+    this->lastFrameUs = micros();
+
+    if (completed.onComplete) {
+      completed.onComplete(completed);
+    }
+  }
+};
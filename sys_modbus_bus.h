@@ -0,0 +1,104 @@
+// ----[MODBUS BUS MODULE]-----
+// one RS485 port with the meters on it: the UART and its pins, the transceiver, and the client
+// (or in listen mode the sniffer) with its own transaction queue and line settings
+//
+// RS485 is half duplex, so on one port the meters are read one after the other and a cycle gets
+// longer with every meter added.  With the meters split over several ports, each port runs its
+// own cycle over its own meters at the same time as the others, so the cycle time goes with the
+// meters on the busiest port rather than with all of them.  Everything here is non-blocking, so
+// the ports are simply polled in turn from the same loop (or from the modbus task).
+//
+// a bus knows nothing about the meters, see the bus cycles in sensor_eastron_smart_meter.h
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoRS485.h>
+#include "sys_modbus_async.h"     // non-blocking modbus RTU client on top of RS485
+#include "sys_modbus_sniffer.h"   // passive listener, for a bus that another master polls
+
+#define MODBUS_SERIAL_BAUD  9600  // Baud rate for esp32 and max485 communication, if the config one can't be used
+#define MODBUS_TIMEOUT_MS   3000  // how long to wait for a meter to answer a request, if the config one can't be used
+
+// the UARTs there are for meter buses.  The ESP32-S3 has three: UART0 is only free when the log
+// goes out over the native USB port, and the smaller ESP32 parts have just two UARTs.  The Nano
+// 33 IoT has the one on Serial1
+#if defined(ARDUINO_ARCH_ESP32) && (SOC_UART_NUM > 2) && defined(ARDUINO_USB_CDC_ON_BOOT) && ARDUINO_USB_CDC_ON_BOOT
+  #define MODBUS_MAX_BUSES  3
+#elif defined(ARDUINO_ARCH_ESP32) && (SOC_UART_NUM > 2)
+  #define MODBUS_MAX_BUSES  2
+#else
+  #define MODBUS_MAX_BUSES  1
+#endif
+
+// the serial line settings for a bus, from the config
+struct ModbusLineSettingsType {
+  unsigned long baud = MODBUS_SERIAL_BAUD;
+  uint32_t serialConfig = SERIAL_8N1;
+  uint8_t bitsPerChar = 10;               // start bit, data bits, parity and stop bits
+  unsigned long timeoutMs = MODBUS_TIMEOUT_MS;
+  unsigned long frameGapUs = 0;           // 0 for the standard 3.5 characters
+};
+
+// the MAX485 wiring for a bus
+struct ModbusBusPinsType {
+  int8_t rx;    // RO
+  int8_t tx;    // DI
+  int8_t de;
+  int8_t re;
+};
+
+class ModbusBusType {
+public:
+  RS485Class rs485;
+  ModbusAsyncClientType client;
+  ModbusSnifferType sniffer;
+  ModbusLineSettingsType settings;
+  bool listening = false;     // listen mode, we never transmit and only pick up other reads
+
+  ModbusBusType(HardwareSerial& uart, const ModbusBusPinsType& wiring) :
+      rs485(uart, wiring.tx, wiring.de, wiring.re),
+      client(rs485),
+      sniffer(rs485),
+      port(uart),
+      pins(wiring) {
+  }
+
+  // the client and the sniffer hold on to the transceiver by reference, so a bus can't be copied
+  ModbusBusType(const ModbusBusType&) = delete;
+  ModbusBusType& operator=(const ModbusBusType&) = delete;
+
+  // (re)start the serial port at the current settings.  RS485.begin() starts the port itself at
+  // 8N1, so the port is started again after it with the framing (and the pins, on the ESP32)
+  void startSerial() {
+    this->rs485.begin(this->settings.baud);
+#ifdef ARDUINO_ARCH_ESP32
+    this->port.begin(this->settings.baud, this->settings.serialConfig, this->pins.rx, this->pins.tx);
+#else
+    this->port.begin(this->settings.baud, (uint16_t)this->settings.serialConfig);
+#endif
+  }
+
+  void startClient() {
+    startSerial();
+    this->client.begin(this->settings.baud, this->settings.timeoutMs, this->settings.bitsPerChar, this->settings.frameGapUs);
+  }
+
+  void startListening(ModbusSniffCallbackType callback) {
+    startSerial();
+    this->sniffer.begin(this->settings.baud, callback, this->settings.bitsPerChar, this->settings.frameGapUs, this);
+  }
+
+  // service whichever side of the bus we are on, call this as often as possible
+  void poll() {
+    if (this->listening) {
+      this->sniffer.poll();
+    } else {
+      this->client.poll();
+    }
+  }
+
+private:
+  HardwareSerial& port;
+  ModbusBusPinsType pins;
+};
@@ -0,0 +1,102 @@
+// ----[MODBUS READ PLANNER]-----
+// works out the cheapest set of modbus read requests that covers a set of enabled registers
+//
+// every request on an RS485 link costs a fixed overhead: the request frame, the response
+// header and CRC, the 3.5 character silent interval either side and the meter turnaround.
+// reading a few unused registers between two wanted ones only costs 2 bytes per register,
+// so it is often cheaper to read through a gap than to start a new request.  The planner
+// weighs the two at the bus's baud rate and framing and picks the cheapest plan, subject to the
+// 125 register per request limit of the modbus spec.
+
+#pragma once
+
+#include "home_assistant.h"
+#include "sensor_eastron_registers.h"
+
+#define MODBUS_MAX_BLOCK_REGISTERS  125     // modbus limit on the number of registers in one read request
+#define MODBUS_BITS_PER_CHAR        10      // 8N1 : start + 8 data + stop bit, 11 with parity or a second stop bit
+#define MODBUS_REQUEST_BYTES        8       // id + function + address (2) + count (2) + crc (2)
+#define MODBUS_RESPONSE_BYTES       5       // id + function + byte count + crc (2), excluding the data
+#define MODBUS_TURNAROUND_US        50000   // typical time for a meter to start answering a request
+
+// one read request: a run of consecutive registers
+struct ModbusReadBlockType {
+  uint16_t startRegister;   // first register, offset from the 30000 base (1 based)
+  uint8_t  count;           // number of registers to read
+};
+
+// the set of requests needed to read a set of fields off a meter
+struct ModbusReadPlanType {
+  MeterFieldMaskType fieldMask = 0;         // the fields this plan was built for
+  uint8_t blockCount = 0;                   // number of requests in the plan
+  ModbusReadBlockType blocks[METER_FIELD_COUNT];
+  unsigned long estimatedUs = 0;            // estimated bus time for the whole plan
+};
+
+// time to send one character on the wire
+unsigned long modbusCharTimeUs(unsigned long baud, uint8_t bitsPerChar = MODBUS_BITS_PER_CHAR) {
+  return (1000000UL * bitsPerChar + baud - 1) / baud;
+}
+
+// fixed cost of one request, regardless of how many registers it reads
+unsigned long modbusRequestOverheadUs(unsigned long baud, uint8_t bitsPerChar = MODBUS_BITS_PER_CHAR, unsigned long turnaroundUs = MODBUS_TURNAROUND_US) {
+  // frames on both sides plus a 3.5 character silent interval after each (rounded up to 4)
+  return (MODBUS_REQUEST_BYTES + MODBUS_RESPONSE_BYTES + 2 * 4) * modbusCharTimeUs(baud, bitsPerChar) + turnaroundUs;
+}
+
+// build the cheapest plan that reads every field in fieldMask
+//
+// fields are taken in register table order, so any plan is a split of that list into runs.
+// with at most 32 fields a straight dynamic programme over the split points is cheap enough
+// to run on every poll cycle.
+void planRegisterReads(MeterFieldMaskType fieldMask, unsigned long baud, ModbusReadPlanType& plan, uint8_t bitsPerChar = MODBUS_BITS_PER_CHAR, unsigned long turnaroundUs = MODBUS_TURNAROUND_US) {
+  uint8_t fields[METER_FIELD_COUNT];          // enabled fields in address order
+  unsigned long cost[METER_FIELD_COUNT + 1];  // cost[i] : cheapest plan for the first i fields
+  uint8_t runStart[METER_FIELD_COUNT + 1];    // runStart[i] : first field of the last request in that plan
+  uint8_t n = 0;
+
+  unsigned long registerUs = 2 * modbusCharTimeUs(baud, bitsPerChar);
+  unsigned long overheadUs = modbusRequestOverheadUs(baud, bitsPerChar, turnaroundUs);
+
+  for (uint8_t i = 0; i < METER_FIELD_COUNT; i++) {
+    if (fieldMask & meterFieldBit(i)) {
+      fields[n++] = i;
+    }
+  }
+
+  cost[0] = 0;
+  for (uint8_t i = 1; i <= n; i++) {
+    const MeterRegisterType& last = meterRegisters[fields[i - 1]];
+    uint16_t endRegister = last.address + last.words - 1;
+    cost[i] = (unsigned long)-1;
+    // try every possible start for the request that ends with field i
+    for (uint8_t j = i; j >= 1; j--) {
+      uint16_t span = endRegister - meterRegisters[fields[j - 1]].address + 1;
+      if (span > MODBUS_MAX_BLOCK_REGISTERS) {
+        break;    // starting any earlier only makes the request longer
+      }
+      unsigned long c = cost[j - 1] + overheadUs + span * registerUs;
+      if (c < cost[i]) {
+        cost[i] = c;
+        runStart[i] = j;
+      }
+    }
+  }
+
+  // walk back through the split points to recover the requests (they come out in reverse)
+  plan.fieldMask = fieldMask;
+  plan.estimatedUs = cost[n];
+  plan.blockCount = 0;
+  for (uint8_t i = n; i > 0; i = runStart[i] - 1) {
+    const MeterRegisterType& first = meterRegisters[fields[runStart[i] - 1]];
+    const MeterRegisterType& last = meterRegisters[fields[i - 1]];
+    plan.blocks[plan.blockCount].startRegister = first.address;
+    plan.blocks[plan.blockCount].count = last.address + last.words - first.address;
+    plan.blockCount++;
+  }
+  for (uint8_t i = 0; i < plan.blockCount / 2; i++) {
+    ModbusReadBlockType swap = plan.blocks[i];
+    plan.blocks[i] = plan.blocks[plan.blockCount - 1 - i];
+    plan.blocks[plan.blockCount - 1 - i] = swap;
+  }
+}
@@ -0,0 +1,189 @@
+// ----[MODBUS RTU SNIFFER]-----
+// passive listener for a bus that already has another master on it (e.g. a solar inverter that
+// polls the meter itself).  A second master would collide with it, so in this mode we never
+// transmit, we just watch the traffic go by and pick the register values out of the responses.
+//
+// RTU has no start or end markers, frames are separated by 3.5 characters of silence.  We can't
+// time every byte from loop(), so the framing goes on the lengths that the headers give instead:
+// a read request is always 8 bytes, its response is 5 plus the byte count, an exception is 5.  A
+// candidate frame is only taken once its CRC checks out, and if nothing fits the first byte is
+// dropped and we try again from the next one, which is how we find the frame boundaries again
+// after noise or after starting up part way through a frame.  A silence longer than the frame gap
+// throws away whatever is left over, that frame is never going to be completed.
+//
+// a response doesn't say which registers it holds, so it is paired up with the request that was
+// seen just before it.  Only a frame with an even byte count, while a request is waiting for its
+// answer, is tried as a response: a request whose start address has 0x03 as its high byte would
+// otherwise pass as a response of its own 8 bytes.  A response to a request we missed is resynced
+// past, and one that doesn't match the request waiting is counted and ignored.
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoRS485.h>
+#include "sys_modbus_async.h"     // CRC, frame gap and the protocol constants
+
+#define SNIFFER_BUFFER_BYTES    (2 * MODBUS_MAX_FRAME_BYTES)    // room for a frame and the start of the next
+
+// a response seen on the bus, with the request it answered
+struct ModbusSniffedReadType {
+  uint8_t id;
+  uint8_t function;
+  uint16_t startRegister;     // 1 based, as in the meter spec
+  uint8_t count;              // registers
+  const uint8_t* data;        // register data, high byte first, only valid during the callback
+  unsigned long latencyMs;    // from the end of the request to the end of the response
+  void* context;              // as given to begin(), e.g. the bus this was heard on
+};
+typedef void (*ModbusSniffCallbackType)(const ModbusSniffedReadType& read);
+
+class ModbusSnifferType {
+public:
+  ModbusSnifferType(RS485Class& rs485) : bus(rs485) {}
+
+  // the serial port must already have been started at the same baud rate and framing
+  void begin(unsigned long baudRate, ModbusSniffCallbackType callback, uint8_t bitsPerChar = 10, unsigned long frameGapUs = 0, void* context = nullptr) {
+    this->gapUs = frameGapUs ? frameGapUs : modbusFrameGapUs(baudRate, bitsPerChar);
+    this->onRead = callback;
+    this->context = context;
+    this->bus.receive();    // and never transmit
+  }
+
+  // pick up whatever has arrived and take any complete frames off it, call this as often as possible
+  void poll() {
+    while (this->bus.available()) {
+      if (this->length >= SNIFFER_BUFFER_BYTES) {
+        dropBytes(1);       // can't be a frame this long, something has gone wrong
+        this->resyncs++;
+      }
+      this->buffer[this->length++] = this->bus.read();
+      this->lastByteUs = micros();
+    }
+
+    while (takeFrame()) {
+    }
+
+    if ((this->length > 0) && (micros() - this->lastByteUs > this->gapUs)) {
+      this->length = 0;     // the line has gone quiet part way through a frame
+      this->resyncs++;
+    }
+  }
+
+  uint32_t frames() const { return this->frameCount; }         // good frames seen
+  uint32_t unmatched() const { return this->unmatchedCount; }  // responses to a request we didn't see
+  uint32_t resyncsSeen() const { return this->resyncs; }       // times the framing was lost and found again
+
+private:
+  RS485Class& bus;
+  unsigned long gapUs = 4010;
+  ModbusSniffCallbackType onRead = nullptr;
+  void* context = nullptr;
+
+  uint8_t buffer[SNIFFER_BUFFER_BYTES];
+  uint16_t length = 0;
+  unsigned long lastByteUs = 0;
+
+  // the last read request seen, waiting for its response
+  struct {
+    bool waiting = false;
+    uint8_t id = 0;
+    uint8_t function = 0;
+    uint16_t startRegister = 0;
+    uint8_t count = 0;
+    unsigned long sentAtMs = 0;
+  } request;
+
+  uint32_t frameCount = 0;
+  uint32_t unmatchedCount = 0;
+  uint32_t resyncs = 0;
+
+  static bool isReadFunction(uint8_t function) {
+    return (function == MODBUS_READ_INPUT_REGISTERS) || (function == MODBUS_READ_HOLDING_REGISTERS);
+  }
+
+  bool crcMatches(uint16_t frameLength) const {
+    uint16_t crc = modbusCRC16(this->buffer, frameLength - 2);
+    return (this->buffer[frameLength - 2] == (crc & 0xFF)) && (this->buffer[frameLength - 1] == (crc >> 8));
+  }
+
+  void dropBytes(uint16_t n) {
+    memmove(this->buffer, this->buffer + n, this->length - n);
+    this->length -= n;
+  }
+
+  // try the frame lengths the header allows, take the first one that checks out.  Returns false
+  // if there is nothing more to take until more bytes arrive
+  bool takeFrame() {
+    if (this->length < 5) {
+      return false;
+    }
+    uint8_t function = this->buffer[1];
+    bool incomplete = false;
+
+    // a response, to the request we are waiting on, comes first as a master doesn't send while
+    // it waits, so this is the likely one.  Register data is always an even number of bytes
+    if (isReadFunction(function) && this->request.waiting && ((this->buffer[2] & 1) == 0)) {
+      uint16_t responseLength = 5 + this->buffer[2];
+      if (this->length < responseLength) {
+        incomplete = true;
+      } else if (crcMatches(responseLength)) {
+        handleResponse();
+        dropBytes(responseLength);
+        return true;
+      }
+    }
+    if (isReadFunction(function)) {
+      if (this->length < 8) {
+        incomplete = true;
+      } else if (crcMatches(8)) {
+        handleRequest();
+        dropBytes(8);
+        return true;
+      }
+    } else if ((function & MODBUS_EXCEPTION_FLAG) && crcMatches(5)) {
+      this->frameCount++;
+      this->request.waiting = false;    // the request has had its answer
+      dropBytes(5);
+      return true;
+    }
+
+    if (incomplete) {
+      return false;     // wait for the rest, or for the line to go quiet
+    }
+    // nothing fits here, so this isn't the start of a frame
+    dropBytes(1);
+    this->resyncs++;
+    return true;
+  }
+
+  void handleRequest() {
+    this->frameCount++;
+    this->request.waiting = (this->buffer[4] == 0) && (this->buffer[5] > 0) && (5 + 2 * this->buffer[5] <= MODBUS_MAX_FRAME_BYTES);
+    this->request.id = this->buffer[0];
+    this->request.function = this->buffer[1];
+    this->request.startRegister = ((this->buffer[2] << 8) | this->buffer[3]) + 1;    // modbus addresses are 0 based
+    this->request.count = this->buffer[5];
+    this->request.sentAtMs = millis();
+  }
+
+  void handleResponse() {
+    this->frameCount++;
+    if (!this->request.waiting || (this->buffer[0] != this->request.id) || (this->buffer[1] != this->request.function)
+        || (this->buffer[2] != 2 * this->request.count)) {
+      this->unmatchedCount++;
+      return;
+    }
+    this->request.waiting = false;
+    if (this->onRead) {
+      ModbusSniffedReadType read;
+      read.id = this->request.id;
+      read.function = this->request.function;
+      read.startRegister = this->request.startRegister;
+      read.count = this->request.count;
+      read.data = &this->buffer[3];
+      read.latencyMs = millis() - this->request.sentAtMs;
+      read.context = this->context;
+      this->onRead(read);
+    }
+  }
+};
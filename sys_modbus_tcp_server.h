@@ -0,0 +1,230 @@
+// ----[MODBUS TCP SERVER MODULE]-----
+// a small non-blocking Modbus TCP server, for other systems on the network to read from
+//
+// each request is a 7 byte MBAP header (transaction id, protocol id 0, length, unit id) and a
+// PDU, the answer goes back with the same header.  Only input register reads are taken, and what
+// goes in the answer comes from a callback, so the server knows nothing about where the registers
+// come from.  Everything is done from poll(), a few bytes at a time as they arrive, so a slow or
+// stuck client never holds up the loop.
+//
+// a client that goes quiet is dropped after a while, so a peer that vanished without closing
+// (e.g. it lost power) doesn't keep its slot for ever
+//
+// the listener is started whenever the wifi comes (back) up.  A dropped link can take the
+// listening socket with it, on the Nano 33 IoT the reconnect resets the NINA module and every
+// socket on it, so it is opened again rather than left dead until a reboot.  The link is only
+// checked every so often, on the NINA each WiFi.status() is a round trip over SPI
+
+#pragma once
+
+#include <Arduino.h>
+#ifdef ARDUINO_ARCH_SAMD
+  #include <WiFiNINA.h>
+#endif
+#ifdef ARDUINO_ARCH_ESP32
+  #include <WiFi.h>
+#endif
+#include "sys_logStatus.h"
+#include "sys_modbus_async.h"     // the protocol constants
+
+#define MODBUS_TCP_PORT             502     // the standard port, if the config one can't be used
+#define MODBUS_TCP_MAX_CLIENTS      4       // connections served at once, a new one is turned away after that
+#define MODBUS_TCP_IDLE_TIMEOUT_MS  60000   // a client that hasn't sent anything for this long is dropped
+#define MODBUS_TCP_MBAP_BYTES       7
+#define MODBUS_TCP_MAX_ADU_BYTES    260     // MBAP header and the largest PDU
+#define MODBUS_TCP_MAX_READ         125     // registers in one read, from the spec
+#define MODBUS_TCP_LINK_CHECK_MS    1000    // how often the wifi is checked for coming up or going down
+
+// exception codes, from the spec
+#define MODBUS_EXCEPTION_ILLEGAL_FUNCTION   0x01
+#define MODBUS_EXCEPTION_ILLEGAL_ADDRESS    0x02
+#define MODBUS_EXCEPTION_ILLEGAL_VALUE      0x03
+#define MODBUS_EXCEPTION_GATEWAY_PATH       0x0A    // no such unit behind the gateway
+#define MODBUS_EXCEPTION_GATEWAY_TARGET     0x0B    // the unit isn't answering (or, for us, what we hold is too old)
+
+// fill data (high byte first) with count input registers from startRegister (1 based, as in the
+// meter spec) on a unit, and return 0, or an exception code to send back instead
+typedef uint8_t (*ModbusTcpReadCallbackType)(uint8_t unitID, uint16_t startRegister, uint16_t count, uint8_t* data);
+
+class ModbusTcpServerType {
+public:
+  ModbusTcpServerType() : server(MODBUS_TCP_PORT) {}
+
+  // the server is only started once the network is up, see poll().  Making the WiFiServer opens
+  // nothing, so a device with the gateway off has no listener at all
+  void begin(uint16_t port, ModbusTcpReadCallbackType callback) {
+    this->port = port;
+    this->server = WiFiServer(port);
+    this->onRead = callback;
+  }
+
+  bool enabled() const { return this->onRead != nullptr; }
+
+  // accept new clients and answer whatever has arrived, call this as often as possible
+  void poll() {
+    if (!enabled()) {
+      return;
+    }
+    if (millis() - this->lastLinkCheckMs >= MODBUS_TCP_LINK_CHECK_MS) {
+      this->lastLinkCheckMs = millis();
+      checkLink(WiFi.status() == WL_CONNECTED);
+    }
+    if (!this->linkUp) {
+      return;
+    }
+
+    WiFiClient incoming = this->server.accept();
+    if (incoming) {
+      acceptClient(incoming);
+    }
+    for (uint8_t i = 0; i < MODBUS_TCP_MAX_CLIENTS; i++) {
+      serviceClient(this->clients[i]);
+    }
+  }
+
+  uint32_t requests() const { return this->requestCount; }       // requests answered
+  uint32_t exceptions() const { return this->exceptionCount; }   // of those, answered with an exception
+  uint8_t connections() const {
+    uint8_t n = 0;
+    for (const ModbusTcpClientType& client : this->clients) {
+      n += client.open ? 1 : 0;
+    }
+    return n;
+  }
+
+private:
+  struct ModbusTcpClientType {
+    WiFiClient socket;
+    bool open = false;
+    uint8_t buffer[MODBUS_TCP_MAX_ADU_BYTES];
+    uint16_t length = 0;
+    unsigned long lastHeardMs = 0;
+  };
+
+  uint16_t port = MODBUS_TCP_PORT;
+  ModbusTcpReadCallbackType onRead = nullptr;
+  WiFiServer server;
+  bool linkUp = false;                  // the wifi was up at the last check, and the server listening
+  unsigned long lastLinkCheckMs = 0;
+  ModbusTcpClientType clients[MODBUS_TCP_MAX_CLIENTS];
+  uint32_t requestCount = 0;
+  uint32_t exceptionCount = 0;
+
+  // (re)start listening when the link comes up, and let go of the clients when it goes down
+  void checkLink(bool connected) {
+    if (connected == this->linkUp) {
+      return;
+    }
+    this->linkUp = connected;
+    if (connected) {
+      this->server.begin();
+      LOG_STATUS("Modbus TCP gateway listening on port %u", this->port);
+      return;
+    }
+    for (ModbusTcpClientType& client : this->clients) {
+      if (client.open) {
+        closeClient(client);
+      }
+    }
+#ifdef ARDUINO_ARCH_ESP32
+    this->server.end();     // the ESP32 won't begin() a server it thinks is still listening
+#endif
+    LOG_STATUS("Modbus TCP gateway stopped, the network is down");
+  }
+
+  void acceptClient(WiFiClient& incoming) {
+    for (ModbusTcpClientType& client : this->clients) {
+      if (!client.open) {
+        client.socket = incoming;
+        client.open = true;
+        client.length = 0;
+        client.lastHeardMs = millis();
+        LOG_TEXT("Modbus TCP client connected, %d of %d", connections(), MODBUS_TCP_MAX_CLIENTS);
+        return;
+      }
+    }
+    LOG_ERROR("Modbus TCP gateway has no room for another client, %d already connected", MODBUS_TCP_MAX_CLIENTS);
+    incoming.stop();
+  }
+
+  void closeClient(ModbusTcpClientType& client) {
+    client.socket.stop();
+    client.open = false;
+    client.length = 0;
+  }
+
+  void serviceClient(ModbusTcpClientType& client) {
+    if (!client.open) {
+      return;
+    }
+    if (!client.socket.connected() || (millis() - client.lastHeardMs > MODBUS_TCP_IDLE_TIMEOUT_MS)) {
+      closeClient(client);
+      return;
+    }
+
+    while (client.socket.available() && (client.length < MODBUS_TCP_MAX_ADU_BYTES)) {
+      client.buffer[client.length++] = client.socket.read();
+      client.lastHeardMs = millis();
+    }
+
+    // answer every complete request in the buffer, clients are allowed to send several at once
+    while (client.length >= MODBUS_TCP_MBAP_BYTES) {
+      uint16_t protocol = (client.buffer[2] << 8) | client.buffer[3];
+      uint16_t length = (client.buffer[4] << 8) | client.buffer[5];    // unit id and the PDU
+      if ((protocol != 0) || (length < 2) || (MODBUS_TCP_MBAP_BYTES - 1 + length > MODBUS_TCP_MAX_ADU_BYTES)) {
+        LOG_ERROR("Bad Modbus TCP frame, dropping the client");
+        closeClient(client);
+        return;
+      }
+      uint16_t frameBytes = MODBUS_TCP_MBAP_BYTES - 1 + length;
+      if (client.length < frameBytes) {
+        return;   // the rest is still on its way
+      }
+      answerRequest(client, client.buffer, frameBytes);
+      memmove(client.buffer, client.buffer + frameBytes, client.length - frameBytes);
+      client.length -= frameBytes;
+    }
+  }
+
+  void answerRequest(ModbusTcpClientType& client, const uint8_t* request, uint16_t requestBytes) {
+    uint8_t response[MODBUS_TCP_MAX_ADU_BYTES];
+    memcpy(response, request, MODBUS_TCP_MBAP_BYTES);      // same transaction, protocol and unit
+    uint8_t unitID = request[6];
+    uint8_t function = request[7];
+    uint16_t pduBytes = 0;
+
+    uint8_t exception = 0;
+    if (function != MODBUS_READ_INPUT_REGISTERS) {
+      exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    } else if (requestBytes != MODBUS_TCP_MBAP_BYTES + 5) {
+      exception = MODBUS_EXCEPTION_ILLEGAL_VALUE;
+    } else {
+      uint16_t address = (request[8] << 8) | request[9];     // modbus addresses are 0 based
+      uint16_t count = (request[10] << 8) | request[11];
+      if ((count == 0) || (count > MODBUS_TCP_MAX_READ)) {
+        exception = MODBUS_EXCEPTION_ILLEGAL_VALUE;
+      } else if ((uint32_t)address + count > 0x10000UL) {
+        exception = MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+      } else {
+        exception = this->onRead(unitID, address + 1, count, &response[MODBUS_TCP_MBAP_BYTES + 2]);
+      }
+      if (exception == 0) {
+        response[MODBUS_TCP_MBAP_BYTES] = function;
+        response[MODBUS_TCP_MBAP_BYTES + 1] = 2 * count;
+        pduBytes = 2 + 2 * count;
+      }
+    }
+    if (exception != 0) {
+      response[MODBUS_TCP_MBAP_BYTES] = function | MODBUS_EXCEPTION_FLAG;
+      response[MODBUS_TCP_MBAP_BYTES + 1] = exception;
+      pduBytes = 2;
+      this->exceptionCount++;
+    }
+    this->requestCount++;
+
+    uint16_t length = 1 + pduBytes;    // the unit id and the PDU
+    response[4] = length >> 8;
+    response[5] = length & 0xFF;
+    client.socket.write(response, MODBUS_TCP_MBAP_BYTES + pduBytes);
+  }
+};
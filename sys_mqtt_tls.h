@@ -0,0 +1,101 @@
+// ----[SECURE MQTT MODULE]-----
+// the network client the MQTT connection runs over, plain TCP or (with MQTT_TLS) TLS to the broker
+//
+// on the Nano 33 IoT the TLS is done by the NINA-W102 wifi module (WiFiSSLClient), checked
+// against the root certificates in its firmware, so the handshake takes no time on the SAMD21
+// at all.  Add the broker's root with the WiFiNINA firmware updater if it isn't one of them.  For
+// a broker that wants a client certificate, MQTT_TLS_ECCX08 runs BearSSL on the SAMD21 instead,
+// with the private key held in the ECCX08 (set up by sys_crypto.h), which does the signing for
+// the handshake so the key never leaves the chip.
+//
+// on the ESP32 it is mbedTLS (WiFiClientSecure), checked against MQTT_TLS_ROOT_CA if it is set.
+//
+// a handshake is by far the dearest part of a connection, so under TLS the MQTT keep alive is
+// longer.  A slow patch of wifi then doesn't get taken for a dead broker and cost another one
+
+#pragma once
+
+#include <Arduino.h>
+#include "sys_wifi.h"
+#include "sys_logStatus.h"
+
+// uncomment this line to connect to the broker over TLS, the port then defaults to 8883
+// #define MQTT_TLS
+
+// uncomment this line as well on the Nano 33 IoT to authenticate with the certificate for the key
+// in the ECCX08, paste the certificate (PEM) the broker issued for it into MQTT_TLS_CLIENT_CERT
+// #define MQTT_TLS_ECCX08
+
+// the PEM of the broker's root CA, for the ESP32 to check the broker against.  Left out the
+// connection is still encrypted, but the broker isn't authenticated
+// #define MQTT_TLS_ROOT_CA "-----BEGIN CERTIFICATE-----\n...\n-----END CERTIFICATE-----\n"
+
+#define MQTT_PLAIN_PORT           1883
+#define MQTT_TLS_PORT             8883
+#define MQTT_TLS_KEEP_ALIVE_S     60      // longer than the usual 15s, see above
+#define MQTT_TLS_HANDSHAKE_S      30      // a handshake that takes longer than this is given up
+#define MQTT_TLS_ECCX08_SLOT      0       // the slot of the private key, as CRYPTO_SLOT in sys_crypto.h
+
+#ifndef ARDUINO_ARCH_SAMD
+  #undef MQTT_TLS_ECCX08
+#endif
+
+#if defined(MQTT_TLS) && defined(MQTT_TLS_ECCX08)
+  #include <ArduinoECCX08.h>
+  #include <ArduinoBearSSL.h>
+  #ifndef MQTT_TLS_CLIENT_CERT
+    #error "MQTT_TLS_ECCX08 needs the client certificate in MQTT_TLS_CLIENT_CERT"
+  #endif
+  WiFiClient tcpClient;                           // BearSSL runs on top of a plain connection
+  BearSSLClient networkClient(tcpClient);
+#elif defined(MQTT_TLS) && defined(ARDUINO_ARCH_SAMD)
+  WiFiSSLClient networkClient;
+#elif defined(MQTT_TLS) && defined(ARDUINO_ARCH_ESP32)
+  #include <WiFiClientSecure.h>
+  WiFiClientSecure networkClient;
+#else
+  WiFiClient networkClient;
+#endif
+
+// the port from the config, 0 for the standard one
+uint16_t mqttBrokerPort() {
+  long port = config.mqttBrokerPort.toInt();
+  if ((port > 0) && (port <= 65535)) {
+    return port;
+  }
+#ifdef MQTT_TLS
+  return MQTT_TLS_PORT;
+#else
+  return MQTT_PLAIN_PORT;
+#endif
+}
+
+#ifdef MQTT_TLS_ECCX08
+// BearSSL checks the broker's certificate dates, the NINA module keeps the time from NTP
+unsigned long getBearSSLTime() {
+  return WiFi.getTime();
+}
+#endif
+
+// set up the TLS on the client, before the MQTT connection is opened
+void setupMqttTls() {
+#if defined(MQTT_TLS) && defined(MQTT_TLS_ECCX08)
+  if (!ECCX08.begin()) {
+    LOG_ERROR("No ECCX08 present, the broker will not accept the connection");
+  }
+  ArduinoBearSSL.onGetTime(getBearSSLTime);
+  networkClient.setEccSlot(MQTT_TLS_ECCX08_SLOT, MQTT_TLS_CLIENT_CERT);
+  LOG_STATUS("MQTT over TLS, with the ECCX08 key in slot %d", MQTT_TLS_ECCX08_SLOT);
+#elif defined(MQTT_TLS) && defined(ARDUINO_ARCH_ESP32)
+  #ifdef MQTT_TLS_ROOT_CA
+  networkClient.setCACert(MQTT_TLS_ROOT_CA);
+  LOG_STATUS("MQTT over TLS");
+  #else
+  networkClient.setInsecure();
+  LOG_ERROR("MQTT over TLS, but with no MQTT_TLS_ROOT_CA the broker is not authenticated");
+  #endif
+  networkClient.setHandshakeTimeout(MQTT_TLS_HANDSHAKE_S);
+#elif defined(MQTT_TLS)
+  LOG_STATUS("MQTT over TLS, by the wifi module");
+#endif
+}
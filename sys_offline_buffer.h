@@ -0,0 +1,176 @@
+// ----[OFFLINE BUFFER MODULE]-----
+// store and forward for readings taken while the network or the broker is down
+//
+// samples are kept in a ring buffer in RAM.  On the ESP32 the buffer can optionally spill over into
+// a file on the LittleFS partition when it fills up (uncomment OFFLINE_SPILL_TO_FLASH), so a long
+// outage doesn't lose the oldest readings.  Once we are back online the backlog is read back out
+// oldest first in batches, and each batch is only dropped from the buffer once it has been sent.
+//
+// samples are timestamped with millis(), so they only make sense within one boot.  The spill
+// file is cleared at startup for that reason.
+
+#pragma once
+
+#include <Arduino.h>
+#include "sys_logStatus.h"
+
+// uncomment this line to spill the buffer to flash on the ESP32 (needs a LittleFS partition)
+// #define OFFLINE_SPILL_TO_FLASH
+
+#ifdef ARDUINO_ARCH_SAMD
+  #define OFFLINE_BUFFER_SAMPLES    128       // samples held in RAM, 12 bytes each
+#else
+  #define OFFLINE_BUFFER_SAMPLES    1024
+#endif
+
+#if defined(OFFLINE_SPILL_TO_FLASH) && defined(ARDUINO_ARCH_ESP32)
+  #include <LittleFS.h>
+  #define OFFLINE_SPILL_FILE        "/backlog.bin"
+  #define OFFLINE_SPILL_MAX_BYTES   262144    // cap on the spill file, beyond this the oldest samples are dropped
+  #define OFFLINE_SPILL_CHUNK       (OFFLINE_BUFFER_SAMPLES / 2)  // samples moved to flash at a time
+#else
+  #undef OFFLINE_SPILL_TO_FLASH
+#endif
+
+struct OfflineSampleType {
+  uint32_t timestampMs;   // millis() when the sample was taken
+  uint8_t meterID;        // modbus id of the meter
+  uint8_t field;          // what was sampled, as understood by whoever stored it
+  float value;
+};
+
+class OfflineBufferType {
+public:
+  // call once at startup
+  void begin() {
+#ifdef OFFLINE_SPILL_TO_FLASH
+    this->flashReady = LittleFS.begin(true);
+    if (!this->flashReady) {
+      LOG_ERROR("LittleFS unavailable, the offline buffer will not spill to flash");
+    } else {
+      LittleFS.remove(OFFLINE_SPILL_FILE);    // left over from a previous boot, the timestamps mean nothing now
+    }
+#endif
+  }
+
+  void push(const OfflineSampleType& sample) {
+    if (this->count >= OFFLINE_BUFFER_SAMPLES) {
+      makeRoom();
+    }
+    this->samples[(this->tail + this->count) % OFFLINE_BUFFER_SAMPLES] = sample;
+    this->count++;
+  }
+
+  // samples waiting to be sent, in RAM and in flash
+  uint32_t pending() const {
+    return this->count + this->flashPending();
+  }
+
+  // samples lost because there was nowhere to keep them
+  uint32_t dropped() const { return this->droppedSamples; }
+
+  // copy out up to max of the oldest samples, without removing them
+  uint16_t peek(OfflineSampleType* out, uint16_t max) {
+    this->peekedFromFlash = false;
+#ifdef OFFLINE_SPILL_TO_FLASH
+    if (this->flashPending() > 0) {
+      // the flash holds the oldest samples, so send all of those before the RAM
+      File file = LittleFS.open(OFFLINE_SPILL_FILE, FILE_READ);
+      if (file && file.seek(this->flashReadOffset)) {
+        uint16_t n = file.read(reinterpret_cast<uint8_t*>(out), max * sizeof(OfflineSampleType)) / sizeof(OfflineSampleType);
+        file.close();
+        this->peekedFromFlash = true;
+        return n;
+      }
+      LOG_ERROR("Could not read the offline spill file, dropping it");
+      discardFlash();
+    }
+#endif
+    uint16_t n = (this->count < max) ? this->count : max;
+    for (uint16_t i = 0; i < n; i++) {
+      out[i] = this->samples[(this->tail + i) % OFFLINE_BUFFER_SAMPLES];
+    }
+    return n;
+  }
+
+  // drop the samples returned by the last peek, once they are safely sent
+  void pop(uint16_t n) {
+#ifdef OFFLINE_SPILL_TO_FLASH
+    if (this->peekedFromFlash) {
+      this->flashReadOffset += n * sizeof(OfflineSampleType);
+      if (this->flashPending() == 0) {
+        discardFlash();
+      }
+      return;
+    }
+#endif
+    if (n > this->count) {
+      n = this->count;
+    }
+    this->tail = (this->tail + n) % OFFLINE_BUFFER_SAMPLES;
+    this->count -= n;
+  }
+
+private:
+  OfflineSampleType samples[OFFLINE_BUFFER_SAMPLES];
+  uint16_t tail = 0;                // oldest sample in RAM
+  uint16_t count = 0;               // samples in RAM
+  uint32_t droppedSamples = 0;
+  bool peekedFromFlash = false;
+
+#ifdef OFFLINE_SPILL_TO_FLASH
+  bool flashReady = false;
+  uint32_t flashWriteOffset = 0;    // length of the spill file
+  uint32_t flashReadOffset = 0;     // how far into it we have sent
+
+  uint32_t flashPending() const {
+    return (this->flashWriteOffset - this->flashReadOffset) / sizeof(OfflineSampleType);
+  }
+
+  void discardFlash() {
+    LittleFS.remove(OFFLINE_SPILL_FILE);
+    this->flashWriteOffset = 0;
+    this->flashReadOffset = 0;
+  }
+
+  // move the oldest chunk of the RAM buffer out to the end of the spill file
+  bool spillToFlash() {
+    if (!this->flashReady || (this->flashWriteOffset + OFFLINE_SPILL_CHUNK * sizeof(OfflineSampleType) > OFFLINE_SPILL_MAX_BYTES)) {
+      return false;
+    }
+    File file = LittleFS.open(OFFLINE_SPILL_FILE, FILE_APPEND);
+    if (!file) {
+      return false;
+    }
+    uint16_t written = 0;
+    while (written < OFFLINE_SPILL_CHUNK) {
+      const OfflineSampleType& sample = this->samples[(this->tail + written) % OFFLINE_BUFFER_SAMPLES];
+      if (file.write(reinterpret_cast<const uint8_t*>(&sample), sizeof(sample)) != sizeof(sample)) {
+        break;    // flash full, keep what made it out
+      }
+      this->flashWriteOffset += sizeof(sample);
+      written++;
+    }
+    file.close();
+    this->tail = (this->tail + written) % OFFLINE_BUFFER_SAMPLES;
+    this->count -= written;
+    return written > 0;
+  }
+#else
+  uint32_t flashPending() const { return 0; }
+  bool spillToFlash() { return false; }
+#endif
+
+  // the RAM buffer is full, spill some of it or lose the oldest sample
+  void makeRoom() {
+    if (spillToFlash()) {
+      return;
+    }
+    if (this->droppedSamples == 0) {
+      LOG_ERROR("Offline buffer full, dropping the oldest readings");
+    }
+    this->droppedSamples++;
+    this->tail = (this->tail + 1) % OFFLINE_BUFFER_SAMPLES;
+    this->count--;
+  }
+};
@@ -0,0 +1,55 @@
+// ----[PUBLISH FILTER MODULE]-----
+// decides whether a freshly read value is worth sending to home assistant
+//
+// readings are noisy in the last digit or two (e.g. a steady 240V mains reads 239.98, 240.01,
+// 239.99...), so publishing every change keeps the wifi and the broker busy with nothing of
+// interest.  Each field gets a filter with:
+//  - a deadband, absolute (in the field's units) or relative (a fraction of the last published value),
+//    that a value has to move by before it counts as a change
+//  - a minimum interval, changes inside this time after the last publish wait for a later read
+//  - a maximum interval, after this the value is sent anyway as a heartbeat so the entity does
+//    not expire in home assistant
+//  - whether the value is retained on the broker.  Fast moving readings aren't worth the broker
+//    storing, the next one is only seconds away, where a counter should be there straight away
+//    when home assistant restarts
+
+#pragma once
+
+#include <Arduino.h>
+
+enum DeadbandType : uint8_t {
+  DEADBAND_ABSOLUTE,  // deadband is in the field's units
+  DEADBAND_RELATIVE   // deadband is a fraction of the last published value, e.g. 0.02 for 2%
+};
+
+enum PublishDecisionType : uint8_t {
+  PUBLISH_SKIP,       // nothing worth sending
+  PUBLISH_CHANGE,     // the value has moved outside the deadband
+  PUBLISH_HEARTBEAT   // unchanged, but due to be sent again anyway
+};
+
+struct PublishFilterType {
+  float deadband;                 // how far a value must move (0 = any change)
+  DeadbandType mode;
+  unsigned long minIntervalMs;    // least time between publishes of a changed value (0 = no limit)
+  unsigned long maxIntervalMs;    // longest time between publishes, changed or not (0 = no heartbeat)
+  bool retain;                    // the broker keeps the last value for new subscribers
+
+  // the value has moved further than the deadband from the last published value
+  bool outsideDeadband(float value, float lastValue) const {
+    float threshold = (this->mode == DEADBAND_RELATIVE) ? this->deadband * fabsf(lastValue) : this->deadband;
+    float difference = fabsf(value - lastValue);
+    return (threshold > 0.0f) ? (difference >= threshold) : (value != lastValue);
+  }
+
+  // compare against the last published value, sinceLastMs is the time since it was published
+  PublishDecisionType check(float value, float lastValue, unsigned long sinceLastMs) const {
+    if ((this->maxIntervalMs > 0) && (sinceLastMs >= this->maxIntervalMs)) {
+      return PUBLISH_HEARTBEAT;
+    }
+    if (sinceLastMs < this->minIntervalMs) {
+      return PUBLISH_SKIP;    // rate limited, a later read will pick up the change
+    }
+    return outsideDeadband(value, lastValue) ? PUBLISH_CHANGE : PUBLISH_SKIP;
+  }
+};
@@ -0,0 +1,95 @@
+// ----[REGISTER SNAPSHOT MODULE]-----
+// the raw registers last read off a meter, held as one packed frame per meter
+//
+// each block response is copied in once, straight out of the modbus frame, to where its table
+// entries live in the snapshot (entries are packed end to end in register table order, so the
+// unused registers between them take no room).  The typed views then decode straight from the
+// snapshot, so anything that wants a reading (publishing, aggregation, derived values, diagnostics)
+// takes it from here rather than going back to the client.
+//
+// a frame is one bus cycle on the meter: beginFrame() when its reads are queued, endFrame() once
+// they have all completed.  frameFields then says which fields were refreshed in that cycle, so
+// readings taken from these are all from the same point in time.
+//
+// the Modbus TCP gateway reads the snapshot from loop(), which in dual core mode is on the other
+// core from the bus.  copyField() guards a field with a sequence count, so it never hands out a
+// value that was half way through being stored
+//
+// needs METER_SNAPSHOT_WORDS, METER_FIELD_COUNT and MeterFieldMaskType, see home_assistant.h
+
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <cstring>
+
+struct RegisterSnapshotType {
+  alignas(4) uint16_t words[METER_SNAPSHOT_WORDS] = {};   // registers in native byte order
+  MeterFieldMaskType validFields = 0;     // fields that have been read at least once
+  MeterFieldMaskType frameFields = 0;     // fields refreshed in the current (or last completed) frame
+  uint32_t frames = 0;                    // frames completed since boot
+  unsigned long frameStartedMs = 0;       // millis() when the current frame was queued
+  unsigned long fieldReadMs[METER_FIELD_COUNT] = {};   // frameStartedMs of the frame each field was last read in
+  std::atomic<uint32_t> sequence{0};      // odd while a store is under way
+
+  void beginFrame(unsigned long now) {
+    this->frameFields = 0;
+    this->frameStartedMs = now;
+  }
+
+  void endFrame() {
+    this->frames++;
+  }
+
+  // copy a field's registers in from a response, which has them high byte first
+  void store(uint8_t field, uint16_t offset, uint8_t count, const uint8_t* wire) {
+    uint32_t sequence = this->sequence.load(std::memory_order_relaxed);
+    this->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint8_t i = 0; i < count; i++) {
+      this->words[offset + i] = (static_cast<uint16_t>(wire[2 * i]) << 8) | wire[2 * i + 1];
+    }
+    MeterFieldMaskType bit = ((MeterFieldMaskType)1) << field;
+    this->validFields |= bit;
+    this->frameFields |= bit;
+    this->fieldReadMs[field] = this->frameStartedMs;
+    this->sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  // copy a field's registers out, from any core.  Returns false if it has never been read
+  bool copyField(uint8_t field, uint16_t offset, uint8_t count, uint16_t* out, unsigned long& readMs) const {
+    for (;;) {
+      uint32_t before = this->sequence.load(std::memory_order_acquire);
+      if (before & 1) {
+        continue;   // a store is under way, it only takes a moment
+      }
+      bool valid = (this->validFields & (((MeterFieldMaskType)1) << field)) != 0;
+      for (uint8_t i = 0; i < count; i++) {
+        out[i] = this->words[offset + i];
+      }
+      readMs = this->fieldReadMs[field];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (this->sequence.load(std::memory_order_relaxed) == before) {
+        return valid;
+      }
+    }
+  }
+
+  // ----[typed views]-----
+  // 32 bit values take 2 registers, high word first
+
+  float float32At(uint16_t offset) const {
+    uint32_t bits = uint32At(offset);
+    float value;
+    std::memcpy(&value, &bits, sizeof(float));    // reinterpret the bits, without breaking aliasing rules
+    return value;
+  }
+
+  uint32_t uint32At(uint16_t offset) const {
+    return (static_cast<uint32_t>(this->words[offset]) << 16) | this->words[offset + 1];
+  }
+
+  int16_t int16At(uint16_t offset) const {
+    return static_cast<int16_t>(this->words[offset]);
+  }
+};
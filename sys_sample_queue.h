@@ -0,0 +1,76 @@
+// ----[SAMPLE QUEUE MODULE]-----
+// hands decoded meter readings from the modbus acquisition task to the publishing side
+//
+// a fixed size ring of records with exactly one writer (the task reading the bus) and one reader
+// (the loop doing the MQTT work).  With only one of each, the two indexes are enough to keep them
+// apart and no lock is needed: the writer only moves head, the reader only moves tail, and each
+// index is published with release/acquire ordering so the record contents are visible before the
+// index that covers them.  Neither side ever waits on the other, if the queue is full the new
+// record is dropped and counted rather than holding up the bus.
+
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#define SAMPLE_QUEUE_LENGTH   512     // records, must be a power of two.  About 6KB
+
+static_assert((SAMPLE_QUEUE_LENGTH & (SAMPLE_QUEUE_LENGTH - 1)) == 0, "SAMPLE_QUEUE_LENGTH must be a power of two");
+static_assert(SAMPLE_QUEUE_LENGTH <= 32768, "SAMPLE_QUEUE_LENGTH must fit the 16 bit indexes");
+
+enum MeterSampleKindType : uint8_t {
+  SAMPLE_READING,           // a decoded value for one field
+  SAMPLE_METER_DONE,        // all the blocks queued for the meter this cycle have completed
+  SAMPLE_METER_RECOVERED    // the meter is answering again after being unavailable
+};
+
+struct MeterSampleType {
+  uint32_t timestampMs;     // millis() when the reading came off the bus
+  uint8_t meterIndex;       // index into ha.meters
+  MeterSampleKindType kind;
+  uint8_t field;            // register table index, for SAMPLE_READING
+  float value;
+};
+
+class SampleQueueType {
+public:
+  // writer side only.  Returns false if the queue is full and the record was dropped
+  bool push(const MeterSampleType& sample) {
+    uint16_t head = this->head.load(std::memory_order_relaxed);
+    uint16_t tail = this->tail.load(std::memory_order_acquire);
+    if ((uint16_t)(head - tail) >= SAMPLE_QUEUE_LENGTH) {
+      this->droppedRecords.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    this->records[head & (SAMPLE_QUEUE_LENGTH - 1)] = sample;
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // reader side only.  Returns false if there is nothing waiting
+  bool pop(MeterSampleType& sample) {
+    uint16_t tail = this->tail.load(std::memory_order_relaxed);
+    uint16_t head = this->head.load(std::memory_order_acquire);
+    if (head == tail) {
+      return false;
+    }
+    sample = this->records[tail & (SAMPLE_QUEUE_LENGTH - 1)];
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // reader side only, true when nothing is waiting
+  bool empty() const {
+    return this->tail.load(std::memory_order_relaxed) == this->head.load(std::memory_order_acquire);
+  }
+
+  // records lost to a full queue since boot, safe to read from either side
+  uint32_t dropped() const { return this->droppedRecords.load(std::memory_order_relaxed); }
+
+private:
+  MeterSampleType records[SAMPLE_QUEUE_LENGTH];
+  // free running, wrapping at 16 bits, the difference is the number of records waiting
+  std::atomic<uint16_t> head{0};    // next slot to write
+  std::atomic<uint16_t> tail{0};    // next slot to read
+  std::atomic<uint32_t> droppedRecords{0};
+};
@@ -0,0 +1,74 @@
+// ----[POLLING SCHEDULER MODULE]-----
+// tiered polling on top of the ThreadController: each poll group gets its own timer thread
+// and period, and when a group's timer fires it is simply marked as due.  The bus cycle then
+// collects everything that is due at once, so groups that fall due together are folded into
+// a single pass over the bus rather than each one doing its own
+
+#pragma once
+
+#include <Thread.h>
+#include <ThreadController.h>
+
+#define POLL_MAX_GROUPS   8     // upper limit on the number of poll groups
+
+class PollSchedulerType;
+
+// a timer thread that flags its group as due rather than running a callback
+class PollGroupThread : public Thread {
+public:
+  PollSchedulerType* scheduler = nullptr;
+  uint8_t group = 0;
+  void run() override;
+  unsigned long period() const { return this->interval; }
+};
+
+class PollSchedulerType {
+public:
+  ThreadController controller;                  // add this to the main controller to drive the group timers
+  PollGroupThread groupTimers[POLL_MAX_GROUPS];
+  uint8_t groupCount = 0;
+  uint32_t dueGroups = 0;                       // one bit per group that is waiting to be polled
+
+  // register a group and its period, all groups start off due so the first cycle reads everything
+  bool addGroup(unsigned long periodMs) {
+    if (groupCount >= POLL_MAX_GROUPS) {
+      return false;
+    }
+    PollGroupThread& timer = this->groupTimers[groupCount];
+    timer.scheduler = this;
+    timer.group = groupCount;
+    timer.setInterval(periodMs);
+    timer.enabled = true;
+    this->controller.add(&timer);
+    this->dueGroups |= bit(groupCount);
+    groupCount++;
+    return true;
+  }
+
+  // change a group's period on the fly
+  void setPeriod(uint8_t group, unsigned long periodMs) {
+    if (group < groupCount) {
+      this->groupTimers[group].setInterval(periodMs);
+    }
+  }
+
+  unsigned long getPeriod(uint8_t group) {
+    return (group < groupCount) ? this->groupTimers[group].period() : 0;
+  }
+
+  void markDue(uint8_t group) {
+    this->dueGroups |= bit(group);
+  }
+
+  // hand over the set of due groups to the bus cycle and reset it
+  uint32_t takeDueGroups() {
+    uint32_t due = this->dueGroups;
+    this->dueGroups = 0;
+    return due;
+  }
+};
+
+void PollGroupThread::run() {
+  this->scheduler->markDue(this->group);
+  runned();
+}
@@ -1,32 +1,81 @@
-// ----[DYNAMICALLY CREATING STATIC STRINGS]----- 
+// ----[DYNAMICALLY CREATING STATIC STRINGS]-----
 // a library to define static strings, where the pointer address does not change
 // required for libraries where it is good to programmatically define strings
-// this library creates a string based on a dynamic input. and returns a pointer to 
+// this library creates a string based on a dynamic input. and returns a pointer to
 // the static string held in the string library from there on in
+//
+// the strings are packed end to end into one statically sized arena (a bump allocator, nothing
+// is ever freed), so there are no small heap allocations to fragment the heap.  Strings are
+// interned, asking for a string that is already held returns the same pointer rather than a copy.
+// If the arena fills up we log it and hand back nullptr, which the HA library treats as "not set"
 
 #pragma once
 
-#define RESERVE_STRINGS    128 // reserve 128 strings for UIDs
-#define FIXED_STR_LENGTH   64  // max string length is 64 chars
-int NEXT_ID = 0;               // let's count how many we use
+#define STATIC_STRING_ARENA_BYTES   3072    // room for all the UIDs, keep an eye on the fill level when adding meters
 
-const char* staticStrings[RESERVE_STRINGS]; // Array to store C-style strings (const char*)
+static_assert(STATIC_STRING_ARENA_BYTES > 0 && STATIC_STRING_ARENA_BYTES <= 65535, "static string arena size must fit in 16 bits");
+
+struct StaticStringArenaType {
+  char buffer[STATIC_STRING_ARENA_BYTES];
+  uint16_t used = 0;          // bytes handed out, including the terminators
+  uint16_t count = 0;         // distinct strings held
+  uint16_t requests = 0;      // strings asked for, including duplicates
+  uint16_t failures = 0;      // strings that did not fit
+} staticStringArena;
+
+// look for a string that is already held, the arena is a run of nul terminated strings so just walk it
+const char* findStaticString(const char* data) {
+  uint16_t offset = 0;
+  while (offset < staticStringArena.used) {
+    const char* held = &staticStringArena.buffer[offset];
+    if (strcmp(held, data) == 0) {
+      return held;
+    }
+    offset += strlen(held) + 1;
+  }
+  return nullptr;
+}
+
+// Save a string in the arena and return a pointer to the saved string
+const char* storeStaticString(const char* data) {
+    if (!data) {
+        return nullptr;
+    }
+    staticStringArena.requests++;
+
+    // Only keep one copy of each string
+    const char* held = findStaticString(data);
+    if (held) {
+        return held;
+    }
 
-// Save a string in the array and return a pointer to the saved string
-const char* storeStaticString(const String& s_data) {
     // Check for available space
-    if (NEXT_ID >= RESERVE_STRINGS) {
-        logSuspend("Allocation full. Not enough space reserved for static strings");
+    size_t length = strlen(data) + 1;
+    if (staticStringArena.used + length > STATIC_STRING_ARENA_BYTES) {
+        staticStringArena.failures++;
+        LOG_ERROR("Static string arena full, increase STATIC_STRING_ARENA_BYTES. Dropped: %s", data);
         return nullptr; // Indicate an error
     }
 
-    // Convert the Arduino String to a C-style string
-    char c_data[FIXED_STR_LENGTH]; 
-    s_data.toCharArray(c_data, FIXED_STR_LENGTH); // Copy String to char array
+    // bump allocate and copy the string in
+    char* stored = &staticStringArena.buffer[staticStringArena.used];
+    memcpy(stored, data, length);
+    staticStringArena.used += length;
+    staticStringArena.count++;
+    return stored;
+}
 
-    // Allocate memory and copy the string
-    staticStrings[NEXT_ID] = strdup(c_data); 
-    NEXT_ID++;
+const char* storeStaticString(const String& s_data) {
+    return storeStaticString(s_data.c_str());
+}
 
-    return staticStrings[NEXT_ID - 1];
-}
\ No newline at end of file
+// report how full the arena is, call once everything has been set up
+void logStaticStringStats() {
+    if (staticStringArena.failures > 0) {
+        LOG_ERROR("Static strings: %u held (%u requested), %u of %u bytes used, %u did not fit", staticStringArena.count, staticStringArena.requests,
+                  staticStringArena.used, STATIC_STRING_ARENA_BYTES, staticStringArena.failures);
+    } else {
+        LOG_STATUS("Static strings: %u held (%u requested), %u of %u bytes used", staticStringArena.count, staticStringArena.requests,
+                   staticStringArena.used, STATIC_STRING_ARENA_BYTES);
+    }
+}
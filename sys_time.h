@@ -20,13 +20,13 @@ void setupTime() {
   setupWiFi();           // ensure that wifi is set up and connected
   // set up the timer
   ezt::setInterval(60);  // set interval for NTP time sync polling
-  logStatus("Syncing NTP...");
+  LOG_STATUS("Syncing NTP...");
 	ezt::waitForSync(5);    // ensure that the time is synced (5 sec timeout)
 
 	// Provide official timezone names
 	// https://en.wikipedia.org/wiki/List_of_tz_database_time_zones
 	tzLondon.setLocation(F(config.timeZone.c_str()));
-  logStatus("IS8601 for Time Zone '" + config.timeZone + "' :" + tzLondon.dateTime(ISO8601));
+  LOG_STATUS("IS8601 for Time Zone '%s' :%s", config.timeZone.c_str(), tzLondon.dateTime(ISO8601).c_str());
 
 /*
 	Serial.println();
@@ -45,62 +45,298 @@ void resetWiFi() {
 
 }
 
-void connectToWiFi()
-{
-  int status = WiFi.status();
-  if (status == WL_CONNECTED)
-  {
+// reconnection is a small state machine run from the loop, nothing in it waits for the network:
+//
+//   CONNECTING --(got an IP)--> CONNECTED --(link lost)--> BACKOFF --(wait over)--> CONNECTING
+//        \-------------(attempt timed out or failed)------------^
+//
+// after each failed attempt the wait before the next one doubles, up to WIFI_BACKOFF_MAX_MS, with
+// some random jitter so a building full of these don't all hammer the access point at the same
+// moment after a power cut.  On the ESP32 the state changes are driven by WiFi.onEvent() as well
+// as by polling WiFi.status(), so a drop is noticed straight away rather than on the next poll.
+
+#define WIFI_CONNECT_TIMEOUT_MS   15000   // how long to give a connection attempt before calling it failed
+#define WIFI_BACKOFF_MIN_MS       1000    // wait after the first failure, doubled for each one after that
+#define WIFI_BACKOFF_MAX_MS       60000   // longest wait between attempts
+#define WIFI_BACKOFF_JITTER       4       // +/- 1/4 of the wait is random
+#define WIFI_BEGIN_TIMEOUT_MS     50      // Nano IoT 33 only, how long WiFi.begin() itself may block
+
+// un-comment this line for the fast boot path, see the fast boot section below
+// #define FAST_BOOT
+#define WIFI_FAST_CONNECT_TIMEOUT_MS  4000    // a join on the cached details that hasn't worked by now isn't going to
+
+enum WiFiStateType : uint8_t {
+  WIFI_STATE_CONNECTING,    // WiFi.begin() has been called, waiting to hear back
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_BACKOFF        // waiting before the next attempt
+};
+
+struct WiFiLinkType {
+  WiFiStateType state = WIFI_STATE_BACKOFF;   // with nextAttemptAt = 0, so the first call starts connecting
+  unsigned long stateSince = 0;               // millis() when the state was entered
+  unsigned long nextAttemptAt = 0;            // when the backoff ends
+  uint8_t failures = 0;                       // attempts failed in a row
+  uint16_t reconnects = 0;                    // times the link has come back after being lost
+  // set from the ESP32 wifi event task, picked up in the loop
+  volatile bool gotIP = false;
+  volatile bool lostLink = false;
+  volatile uint8_t disconnectReason = 0;
+} wifiLink;
+
+// ----[fast boot]-----
+// with FAST_BOOT set, setup() doesn't wait for the network at all.  The meters are read from the
+// start and their readings go into the offline buffer until the broker is reached, like any other
+// outage.  The access point (BSSID and channel, ESP32 only) and the address we were given are kept
+// in Preferences after each full join, and the first join after a boot uses them, so it skips the
+// scan and DHCP.  If that join doesn't work the cache is forgotten and we fall back to a full join.
+//
+// the cached address is used as a static one and DHCP doesn't renew it, so give the device a
+// DHCP reservation on the router, otherwise the lease can run out and be handed to someone else.
+// Only the boot join uses the cache, any later reconnect does a full join and renews it.
+
+#ifdef FAST_BOOT
+struct WiFiCacheType {
+  bool valid = false;         // loaded, and for the configured SSID
+  bool inUse = false;         // the current attempt is using it
+  uint8_t bssid[6] = {};
+  uint32_t channel = 0;
+  uint32_t localIP = 0;
+  uint32_t gatewayIP = 0;
+  uint32_t subnetMask = 0;
+  uint32_t dnsIP = 0;
+} wifiCache;
+
+void loadWiFiCache() {
+  preferences.begin("wifi_cache", true);
+  wifiCache.valid = (preferences.getString("ssid") == config.secretWiFiSSID)
+    && (preferences.getBytes("bssid", wifiCache.bssid, sizeof(wifiCache.bssid)) == sizeof(wifiCache.bssid));
+  wifiCache.channel = preferences.getUInt("channel");
+  wifiCache.localIP = preferences.getUInt("ip");
+  wifiCache.gatewayIP = preferences.getUInt("gw");
+  wifiCache.subnetMask = preferences.getUInt("mask");
+  wifiCache.dnsIP = preferences.getUInt("dns");
+  preferences.end();
+  wifiCache.valid = wifiCache.valid && (wifiCache.localIP != 0);
+}
+
+// keep the details of the join we have just made, only writing to flash when they have changed
+void saveWiFiCache() {
+  WiFiCacheType current;
+#ifdef ARDUINO_ARCH_ESP32
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  current.dnsIP = WiFi.dnsIP();
+#else
+  WiFi.BSSID(current.bssid);
+  current.dnsIP = WiFi.gatewayIP();   // WiFiNINA doesn't tell us the DNS server, the router is the usual one
+#endif
+  current.localIP = WiFi.localIP();
+  current.gatewayIP = WiFi.gatewayIP();
+  current.subnetMask = WiFi.subnetMask();
+
+  if (wifiCache.valid && (memcmp(current.bssid, wifiCache.bssid, sizeof(current.bssid)) == 0)
+      && (current.channel == wifiCache.channel) && (current.localIP == wifiCache.localIP) && (current.gatewayIP == wifiCache.gatewayIP)
+      && (current.subnetMask == wifiCache.subnetMask) && (current.dnsIP == wifiCache.dnsIP)) {
     return;
   }
+  preferences.begin("wifi_cache");
+  preferences.putString("ssid", config.secretWiFiSSID);
+  preferences.putBytes("bssid", current.bssid, sizeof(current.bssid));
+  preferences.putUInt("channel", current.channel);
+  preferences.putUInt("ip", current.localIP);
+  preferences.putUInt("gw", current.gatewayIP);
+  preferences.putUInt("mask", current.subnetMask);
+  preferences.putUInt("dns", current.dnsIP);
+  preferences.end();
+  current.valid = true;
+  wifiCache = current;
+  LOG_TEXT("WiFi details cached for the next boot");
+}
+
+void forgetWiFiCache() {
+  preferences.begin("wifi_cache");
+  preferences.remove("ssid");
+  preferences.end();
+  wifiCache.valid = false;
+}
 
-  // connect to the wifi
-  logStatus("Connecting to WiFi...");
-  while(true) {
-    WiFi.setHostname(config.deviceID.c_str());
-    status = WiFi.begin(config.secretWiFiSSID.c_str(), config.secretWiFiPassword.c_str());
+// start a join on the cached details, the static address sticks on the Nano IoT 33 until the
+// driver is reset, which the next (full) attempt does as it follows a failure
+void startCachedWiFiAttempt() {
+  LOG_STATUS("Connecting to WiFi on the cached access point and address...");
 #ifdef ARDUINO_ARCH_ESP32
-    status = WiFi.waitForConnectResult();  // needed for ESP32
+  WiFi.config(IPAddress(wifiCache.localIP), IPAddress(wifiCache.gatewayIP), IPAddress(wifiCache.subnetMask), IPAddress(wifiCache.dnsIP));
+  WiFi.begin(config.secretWiFiSSID.c_str(), config.secretWiFiPassword.c_str(), wifiCache.channel, wifiCache.bssid);
+#else
+  WiFi.config(IPAddress(wifiCache.localIP), IPAddress(wifiCache.dnsIP), IPAddress(wifiCache.gatewayIP), IPAddress(wifiCache.subnetMask));
+  WiFi.begin(config.secretWiFiSSID.c_str(), config.secretWiFiPassword.c_str());
 #endif
-    if (status == WL_CONNECTED) {
-      break;
-    } else {
-      // evaluate failure mode   
-      switch (status) {
-      case WL_CONNECT_FAILED:
-        logText("Connection failed. Check SSID and password.");
-        break;
-      case WL_NO_SSID_AVAIL:
-        logText("SSID not found. Check if the network is available.");
-        break;
-      case WL_CONNECTION_LOST:
-        logText("Connection lost. Check network stability.");
-        break;
-      case WL_DISCONNECTED:
-        logText("Connection disconnected. Double-check that you've entered the correct SSID and password.");
-        break; 
-      default:
-        logText("Unknown error [" + String(status) + "] occurred.");
-      }
+}
+#endif
+
+#ifdef ARDUINO_ARCH_ESP32
+// runs in the wifi event task, not the loop, so only note what happened
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    wifiLink.gotIP = true;
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+    wifiLink.disconnectReason = info.wifi_sta_disconnected.reason;
+    wifiLink.lostLink = true;
+  }
+}
+#endif
+
+void setWiFiState(WiFiStateType state) {
+  wifiLink.state = state;
+  wifiLink.stateSince = millis();
+}
+
+// the wait before the next attempt, doubling with each failure, plus or minus the jitter
+unsigned long wiFiBackoffMs(uint8_t failures) {
+  unsigned long wait = WIFI_BACKOFF_MIN_MS;
+  for (uint8_t i = 1; (i < failures) && (wait < WIFI_BACKOFF_MAX_MS); i++) {
+    wait *= 2;
+  }
+  if (wait > WIFI_BACKOFF_MAX_MS) {
+    wait = WIFI_BACKOFF_MAX_MS;
+  }
+  long jitter = wait / WIFI_BACKOFF_JITTER;
+  return wait + random(-jitter, jitter + 1);
+}
+
+void logWiFiFailure(int status) {
+  // evaluate failure mode of the last attempt
+  switch (status) {
+  case WL_CONNECT_FAILED:
+    LOG_TEXT("Connection failed. Check SSID and password.");
+    break;
+  case WL_NO_SSID_AVAIL:
+    LOG_TEXT("SSID not found. Check if the network is available.");
+    break;
+  case WL_CONNECTION_LOST:
+    LOG_TEXT("Connection lost. Check network stability.");
+    break;
+  case WL_DISCONNECTED:
+    LOG_TEXT("Connection disconnected. Double-check that you've entered the correct SSID and password.");
+    break; 
+  default:
+    LOG_TEXT("Unknown error [%d] occurred.", status);
+  }
+  #ifdef ARDUINO_ARCH_ESP32
+    if (wifiLink.disconnectReason != 0) {
+      LOG_TEXT("Disconnect reason %d", wifiLink.disconnectReason);
     }
-    logError("Retrying in 5 seconds...");
-    resetWiFi();
-    delay(5000);
+  #endif
+}
+
+// give up on the current attempt (or the lost link) and wait before trying again
+void backOffWiFi(int status) {
+#ifdef FAST_BOOT
+  if (wifiCache.inUse) {
+    LOG_ERROR("Could not join with the cached WiFi details, forgetting them");
+    forgetWiFiCache();
+    wifiCache.inUse = false;
   }
+#endif
+  wifiLink.failures++;
+  logWiFiFailure(status);
+  unsigned long wait = wiFiBackoffMs(wifiLink.failures);
+  LOG_ERROR("Retrying WiFi connection in %lums...", wait);
+  wifiLink.nextAttemptAt = millis() + wait;
+  setWiFiState(WIFI_STATE_BACKOFF);
+}
+
+// a retry is just another begin().  Resetting the driver here would block for most of a second on
+// the NINA and drop every open socket with it, so that is only done once at boot (see setupWiFi)
+void startWiFiAttempt() {
+  wifiLink.gotIP = false;
+  wifiLink.lostLink = false;
+  wifiLink.disconnectReason = 0;
+  setWiFiState(WIFI_STATE_CONNECTING);
+  WiFi.setHostname(config.deviceID.c_str());
+#ifdef FAST_BOOT
+  // only the boot join uses the cache
+  wifiCache.inUse = wifiCache.valid && (wifiLink.failures == 0) && (wifiLink.reconnects == 0);
+  if (wifiCache.inUse) {
+    startCachedWiFiAttempt();
+    return;
+  }
+  #ifdef ARDUINO_ARCH_ESP32
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);    // back to DHCP
+  #endif
+#endif
+  LOG_STATUS("Connecting to WiFi...");
+  WiFi.begin(config.secretWiFiSSID.c_str(), config.secretWiFiPassword.c_str());
+}
 
-  // log the mac address
-  byte mac[6];
-  WiFi.macAddress(mac);
-  logStatus("MAC Address: ");
-  logByteArrayAsHex(mac,6);
-  // connection complete
-  logStatus("Connected to WiFi.");
+// how long the current attempt gets before it is called failed
+unsigned long wiFiAttemptTimeoutMs() {
+#ifdef FAST_BOOT
+  if (wifiCache.inUse) {
+    return WIFI_FAST_CONNECT_TIMEOUT_MS;
+  }
+#endif
+  return WIFI_CONNECT_TIMEOUT_MS;
 }
 
-void setupWiFi()
+// run the reconnection state machine, call this every time round the loop.  It never waits for
+// the connection, so the loop keeps running while the network is down (the meters are still read
+// and their readings kept until we are back).  Returns true when connected.
+bool connectToWiFi()
 {
   int status = WiFi.status();
 
+  switch (wifiLink.state) {
+  case WIFI_STATE_CONNECTING:
+    if (wifiLink.gotIP || (status == WL_CONNECTED)) {
+      if (wifiLink.failures > 0 || wifiLink.reconnects > 0) {
+        LOG_STATUS("WiFi back after %d failed attempts", wifiLink.failures);
+      }
+      wifiLink.failures = 0;
+      wifiLink.gotIP = false;
+      wifiLink.lostLink = false;
+      setWiFiState(WIFI_STATE_CONNECTED);
+#ifdef FAST_BOOT
+      wifiCache.inUse = false;
+      saveWiFiCache();
+#endif
+      // log the mac address
+      byte mac[6];
+      WiFi.macAddress(mac);
+      LOG_STATUS("MAC Address: ");
+      logByteArrayAsHex(mac,6);
+      // connection complete
+      LOG_STATUS("Connected to WiFi.");
+      return true;
+    }
+    if ((status == WL_CONNECT_FAILED) || (status == WL_NO_SSID_AVAIL) || wifiLink.lostLink
+        || (millis() - wifiLink.stateSince >= wiFiAttemptTimeoutMs())) {
+      backOffWiFi(status);
+    }
+    return false;
+
+  case WIFI_STATE_CONNECTED:
+    if (wifiLink.lostLink || (status != WL_CONNECTED)) {
+      LOG_ERROR("WiFi link lost");
+      wifiLink.reconnects++;
+      backOffWiFi(status);
+      return false;
+    }
+    return true;
+
+  case WIFI_STATE_BACKOFF:
+  default:
+    if ((long)(millis() - wifiLink.nextAttemptAt) >= 0) {
+      startWiFiAttempt();
+    }
+    return false;
+  }
+}
+
+void setupWiFi()
+{
   #ifdef ARDUINO_ARCH_SAMD
+    int status = WiFi.status();
     if (status == WL_NO_SHIELD)
     {
       logSuspend("WiFi shield missing!");
@@ -111,12 +347,35 @@ void setupWiFi()
     }
     if (WiFi.firmwareVersion() < WIFI_FIRMWARE_LATEST_VERSION)
     {
-      logStatus("Please upgrade WiFi firmware!");
+      LOG_STATUS("Please upgrade WiFi firmware!");
     }
   #endif
 
-  resetWiFi();
+  #ifdef ARDUINO_ARCH_SAMD
+    // begin() waits this long for the connection, keep it short and let the state machine do the waiting
+    WiFi.setTimeout(WIFI_BEGIN_TIMEOUT_MS);
+    // random() isn't seeded by the core on the SAMD, without this every board backs off in step
+    randomSeed(*(uint32_t*)0x0080A00C ^ micros());   // the chip's serial number word, as in getUniqueChipID()
+  #endif
+
+  #ifdef ARDUINO_ARCH_ESP32
+    // we do our own reconnecting with a backoff, so stop the driver doing it underneath us
+    WiFi.setAutoReconnect(false);
+    WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+  #endif
+
+  resetWiFi();     // the one switch from BLE to WiFi
+#ifdef FAST_BOOT
+  // start the first join and carry on, the loop sees it through
+  loadWiFiCache();
   connectToWiFi();
+#else
+  // wait for the first connection, everything else in setup needs the network
+  while (!connectToWiFi()) {
+    delay(100);
+  }
+#endif
 }
 
 // helper functions
@@ -0,0 +1,91 @@
+// ----[WINDOW STATISTICS MODULE]-----
+// summarises high rate samples of a value (min, max, mean and rms) at the end of each window.
+// The summary is what gets published, so a value can be sampled every second while only one set
+// of figures a minute goes over MQTT.
+//
+// none of the figures depend on the order of the samples, so rather than hold the samples the
+// window keeps a running min, max, sum and sum of squares.  That is a couple of dozen bytes a
+// window whatever the sample rate, where a buffer of the samples was a few hundred per meter.
+
+#pragma once
+
+#include <Arduino.h>
+
+struct WindowSummaryType {
+  float minimum = 0.0;
+  float maximum = 0.0;
+  float mean = 0.0;
+  float rms = 0.0;
+  uint16_t samples = 0;             // 0 if nothing was sampled in the window
+};
+
+// the summary figures by index, for publishing them in a loop
+#define WINDOW_SUMMARY_COUNT  4
+constexpr const char* windowSummaryKeys[WINDOW_SUMMARY_COUNT]  = { "Min", "Max", "Mean", "Rms" };      // appended to the field key
+constexpr const char* windowSummaryNames[WINDOW_SUMMARY_COUNT] = { " Min", " Max", " Mean", " RMS" };  // appended to the field name
+
+float windowSummaryValue(const WindowSummaryType& summary, uint8_t index) {
+  switch (index) {
+    case 0: return summary.minimum;
+    case 1: return summary.maximum;
+    case 2: return summary.mean;
+    default: return summary.rms;
+  }
+}
+
+class SampleWindowType {
+public:
+  unsigned long windowMs = 60000;   // length of a window
+
+  void add(float value) {
+    if ((this->count == 0) || (value < this->minimum)) {
+      this->minimum = value;
+    }
+    if ((this->count == 0) || (value > this->maximum)) {
+      this->maximum = value;
+    }
+    // a window that long (over 18 hours at one a second) keeps its min and max going, but the mean
+    // and rms stay on the samples counted so the sums and the count can't drift apart
+    if (this->count < UINT16_MAX) {
+      this->total += value;
+      this->totalSquares += value * value;
+      this->count++;
+    }
+  }
+
+  // has the current window run its length (the first window starts with the first call)
+  bool windowComplete(unsigned long now) {
+    if (!this->started) {
+      this->started = true;
+      this->windowStartMs = now;
+    }
+    return now - this->windowStartMs >= this->windowMs;
+  }
+
+  // summarise the samples in the window, then start the next window
+  WindowSummaryType close(unsigned long now) {
+    WindowSummaryType summary;
+    if (this->count > 0) {
+      summary.minimum = this->minimum;
+      summary.maximum = this->maximum;
+      summary.mean = this->total / this->count;
+      summary.rms = sqrtf(this->totalSquares / this->count);
+      summary.samples = this->count;
+    }
+
+    this->count = 0;
+    this->total = 0.0;
+    this->totalSquares = 0.0;
+    this->windowStartMs = now;
+    return summary;
+  }
+
+private:
+  float minimum = 0.0;
+  float maximum = 0.0;
+  float total = 0.0;
+  float totalSquares = 0.0;
+  uint16_t count = 0;               // samples taken in the window
+  unsigned long windowStartMs = 0;
+  bool started = false;
+};